@@ -33,6 +33,10 @@
 #define DROPBEAR_MODE_CBC 1
 #define DROPBEAR_MODE_CTR 2
 
+/* direction argument for dropbear_cipher_mode.aead_crypt */
+#define DROPBEAR_ENCRYPT 0
+#define DROPBEAR_DECRYPT 1
+
 struct Algo_Type {
 
 	const char *name; /* identifying name */
@@ -56,6 +60,9 @@ extern algo_type ssh_nocompress[];
 
 extern const struct dropbear_cipher dropbear_nocipher;
 extern const struct dropbear_cipher_mode dropbear_mode_none;
+#if DROPBEAR_ENABLE_CTR_MODE
+extern const struct dropbear_cipher_mode dropbear_mode_ctr;
+#endif
 extern const struct dropbear_hash dropbear_nohash;
 
 struct dropbear_cipher {
@@ -72,6 +79,22 @@ struct dropbear_cipher_mode {
 			unsigned long len, void *cipher_state);
 	int (*decrypt)(const unsigned char *ct, unsigned char *pt, 
 			unsigned long len, void *cipher_state);
+	/* AEAD modes encrypt/decrypt and authenticate the whole packet in one
+	 * call, len is the packet length including the length field and
+	 * the taglen byte tag follows it. NULL for other modes. */
+	int (*aead_crypt)(unsigned int seq,
+			const unsigned char *in, unsigned char *out,
+			unsigned long len, unsigned long taglen,
+			void *cipher_state, int direction);
+	/* decrypt only the packet length field, from the first block */
+	int (*aead_getlength)(unsigned int seq,
+			const unsigned char *in, unsigned int *outlen,
+			unsigned long len, void *cipher_state);
+	/* the tag is used in place of the negotiated MAC */
+	const struct dropbear_hash *aead_mac;
+	/* release anything held by cipher_state once the keys are replaced,
+	 * NULL if there is nothing */
+	void (*cleanup)(void *cipher_state);
 };
 
 struct dropbear_hash {
@@ -80,6 +103,11 @@ struct dropbear_hash {
 	/* hashsize may be truncated from the size returned by hash_desc,
 	   eg sha1-96 */
 	const unsigned char hashsize;
+	/* encrypt-then-mac: the packet length is sent in the clear and the
+	   mac covers the ciphertext */
+	const unsigned char etm;
+	/* UMAC rather than HMAC, hash_desc is unused */
+	const unsigned char umac;
 };
 
 enum dropbear_kex_mode {
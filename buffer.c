@@ -66,6 +66,106 @@ void buf_free(buffer* buf) {
 	m_free(buf);
 }
 
+/* Transport packet buffers are kept on free lists, one per power of two
+ * size class, so that a bulk transfer doesn't malloc and free for every
+ * packet. Larger buffers and those beyond the list depth are freed as
+ * usual. */
+#define BUF_POOL_MIN_SHIFT 7 /* 128 bytes */
+#define BUF_POOL_CLASSES 13 /* up to 512kB, for -M jumbo packets */
+#define BUF_POOL_DEPTH 8
+
+static buffer *buf_pool[BUF_POOL_CLASSES];
+static unsigned int buf_pool_len[BUF_POOL_CLASSES];
+
+/* Returns BUF_POOL_CLASSES if size is too large to pool */
+static unsigned int buf_pool_class(unsigned int size) {
+	unsigned int class = 0;
+	while (class < BUF_POOL_CLASSES 
+			&& (1U << (BUF_POOL_MIN_SHIFT + class)) < size) {
+		class++;
+	}
+	return class;
+}
+
+/* Get an empty buffer of at least size bytes */
+buffer* buf_pool_new(unsigned int size) {
+
+	unsigned int class;
+	buffer* buf;
+
+	class = buf_pool_class(size);
+	if (class == BUF_POOL_CLASSES) {
+		return buf_new(size);
+	}
+
+	buf = buf_pool[class];
+	if (buf) {
+		buf_pool[class] = buf->next;
+		buf_pool_len[class]--;
+		buf->next = NULL;
+		buf->len = 0;
+		buf->pos = 0;
+	} else {
+		buf = buf_new(1U << (BUF_POOL_MIN_SHIFT + class));
+	}
+	return buf;
+}
+
+/* Grow a pooled buffer, keeping its contents, len and pos. 
+ * Possibly returns a new buffer* */
+buffer* buf_pool_resize(buffer *buf, unsigned int newsize) {
+
+	buffer* ret;
+
+	if (newsize <= buf->size) {
+		return buf;
+	}
+	ret = buf_pool_new(newsize);
+	memcpy(ret->data, buf->data, buf->len);
+	ret->len = buf->len;
+	ret->pos = buf->pos;
+	buf_pool_free(buf);
+	return ret;
+}
+
+/* Return a buffer to the pool */
+void buf_pool_free(buffer* buf) {
+
+	unsigned int class;
+
+	if (buf == NULL) {
+		return;
+	}
+
+	class = buf_pool_class(buf->size);
+	if (class == BUF_POOL_CLASSES
+			|| buf->size != (1U << (BUF_POOL_MIN_SHIFT + class))
+			|| buf_pool_len[class] >= BUF_POOL_DEPTH) {
+		buf_free(buf);
+		return;
+	}
+
+	buf->next = buf_pool[class];
+	buf_pool[class] = buf;
+	buf_pool_len[class]++;
+}
+
+/* Clear and free the pooled buffers */
+void buf_pool_cleanup() {
+
+	unsigned int class;
+	buffer* buf;
+
+	for (class = 0; class < BUF_POOL_CLASSES; class++) {
+		while ((buf = buf_pool[class]) != NULL) {
+			buf_pool[class] = buf->next;
+			buf_burn(buf);
+			buf_free(buf);
+		}
+		buf_pool_len[class] = 0;
+	}
+}
+
 /* overwrite the contents of the buffer to clear it */
 void buf_burn(buffer* buf) {
 	
@@ -89,6 +189,29 @@ buffer* buf_resize(buffer *buf, unsigned int newsize) {
 	return buf;
 }
 
+/* Set up view to use the free space after buf->len, without copying.
+ * It is only valid until buf is next resized */
+void buf_tailview(buffer *view, buffer *buf) {
+	view->data = buf->data + buf->len;
+	view->size = buf->size - buf->len;
+	view->len = 0;
+	view->pos = 0;
+	view->next = NULL;
+}
+
+/* Set up view to use size bytes of buf from offset, without copying.
+ * It is only valid until buf is next resized */
+void buf_subview(buffer *view, buffer *buf, unsigned int offset, unsigned int size) {
+	if (offset > buf->size || size > buf->size - offset) {
+		dropbear_exit("Bad buf_subview");
+	}
+	view->data = buf->data + offset;
+	view->size = size;
+	view->len = 0;
+	view->pos = 0;
+	view->next = NULL;
+}
+
 /* Create a copy of buf, allocating required memory etc. */
 /* The new buffer is sized the same as the length of the source buffer. */
 buffer* buf_newcopy(buffer* buf) {
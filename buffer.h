@@ -35,6 +35,7 @@ struct buf {
 	unsigned int len; /* the used size */
 	unsigned int pos;
 	unsigned int size; /* the memory size */
+	struct buf * next; /* link while on a pool free list */
 
 };
 
@@ -44,7 +45,15 @@ buffer * buf_new(unsigned int size);
 /* Possibly returns a new buffer*, like realloc() */
 buffer * buf_resize(buffer *buf, unsigned int newsize);
 void buf_free(buffer* buf);
+/* Pooled buffers for the transport packet path, reused rather than
+ * freed. buf_pool_free() also accepts buffers from buf_new() */
+buffer * buf_pool_new(unsigned int size);
+buffer * buf_pool_resize(buffer *buf, unsigned int newsize);
+void buf_pool_free(buffer* buf);
+void buf_pool_cleanup(void);
 void buf_burn(buffer* buf);
+void buf_tailview(buffer *view, buffer *buf);
+void buf_subview(buffer *view, buffer *buf, unsigned int offset, unsigned int size);
 buffer* buf_newcopy(buffer* buf);
 void buf_setlen(buffer* buf, unsigned int len);
 void buf_incrlen(buffer* buf, unsigned int incr);
@@ -37,7 +37,15 @@
 /* Not a real type */
 #define SSH_OPEN_IN_PROGRESS					99
 
-#define CHAN_EXTEND_SIZE 3 /* how many extra slots to add when we need more */
+#define CHAN_INITIAL_SIZE 4 /* channel slots to start with, doubled when full */
+#define CHANNEL_TX_QUANTUM 32768 /* bytes a bulk channel may send in a turn */
+/* writequeue limit for channel data when no channel is interactive */
+#define CHANNEL_TX_BATCH (8*TRANS_MAX_PAYLOAD_LEN)
+/* how long to wait for more output from an exited process, milliseconds */
+#define CHANNEL_FLUSH_WAIT 10
+/* a channel's round trip time estimate is replaced after this long,
+ * in case the path changed */
+#define RECV_RTT_EXPIRY (10*1000000)
 
 struct ChanType;
 
@@ -53,6 +61,8 @@ struct Channel {
 	unsigned int index; /* the local channel index */
 	unsigned int remotechan;
 	unsigned int recvwindow, transwindow;
+	unsigned int recvwindowsize; /* the full receive window, opts.recv_window
+									unless it has been tuned */
 	unsigned int recvdonelen;
 	unsigned int recvmaxpacket, transmaxpacket;
 	void* typedata; /* a pointer to type specific data */
@@ -89,6 +99,39 @@ struct Channel {
 	const struct ChanType* type;
 
 	enum dropbear_channel_prio prio;
+	enum dropbear_channel_prio counted_prio; /* in ses.chan_prio_count */
+
+	unsigned int active_pos; /* position in ses.chan_active */
+	int events_dirty; /* on ses.chan_dirty */
+	unsigned int io_round;
+
+#if DROPBEAR_RECV_WINDOW_AUTOTUNE
+	unsigned int recvtotal; /* bytes received, wraps */
+	/* bytes consumed since recvtune_time, a monotonic_now_us() */
+	uint64_t recvtune_time;
+	uint64_t recvtune_bytes;
+	/* when an adjust was sent, and how far the peer could send before it */
+	uint64_t recvprobe_time;
+	unsigned int recvprobe_edge;
+	/* least round trip time seen, microseconds, and when */
+	unsigned int recvrtt;
+	uint64_t recvrtt_time;
+#endif
+
+	/* while on ses.chan_txq, waiting for a turn to send */
+	struct Channel *tx_next, *tx_prev;
+	size_t tx_deficit;
+
+	/* interactive output coalescing. When readfd was last read, and
+	 * while on ses.chan_held, when reading it resumes */
+	uint64_t tx_last_time;
+	uint64_t tx_hold_until;
+	struct Channel *hold_next;
+
+	/* after the process exited, while on ses.chan_flush, when its fds
+	 * are closed unless more output arrives */
+	uint64_t flush_until;
+	struct Channel *flush_next;
 };
 
 struct ChanType {
@@ -106,8 +149,10 @@ void channel_connect_done(int result, int sock, void* user_data, const char* err
 
 void chaninitialise(const struct ChanType *chantypes[]);
 void chancleanup(void);
-void setchannelfds(fd_set *readfds, fd_set *writefds, int allow_reads);
-void channelio(fd_set *readfd, fd_set *writefd);
+void update_channel_events(int allow_reads);
+void channelio(void);
+void channel_prio_changed(struct Channel *channel);
+long channel_timeout(void);
 struct Channel* getchannel(void);
 /* Returns an arbitrary channel that is in a ready state - not
 being initialised and no EOF in either direction. NULL if none. */
@@ -26,8 +26,67 @@
 #include "dbutil.h"
 #include "circbuffer.h"
 
+#if DROPBEAR_CBUF_DOUBLE_MAP
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#endif
+
 #define MAX_CBUF_SIZE 100000000
 
+/* Chunks freed by drained buffers are kept for reuse by any channel in the
+ * session, up to CBUF_POOL_DEPTH of them */
+#define CBUF_CHUNK_SIZE 32768
+#define CBUF_POOL_DEPTH 16
+
+struct cbuf_chunk {
+	struct cbuf_chunk *next;
+	unsigned char data[CBUF_CHUNK_SIZE];
+};
+
+static struct cbuf_chunk *cbuf_pool;
+static unsigned int cbuf_pool_len;
+
+static struct cbuf_chunk* cbuf_chunk_new() {
+
+	struct cbuf_chunk *chunk = cbuf_pool;
+
+	if (chunk) {
+		cbuf_pool = chunk->next;
+		cbuf_pool_len--;
+	} else {
+		chunk = (struct cbuf_chunk*)m_malloc(sizeof(struct cbuf_chunk));
+	}
+	chunk->next = NULL;
+	return chunk;
+}
+
+static void cbuf_chunk_free(struct cbuf_chunk *chunk) {
+
+	if (cbuf_pool_len >= CBUF_POOL_DEPTH) {
+		m_burn(chunk->data, CBUF_CHUNK_SIZE);
+		m_free(chunk);
+		return;
+	}
+	chunk->next = cbuf_pool;
+	cbuf_pool = chunk;
+	cbuf_pool_len++;
+}
+
+void cbuf_pool_cleanup() {
+
+	struct cbuf_chunk *chunk;
+
+	while ((chunk = cbuf_pool) != NULL) {
+		cbuf_pool = chunk->next;
+		m_burn(chunk->data, CBUF_CHUNK_SIZE);
+		m_free(chunk);
+	}
+	cbuf_pool_len = 0;
+}
+
 circbuffer * cbuf_new(unsigned int size) {
 
 	circbuffer *cbuf = NULL;
@@ -37,25 +96,157 @@ circbuffer * cbuf_new(unsigned int size) {
 	}
 
 	cbuf = (circbuffer*)m_malloc(sizeof(circbuffer));
-	/* data is malloced on first write */
+	/* storage is allocated on first write */
+	cbuf->head = NULL;
+	cbuf->tail = NULL;
 	cbuf->data = NULL;
 	cbuf->used = 0;
 	cbuf->readpos = 0;
 	cbuf->writepos = 0;
 	cbuf->size = size;
+	cbuf->wrap = 0;
+	cbuf->mapped = 0;
 
 	return cbuf;
 }
 
+#if DROPBEAR_CBUF_DOUBLE_MAP
+static int cbuf_map_failed;
+
+/* Maps a len byte memfd twice in a row, so that data running off the end
+ * of the first view continues in the second. len must be a multiple of the
+ * page size. Returns NULL on failure */
+static unsigned char* cbuf_map_twice(unsigned int len) {
+#ifdef __NR_memfd_create
+	unsigned char *base = NULL;
+	int fd;
+
+	fd = syscall(__NR_memfd_create, "dropbear-cbuf", MFD_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (ftruncate(fd, len) < 0) {
+		goto out;
+	}
+
+	/* reserve the address range, then put both views over it */
+	base = mmap(NULL, 2*(size_t)len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		base = NULL;
+		goto out;
+	}
+	if (mmap(base, len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+			|| mmap(base + len, len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(base, 2*(size_t)len);
+		base = NULL;
+	}
+
+out:
+	m_close(fd);
+	return base;
+#else
+	(void)len;
+	return NULL;
+#endif
+}
+
+/* Maps storage for cbuf->size bytes. Returns DROPBEAR_FAILURE if chunks
+ * should be used instead */
+static int cbuf_map(circbuffer * cbuf) {
+
+	const unsigned int page = sysconf(_SC_PAGESIZE);
+	const unsigned int len = (cbuf->size + page - 1) / page * page;
+
+	if (len == 0 || cbuf_map_failed) {
+		return DROPBEAR_FAILURE;
+	}
+	cbuf->data = cbuf_map_twice(len);
+	if (cbuf->data == NULL) {
+		/* don't keep trying */
+		TRACE(("cbuf_map: double mapping failed, %s", strerror(errno)))
+		cbuf_map_failed = 1;
+		return DROPBEAR_FAILURE;
+	}
+	cbuf->wrap = len;
+	cbuf->mapped = 1;
+	return DROPBEAR_SUCCESS;
+}
+
+static void cbuf_unmap(unsigned char *data, unsigned int wrap) {
+
+	m_burn(data, wrap);
+	munmap(data, 2*(size_t)wrap);
+}
+#endif /* DROPBEAR_CBUF_DOUBLE_MAP */
+
+/* Return all chunks, once the buffer is empty */
+static void cbuf_release_chunks(circbuffer * cbuf) {
+
+	struct cbuf_chunk *chunk;
+
+	while ((chunk = cbuf->head) != NULL) {
+		cbuf->head = chunk->next;
+		cbuf_chunk_free(chunk);
+	}
+	cbuf->tail = NULL;
+	cbuf->readpos = 0;
+	cbuf->writepos = 0;
+}
+
 void cbuf_free(circbuffer * cbuf) {
 
-	if (cbuf->data) {
-		m_burn(cbuf->data, cbuf->size);
-		m_free(cbuf->data);
+#if DROPBEAR_CBUF_DOUBLE_MAP
+	if (cbuf->mapped) {
+		cbuf_unmap(cbuf->data, cbuf->wrap);
 	}
+#endif
+	cbuf_release_chunks(cbuf);
 	m_free(cbuf);
 }
 
+void cbuf_resize(circbuffer * cbuf, unsigned int size) {
+
+	if (size > MAX_CBUF_SIZE || size < cbuf->used) {
+		dropbear_exit("Bad cbuf size");
+	}
+
+#if DROPBEAR_CBUF_DOUBLE_MAP
+	if (cbuf->mapped) {
+		/* the contents are moved to the start of a new mapping, or into
+		 * chunks if that fails */
+		unsigned char *olddata = cbuf->data;
+		const unsigned int oldwrap = cbuf->wrap;
+		const unsigned int oldread = cbuf->readpos;
+		const unsigned int used = cbuf->used;
+		unsigned int len;
+
+		cbuf->size = size;
+		cbuf->data = NULL;
+		cbuf->mapped = 0;
+		cbuf->used = 0;
+		cbuf->readpos = 0;
+		cbuf->writepos = 0;
+		if (cbuf_map(cbuf) == DROPBEAR_SUCCESS) {
+			memcpy(cbuf->data, &olddata[oldread], used);
+			cbuf_incrwrite(cbuf, used);
+		} else {
+			for (len = 0; len < used; ) {
+				unsigned int n = MIN(cbuf_writelen(cbuf), used - len);
+				memcpy(cbuf_writeptr(cbuf, n), &olddata[oldread + len], n);
+				cbuf_incrwrite(cbuf, n);
+				len += n;
+			}
+		}
+		cbuf_unmap(olddata, oldwrap);
+		return;
+	}
+#endif
+	/* chunks are allocated as needed, only the limit changes */
+	cbuf->size = size;
+}
+
 unsigned int cbuf_getused(circbuffer * cbuf) {
 
 	return cbuf->used;
@@ -70,51 +261,96 @@ unsigned int cbuf_getavail(circbuffer * cbuf) {
 
 unsigned int cbuf_writelen(circbuffer *cbuf) {
 
+	unsigned int len;
+
 	dropbear_assert(cbuf->used <= cbuf->size);
-	dropbear_assert(((2*cbuf->size)+cbuf->writepos-cbuf->readpos)%cbuf->size == cbuf->used%cbuf->size);
-	dropbear_assert(((2*cbuf->size)+cbuf->readpos-cbuf->writepos)%cbuf->size == (cbuf->size-cbuf->used)%cbuf->size);
+
+	if (cbuf->mapped) {
+		/* free space is always contiguous */
+		return cbuf->size - cbuf->used;
+	}
 
 	if (cbuf->used == cbuf->size) {
 		TRACE(("cbuf_writelen: full buffer"))
 		return 0; /* full */
 	}
-	
-	if (cbuf->writepos < cbuf->readpos) {
-		return cbuf->readpos - cbuf->writepos;
-	}
 
-	return cbuf->size - cbuf->writepos;
+	if (cbuf->tail == NULL || cbuf->writepos == CBUF_CHUNK_SIZE) {
+		/* a new chunk */
+		len = CBUF_CHUNK_SIZE;
+	} else {
+		len = CBUF_CHUNK_SIZE - cbuf->writepos;
+	}
+	return MIN(len, cbuf->size - cbuf->used);
 }
 
 void cbuf_readptrs(circbuffer *cbuf, 
 	unsigned char **p1, unsigned int *len1, 
 	unsigned char **p2, unsigned int *len2) {
-	*p1 = &cbuf->data[cbuf->readpos];
-	*len1 = MIN(cbuf->used, cbuf->size - cbuf->readpos);
 
-	if (*len1 < cbuf->used) {
-		*p2 = cbuf->data;
-		*len2 = cbuf->used - *len1;
-	} else {
-		*p2 = NULL;
-		*len2 = 0;
+	struct cbuf_chunk *next;
+
+	*p2 = NULL;
+	*len2 = 0;
+
+	if (cbuf->mapped) {
+		*p1 = &cbuf->data[cbuf->readpos];
+		*len1 = cbuf->used;
+		return;
+	}
+
+	if (cbuf->used == 0) {
+		*p1 = NULL;
+		*len1 = 0;
+		return;
+	}
+
+	*p1 = &cbuf->head->data[cbuf->readpos];
+	*len1 = MIN(cbuf->used, CBUF_CHUNK_SIZE - cbuf->readpos);
+
+	next = cbuf->head->next;
+	if (*len1 < cbuf->used && next) {
+		*p2 = next->data;
+		*len2 = MIN(cbuf->used - *len1, CBUF_CHUNK_SIZE);
 	}
 }
 
 unsigned char* cbuf_writeptr(circbuffer *cbuf, unsigned int len) {
 
+	struct cbuf_chunk *chunk;
+
 	if (len > cbuf_writelen(cbuf)) {
 		dropbear_exit("Bad cbuf write");
 	}
 
-	if (!cbuf->data) {
+#if DROPBEAR_CBUF_DOUBLE_MAP
+	if (!cbuf->mapped && cbuf->head == NULL) {
 		/* lazy allocation */
-		cbuf->data = (unsigned char*)m_malloc(cbuf->size);
+		cbuf_map(cbuf);
+	}
+	if (cbuf->mapped) {
+		return &cbuf->data[cbuf->writepos];
+	}
+#endif
+
+	if (len > 0 && (cbuf->tail == NULL || cbuf->writepos == CBUF_CHUNK_SIZE)) {
+		chunk = cbuf_chunk_new();
+		if (cbuf->tail) {
+			cbuf->tail->next = chunk;
+		} else {
+			cbuf->head = chunk;
+		}
+		cbuf->tail = chunk;
+		cbuf->writepos = 0;
 	}
 
-	return &cbuf->data[cbuf->writepos];
+	if (cbuf->tail == NULL) {
+		return NULL;
+	}
+	return &cbuf->tail->data[cbuf->writepos];
 }
 
+/* len is at most size, so positions wrap at most once */
 void cbuf_incrwrite(circbuffer *cbuf, unsigned int len) {
 	if (len > cbuf_writelen(cbuf)) {
 		dropbear_exit("Bad cbuf write");
@@ -122,12 +358,44 @@ void cbuf_incrwrite(circbuffer *cbuf, unsigned int len) {
 
 	cbuf->used += len;
 	dropbear_assert(cbuf->used <= cbuf->size);
-	cbuf->writepos = (cbuf->writepos + len) % cbuf->size;
+	cbuf->writepos += len;
+	if (cbuf->mapped && cbuf->writepos >= cbuf->wrap) {
+		cbuf->writepos -= cbuf->wrap;
+	}
 }
 
 
 void cbuf_incrread(circbuffer *cbuf, unsigned int len) {
+
+	struct cbuf_chunk *chunk;
+	unsigned int n;
+
 	dropbear_assert(cbuf->used >= len);
 	cbuf->used -= len;
-	cbuf->readpos = (cbuf->readpos + len) % cbuf->size;
+
+	if (cbuf->mapped) {
+		cbuf->readpos += len;
+		if (cbuf->readpos >= cbuf->wrap) {
+			cbuf->readpos -= cbuf->wrap;
+		}
+		return;
+	}
+
+	if (cbuf->used == 0) {
+		/* drained, give the memory back */
+		cbuf_release_chunks(cbuf);
+		return;
+	}
+
+	while (len > 0) {
+		n = MIN(len, CBUF_CHUNK_SIZE - cbuf->readpos);
+		cbuf->readpos += n;
+		len -= n;
+		if (cbuf->readpos == CBUF_CHUNK_SIZE) {
+			chunk = cbuf->head;
+			cbuf->head = chunk->next;
+			cbuf_chunk_free(chunk);
+			cbuf->readpos = 0;
+		}
+	}
 }
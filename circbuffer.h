@@ -24,25 +24,44 @@
 
 #ifndef DROPBEAR_CIRCBUFFER_H_
 #define DROPBEAR_CIRCBUFFER_H_
+
+struct cbuf_chunk;
+
+/* Data is stored in a list of fixed size chunks, taken from a pool as data
+ * is queued and returned as it is read, so a buffer only holds memory for
+ * what it contains. size is the limit. With DROPBEAR_CBUF_DOUBLE_MAP
+ * the storage is instead a single double-mapped area of size bytes */
 struct circbuf {
 
 	unsigned int size;
-	unsigned int readpos;
-	unsigned int writepos;
+	unsigned int readpos; /* in head, or data */
+	unsigned int writepos; /* in tail, or data */
 	unsigned int used;
+	struct cbuf_chunk *head;
+	struct cbuf_chunk *tail;
 	unsigned char* data;
+	/* readpos and writepos wrap at this when the data is mapped twice,
+	 * the length of one mapping (size rounded up to a page) */
+	unsigned int wrap;
+	int mapped;
 };
 
 typedef struct circbuf circbuffer;
 
 circbuffer * cbuf_new(unsigned int size);
 void cbuf_free(circbuffer * cbuf);
+/* Change the capacity, which must be at least what is stored */
+void cbuf_resize(circbuffer * cbuf, unsigned int size);
+/* Clear and free the pooled chunks */
+void cbuf_pool_cleanup(void);
 
 unsigned int cbuf_getused(circbuffer * cbuf); /* how much data stored */
 unsigned int cbuf_getavail(circbuffer * cbuf); /* how much we can write */
 unsigned int cbuf_writelen(circbuffer *cbuf); /* max linear write len */
 
-/* returns pointers to the two portions of the circular buffer that can be read */
+/* returns pointers to the first two contiguous portions of the data that
+ * can be read. These may not cover all of it. The second is always empty
+ * for a buffer that is mapped twice */
 void cbuf_readptrs(circbuffer *cbuf, 
 	unsigned char **p1, unsigned int *len1, 
 	unsigned char **p2, unsigned int *len2);
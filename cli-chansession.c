@@ -255,9 +255,9 @@ void cli_chansess_winchange() {
 	unsigned int i;
 	struct Channel *channel = NULL;
 
-	for (i = 0; i < ses.chansize; i++) {
-		channel = ses.channels[i];
-		if (channel != NULL && channel->type == &clichansess) {
+	for (i = 0; i < ses.chancount; i++) {
+		channel = ses.chan_active[i];
+		if (channel->type == &clichansess) {
 			CHECKCLEARTOWRITE();
 			buf_putbyte(ses.writepayload, SSH_MSG_CHANNEL_REQUEST);
 			buf_putint(ses.writepayload, channel->remotechan);
@@ -342,7 +342,7 @@ static int cli_init_stdpipe_sess(struct Channel *channel) {
 	channel->errfd = STDERR_FILENO;
 	setnonblocking(STDERR_FILENO);
 
-	channel->extrabuf = cbuf_new(opts.recv_window);
+	channel->extrabuf = cbuf_new(channel->recvwindowsize);
 	return 0;
 }
 
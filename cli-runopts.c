@@ -80,6 +80,7 @@ static void printhelp() {
 					"-R <[listenaddress:]listenport:remotehost:remoteport> Remote port forwarding\n"
 #endif
 					"-W <receive_window_buffer> (default %d, larger may be faster, max 1MB)\n"
+					"-M <max_packet>  (default %d, larger may be faster, max %d)\n"
 					"-K <keepalive>  (0 is never, default %d)\n"
 					"-I <idle_timeout>  (0 is never, default %d)\n"
 #if DROPBEAR_CLI_NETCAT
@@ -100,7 +101,8 @@ static void printhelp() {
 #if DROPBEAR_CLI_PUBKEY_AUTH
 					DROPBEAR_DEFAULT_CLI_AUTHKEY,
 #endif
-					DEFAULT_RECV_WINDOW, DEFAULT_KEEPALIVE, DEFAULT_IDLE_TIMEOUT);
+					DEFAULT_RECV_WINDOW, RECV_MAX_PAYLOAD_LEN, MAX_JUMBO_PAYLOAD_LEN,
+					DEFAULT_KEEPALIVE, DEFAULT_IDLE_TIMEOUT);
 					
 }
 
@@ -128,6 +130,7 @@ void cli_getopts(int argc, char ** argv) {
 	char* dummy = NULL; /* Not used for anything real */
 
 	char* recv_window_arg = NULL;
+	char* max_payload_arg = NULL;
 	char* keepalive_arg = NULL;
 	char* idle_timeout_arg = NULL;
 	char *host_arg = NULL;
@@ -181,6 +184,8 @@ void cli_getopts(int argc, char ** argv) {
 	opts.ipv6 = 1;
 	*/
 	opts.recv_window = DEFAULT_RECV_WINDOW;
+	opts.recv_max_payload = RECV_MAX_PAYLOAD_LEN;
+	opts.trans_max_payload = TRANS_MAX_PAYLOAD_LEN;
 	opts.keepalive_secs = DEFAULT_KEEPALIVE;
 	opts.idle_timeout_secs = DEFAULT_IDLE_TIMEOUT;
 
@@ -272,6 +277,9 @@ void cli_getopts(int argc, char ** argv) {
 				case 'W':
 					next = &recv_window_arg;
 					break;
+				case 'M':
+					next = &max_payload_arg;
+					break;
 				case 'K':
 					next = &keepalive_arg;
 					break;
@@ -441,6 +449,10 @@ void cli_getopts(int argc, char ** argv) {
 			dropbear_exit("Bad recv window '%s'", recv_window_arg);
 		}
 	}
+
+	if (max_payload_arg) {
+		parse_max_payload(max_payload_arg);
+	}
 	if (keepalive_arg) {
 		unsigned int val;
 		if (m_str_to_uint(keepalive_arg, &val) == DROPBEAR_FAILURE) {
@@ -512,7 +524,7 @@ multihop_passthrough_args() {
 	int total;
 	unsigned int len = 0;
 	m_list_elem *iter;
-	/* Fill out -i, -y, -W options that make sense for all
+	/* Fill out -i, -y, -W, -M options that make sense for all
 	 * the intermediate processes */
 #if DROPBEAR_CLI_PUBKEY_AUTH
 	for (iter = cli_opts.privkeys->first; iter; iter = iter->next)
@@ -522,7 +534,7 @@ multihop_passthrough_args() {
 	}
 #endif /* DROPBEAR_CLI_PUBKEY_AUTH */
 
-	len += 30; /* space for -W <size>, terminator. */
+	len += 50; /* space for -W <size>, -M <size>, terminator. */
 	ret = m_malloc(len);
 	total = 0;
 
@@ -543,6 +555,12 @@ multihop_passthrough_args() {
 		total += written;
 	}
 
+	if (opts.recv_max_payload != RECV_MAX_PAYLOAD_LEN)
+	{
+		int written = snprintf(ret+total, len-total, "-M %u ", opts.recv_max_payload);
+		total += written;
+	}
+
 #if DROPBEAR_CLI_PUBKEY_AUTH
 	for (iter = cli_opts.privkeys->first; iter; iter = iter->next)
 	{
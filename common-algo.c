@@ -30,6 +30,9 @@
 #include "dh_groups.h"
 #include "ltc_prng.h"
 #include "ecc.h"
+#include "chachapoly.h"
+#include "gcm.h"
+#include "ctrmt.h"
 
 /* This file (algo.c) organises the ciphers which can be used, and is used to
  * decide which ciphers/hashes/compression/signing to use during key exchange*/
@@ -86,11 +89,11 @@ const struct dropbear_cipher dropbear_nocipher =
  * about the symmetric_CBC vs symmetric_CTR cipher_state pointer */
 #if DROPBEAR_ENABLE_CBC_MODE
 const struct dropbear_cipher_mode dropbear_mode_cbc =
-	{(void*)cbc_start, (void*)cbc_encrypt, (void*)cbc_decrypt};
+	{(void*)cbc_start, (void*)cbc_encrypt, (void*)cbc_decrypt, NULL, NULL, NULL, NULL};
 #endif /* DROPBEAR_ENABLE_CBC_MODE */
 
 const struct dropbear_cipher_mode dropbear_mode_none =
-	{void_start, void_cipher, void_cipher};
+	{void_start, void_cipher, void_cipher, NULL, NULL, NULL, NULL};
 
 #if DROPBEAR_ENABLE_CTR_MODE
 /* a wrapper to make ctr_start and cbc_start look the same */
@@ -101,35 +104,52 @@ static int dropbear_big_endian_ctr_start(int cipher,
 	return ctr_start(cipher, IV, key, keylen, num_rounds, CTR_COUNTER_BIG_ENDIAN, ctr);
 }
 const struct dropbear_cipher_mode dropbear_mode_ctr =
-	{(void*)dropbear_big_endian_ctr_start, (void*)ctr_encrypt, (void*)ctr_decrypt};
+	{(void*)dropbear_big_endian_ctr_start, (void*)ctr_encrypt, (void*)ctr_decrypt, NULL, NULL, NULL, NULL};
+
+/* AES counter mode keystream can be generated by worker threads */
+#if DROPBEAR_CTR_THREADS
+#define DROPBEAR_MODE_AES_CTR dropbear_mode_ctrmt
+#else
+#define DROPBEAR_MODE_AES_CTR dropbear_mode_ctr
+#endif
 #endif /* DROPBEAR_ENABLE_CTR_MODE */
 
 /* Mapping of ssh hashes to libtomcrypt hashes, including keysize etc.
-   {&hash_desc, keysize, hashsize} */
+   {&hash_desc, keysize, hashsize, etm, umac} */
 
 #if DROPBEAR_SHA1_HMAC
 static const struct dropbear_hash dropbear_sha1 = 
-	{&sha1_desc, 20, 20};
+	{&sha1_desc, 20, 20, 0, 0};
 #endif
 #if DROPBEAR_SHA1_96_HMAC
 static const struct dropbear_hash dropbear_sha1_96 = 
-	{&sha1_desc, 20, 12};
+	{&sha1_desc, 20, 12, 0, 0};
 #endif
 #if DROPBEAR_SHA2_256_HMAC
 static const struct dropbear_hash dropbear_sha2_256 = 
-	{&sha256_desc, 32, 32};
+	{&sha256_desc, 32, 32, 0, 0};
+static const struct dropbear_hash dropbear_sha2_256_etm = 
+	{&sha256_desc, 32, 32, 1, 0};
 #endif
 #if DROPBEAR_SHA2_512_HMAC
 static const struct dropbear_hash dropbear_sha2_512 =
-	{&sha512_desc, 64, 64};
+	{&sha512_desc, 64, 64, 0, 0};
+static const struct dropbear_hash dropbear_sha2_512_etm =
+	{&sha512_desc, 64, 64, 1, 0};
+#endif
+#if DROPBEAR_UMAC
+static const struct dropbear_hash dropbear_umac64_etm =
+	{NULL, 16, 8, 1, 1};
+static const struct dropbear_hash dropbear_umac128_etm =
+	{NULL, 16, 16, 1, 1};
 #endif
 #if DROPBEAR_MD5_HMAC
 static const struct dropbear_hash dropbear_md5 = 
-	{&md5_desc, 16, 16};
+	{&md5_desc, 16, 16, 0, 0};
 #endif
 
 const struct dropbear_hash dropbear_nohash =
-	{NULL, 16, 0}; /* used initially */
+	{NULL, 16, 0, 0, 0}; /* used initially */
 	
 
 /* The following map ssh names to internal values.
@@ -137,12 +157,23 @@ const struct dropbear_hash dropbear_nohash =
  * that is also supported by the server will get used. */
 
 algo_type sshciphers[] = {
+#if DROPBEAR_CHACHA20POLY1305
+	{"chacha20-poly1305@openssh.com", 0, &dropbear_chachapoly, 1, &dropbear_mode_chachapoly},
+#endif
+#if DROPBEAR_ENABLE_GCM_MODE
+#if DROPBEAR_AES128
+	{"aes128-gcm@openssh.com", 0, &dropbear_aes128, 1, &dropbear_mode_gcm},
+#endif
+#if DROPBEAR_AES256
+	{"aes256-gcm@openssh.com", 0, &dropbear_aes256, 1, &dropbear_mode_gcm},
+#endif
+#endif /* DROPBEAR_ENABLE_GCM_MODE */
 #if DROPBEAR_ENABLE_CTR_MODE
 #if DROPBEAR_AES128
-	{"aes128-ctr", 0, &dropbear_aes128, 1, &dropbear_mode_ctr},
+	{"aes128-ctr", 0, &dropbear_aes128, 1, &DROPBEAR_MODE_AES_CTR},
 #endif
 #if DROPBEAR_AES256
-	{"aes256-ctr", 0, &dropbear_aes256, 1, &dropbear_mode_ctr},
+	{"aes256-ctr", 0, &dropbear_aes256, 1, &DROPBEAR_MODE_AES_CTR},
 #endif
 #if DROPBEAR_TWOFISH_CTR
 /* twofish ctr is conditional as it hasn't been tested for interoperability, see options.h */
@@ -186,6 +217,16 @@ algo_type sshciphers[] = {
 };
 
 algo_type sshhashes[] = {
+#if DROPBEAR_UMAC
+	{"umac-64-etm@openssh.com", 0, &dropbear_umac64_etm, 1, NULL},
+	{"umac-128-etm@openssh.com", 0, &dropbear_umac128_etm, 1, NULL},
+#endif
+#if DROPBEAR_SHA2_256_HMAC
+	{"hmac-sha2-256-etm@openssh.com", 0, &dropbear_sha2_256_etm, 1, NULL},
+#endif
+#if DROPBEAR_SHA2_512_HMAC
+	{"hmac-sha2-512-etm@openssh.com", 0, &dropbear_sha2_512_etm, 1, NULL},
+#endif
 #if DROPBEAR_SHA1_96_HMAC
 	{"hmac-sha1-96", 0, &dropbear_sha1_96, 1, NULL},
 #endif
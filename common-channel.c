@@ -35,6 +35,7 @@
 #include "listener.h"
 #include "runopts.h"
 #include "netio.h"
+#include "event.h"
 
 static void send_msg_channel_open_failure(unsigned int remotechan, int reason,
 		const char *text, const char *lang);
@@ -45,13 +46,23 @@ static int writechannel(struct Channel* channel, int fd, circbuffer *cbuf,
 	const unsigned char *moredata, unsigned int *morelen);
 static void send_msg_channel_window_adjust(struct Channel *channel, 
 		unsigned int incr);
-static void send_msg_channel_data(struct Channel *channel, int isextended);
+static size_t channel_data_maxlen(struct Channel *channel, int isextended);
+static size_t send_msg_channel_data(struct Channel *channel, int isextended,
+		size_t maxlen);
 static void send_msg_channel_eof(struct Channel *channel);
 static void send_msg_channel_close(struct Channel *channel);
 static void remove_channel(struct Channel *channel);
 static unsigned int write_pending(struct Channel * channel);
 static void check_close(struct Channel *channel);
 static void close_chan_fd(struct Channel *channel, int fd, int how);
+static void channel_events_dirty(struct Channel *channel);
+static void channel_txq_remove(struct Channel *channel);
+#if DROPBEAR_RECV_WINDOW_AUTOTUNE
+static void channel_tune_window(struct Channel *channel);
+#endif
+static int channel_tx_space(void);
+static void channel_hold_remove(struct Channel *channel);
+static void channel_flush_remove(struct Channel *channel);
 
 #define FD_UNINIT (-2)
 #define FD_CLOSED (-1)
@@ -64,16 +75,58 @@ static void close_chan_fd(struct Channel *channel, int fd, int how);
  * 4 bytes uint32    recipient channel
  * 4 bytes string    data
  */
-#define RECV_MAX_CHANNEL_DATA_LEN (RECV_MAX_PAYLOAD_LEN-(1+4+4))
+#define RECV_MAX_CHANNEL_DATA_LEN (opts.recv_max_payload-(1+4+4))
+
+/* Extend the channel table, doubling it each time so that opening many
+ * channels costs amortised O(1). The new indexes go on the free list,
+ * lowest on top */
+static void grow_channels() {
+
+	unsigned int oldsize = ses.chansize;
+	unsigned int newsize, i;
+
+	newsize = MIN(MAX(oldsize * 2, CHAN_INITIAL_SIZE), MAX_CHANNELS);
+	ses.channels = (struct Channel**)m_realloc(ses.channels,
+			newsize*sizeof(struct Channel*));
+	ses.chan_free = (unsigned int*)m_realloc(ses.chan_free,
+			newsize*sizeof(unsigned int));
+	ses.chan_active = (struct Channel**)m_realloc(ses.chan_active,
+			newsize*sizeof(struct Channel*));
+	ses.chan_dirty = (unsigned int*)m_realloc(ses.chan_dirty,
+			newsize*sizeof(unsigned int));
+
+	for (i = newsize; i > oldsize; i--) {
+		ses.channels[i-1] = NULL;
+		ses.chan_free[ses.chan_freecount++] = i-1;
+	}
+	ses.chansize = newsize;
+}
 
 /* Initialise all the channels */
 void chaninitialise(const struct ChanType *chantypes[]) {
 
-	/* may as well create space for a single channel */
-	ses.channels = (struct Channel**)m_malloc(sizeof(struct Channel*));
-	ses.chansize = 1;
-	ses.channels[0] = NULL;
+	ses.channels = NULL;
+	ses.chansize = 0;
 	ses.chancount = 0;
+	ses.chan_free = NULL;
+	ses.chan_freecount = 0;
+	ses.chan_active = NULL;
+	ses.chan_dirty = NULL;
+	memset(ses.chan_prio_count, 0x0, sizeof(ses.chan_prio_count));
+	grow_channels();
+
+	ses.chan_dirtycount = 0;
+	ses.chan_events_all = 1;
+	ses.chan_reads_allowed = 0;
+	ses.chan_io_round = 0;
+	ses.chan_txq = NULL;
+	ses.chan_txqcount = 0;
+	ses.chan_held = NULL;
+	ses.chan_flush = NULL;
+#if DROPBEAR_RECV_WINDOW_AUTOTUNE
+	ses.chan_window_grown = 0;
+	ses.chan_window_pressure = 0;
+#endif
 
 	ses.chantypes = chantypes;
 
@@ -89,13 +142,15 @@ void chancleanup() {
 	unsigned int i;
 
 	TRACE(("enter chancleanup"))
-	for (i = 0; i < ses.chansize; i++) {
-		if (ses.channels[i] != NULL) {
-			TRACE(("channel %d closing", i))
-			remove_channel(ses.channels[i]);
-		}
+	/* backwards, since removing a channel moves the last one into its place */
+	for (i = ses.chancount; i > 0; i--) {
+		TRACE(("channel %d closing", ses.chan_active[i-1]->index))
+		remove_channel(ses.chan_active[i-1]);
 	}
 	m_free(ses.channels);
+	m_free(ses.chan_free);
+	m_free(ses.chan_active);
+	m_free(ses.chan_dirty);
 	TRACE(("leave chancleanup"))
 }
 
@@ -108,37 +163,19 @@ static struct Channel* newchannel(unsigned int remotechan,
 		unsigned int transwindow, unsigned int transmaxpacket) {
 
 	struct Channel * newchan;
-	unsigned int i, j;
+	unsigned int i;
 
 	TRACE(("enter newchannel"))
 	
-	/* first see if we can use existing channels */
-	for (i = 0; i < ses.chansize; i++) {
-		if (ses.channels[i] == NULL) {
-			break;
-		}
-	}
-
-	/* otherwise extend the list */
-	if (i == ses.chansize) {
+	if (ses.chan_freecount == 0) {
 		if (ses.chansize >= MAX_CHANNELS) {
 			TRACE(("leave newchannel: max chans reached"))
 			return NULL;
 		}
-
-		/* extend the channels */
-		ses.channels = (struct Channel**)m_realloc(ses.channels,
-				(ses.chansize+CHAN_EXTEND_SIZE)*sizeof(struct Channel*));
-
-		ses.chansize += CHAN_EXTEND_SIZE;
-
-		/* set the new channels to null */
-		for (j = i; j < ses.chansize; j++) {
-			ses.channels[j] = NULL;
-		}
-
+		grow_channels();
 	}
-	
+	i = ses.chan_free[--ses.chan_freecount];
+
 	newchan = (struct Channel*)m_malloc(sizeof(struct Channel));
 	newchan->type = type;
 	newchan->index = i;
@@ -159,6 +196,16 @@ static struct Channel* newchannel(unsigned int remotechan,
 
 	newchan->writebuf = cbuf_new(opts.recv_window);
 	newchan->recvwindow = opts.recv_window;
+	newchan->recvwindowsize = opts.recv_window;
+#if DROPBEAR_RECV_WINDOW_AUTOTUNE
+	newchan->recvtotal = 0;
+	newchan->recvtune_time = monotonic_now_us();
+	newchan->recvtune_bytes = 0;
+	newchan->recvprobe_time = 0;
+	newchan->recvprobe_edge = 0;
+	newchan->recvrtt = 0;
+	newchan->recvrtt_time = 0;
+#endif
 
 	newchan->extrabuf = NULL; /* The user code can set it up */
 	newchan->recvdonelen = 0;
@@ -166,8 +213,22 @@ static struct Channel* newchannel(unsigned int remotechan,
 
 	newchan->prio = DROPBEAR_CHANNEL_PRIO_EARLY; /* inithandler sets it */
 
+	newchan->counted_prio = DROPBEAR_CHANNEL_PRIO_EARLY;
+	newchan->events_dirty = 0;
+	newchan->io_round = 0;
+	newchan->tx_next = newchan->tx_prev = NULL;
+	newchan->tx_deficit = 0;
+	newchan->tx_last_time = 0;
+	newchan->tx_hold_until = 0;
+	newchan->hold_next = NULL;
+	newchan->flush_until = 0;
+	newchan->flush_next = NULL;
+
 	ses.channels[i] = newchan;
-	ses.chancount++;
+	newchan->active_pos = ses.chancount;
+	ses.chan_active[ses.chancount++] = newchan;
+	/* fds are set up by the caller */
+	channel_events_dirty(newchan);
 
 	TRACE(("leave newchannel"))
 
@@ -190,6 +251,8 @@ static struct Channel* getchannel_msg(const char* kind) {
 			dropbear_exit("Unknown channel %d", chan);
 		}
 	}
+	/* any message can change which fds the channel is waiting on */
+	channel_events_dirty(ses.channels[chan]);
 	return ses.channels[chan];
 }
 
@@ -197,65 +260,440 @@ struct Channel* getchannel() {
 	return getchannel_msg(NULL);
 }
 
-/* Iterate through the channels, performing IO if available */
-void channelio(fd_set *readfds, fd_set *writefds) {
+/* Whether fd was ready for reading in the last wait */
+static int channel_fd_readable(int fd) {
+	return fd >= 0 && (events_ready(fd) & DROPBEAR_EV_READ);
+}
 
-	/* Listeners such as TCP, X11, agent-auth */
-	struct Channel *channel;
-	unsigned int i;
+static int channel_tx_ready(struct Channel *channel) {
+	return channel_fd_readable(channel->readfd)
+		|| (ERRFD_IS_READ(channel) && channel_fd_readable(channel->errfd));
+}
 
-	/* foreach channel */
-	for (i = 0; i < ses.chansize; i++) {
-		/* Close checking only needs to occur for channels that had IO events */
-		int do_check_close = 0;
+/* Read data from fd and send it over the wire, as much as will fit */
+static void send_channel_fd_data(struct Channel *channel, int isextended) {
+	size_t maxlen = channel_data_maxlen(channel, isextended);
+	if (maxlen == 0) {
+		TRACE(("send_channel_fd_data: no window"))
+		return;
+	}
+	send_msg_channel_data(channel, isextended, maxlen);
+}
 
-		channel = ses.channels[i];
-		if (channel == NULL) {
-			/* only process in-use channels */
+/* The channels waiting to send are a circular list, ses.chan_txq is the
+ * one whose turn is next. A channel joins at the back */
+static void channel_txq_add(struct Channel *channel) {
+	if (channel->tx_next) {
+		return;
+	}
+	if (ses.chan_txq == NULL) {
+		channel->tx_next = channel->tx_prev = channel;
+		ses.chan_txq = channel;
+	} else {
+		channel->tx_next = ses.chan_txq;
+		channel->tx_prev = ses.chan_txq->tx_prev;
+		channel->tx_prev->tx_next = channel;
+		ses.chan_txq->tx_prev = channel;
+	}
+	ses.chan_txqcount++;
+}
+
+static void channel_txq_remove(struct Channel *channel) {
+	if (!channel->tx_next) {
+		return;
+	}
+	if (channel->tx_next == channel) {
+		ses.chan_txq = NULL;
+	} else {
+		channel->tx_prev->tx_next = channel->tx_next;
+		channel->tx_next->tx_prev = channel->tx_prev;
+		if (ses.chan_txq == channel) {
+			ses.chan_txq = channel->tx_next;
+		}
+	}
+	channel->tx_next = channel->tx_prev = NULL;
+	channel->tx_deficit = 0;
+	ses.chan_txqcount--;
+}
+
+/* Bytes a channel may send in each turn */
+static unsigned int channel_tx_quantum(const struct Channel *channel) {
+	switch (channel->prio) {
+		case DROPBEAR_CHANNEL_PRIO_UNKNOWABLE:
+			/* forwarded tcp might be interactive, so gets a larger share */
+			return 2*CHANNEL_TX_QUANTUM;
+		default:
+			return CHANNEL_TX_QUANTUM;
+	}
+}
+
+/* Send from one of a channel's fds, limited by its deficit. Returns 1 if
+ * everything asked for was read, so the fd may have more */
+static int channel_tx_fd(struct Channel *channel, int isextended) {
+	size_t maxlen, len;
+
+	maxlen = MIN(channel->tx_deficit, channel_data_maxlen(channel, isextended));
+	if (maxlen == 0) {
+		return 0;
+	}
+	len = send_msg_channel_data(channel, isextended, maxlen);
+	channel->tx_deficit -= len;
+	return len == maxlen;
+}
+
+/* A channel's turn to send. Returns 1 if it has more data waiting */
+static int channel_tx_turn(struct Channel *channel) {
+	int out = channel_fd_readable(channel->readfd);
+	int err = ERRFD_IS_READ(channel) && channel_fd_readable(channel->errfd);
+
+	while ((out || err) && channel->tx_deficit > 0 && channel_tx_space()) {
+		if (out) {
+			out = channel_tx_fd(channel, 0);
+		}
+		if (err && channel->tx_deficit > 0 && channel_tx_space()) {
+			err = channel_tx_fd(channel, 1);
+		}
+	}
+	return out || err;
+}
+
+/* Whether more channel data can be queued for sending. While no channel is
+ * interactive, a larger batch is allowed so a bulk channel fills the
+ * transmit path in one pass */
+static int channel_tx_space() {
+	if (ses.chan_prio_count[DROPBEAR_CHANNEL_PRIO_INTERACTIVE] > 0) {
+		return writequeue_has_space();
+	}
+	return send_queue_len() <= MAX(send_queue_limit(), CHANNEL_TX_BATCH);
+}
+
+/* Send data from the channels waiting in ses.chan_txq, by deficit round
+ * robin. Each turn a channel gets its quantum added to its deficit and
+ * sends up to that, then goes to the back of the queue. Channels keep
+ * taking turns until they have nothing more to send or the writequeue is
+ * full, so that data from interactive channels (which don't queue) isn't
+ * stuck behind much bulk data. The next call carries on from the channel
+ * that was interrupted */
+static void channel_tx_schedule() {
+
+	struct Channel *channel;
+	unsigned int skipped = 0;
+
+	while (ses.chan_txq != NULL && channel_tx_space()) {
+		channel = ses.chan_txq;
+
+		if (!channel_tx_ready(channel)) {
+			if (ses.chan_reads_allowed) {
+				/* it wasn't waited on, drained or out of window */
+				channel_txq_remove(channel);
+			} else {
+				if (++skipped >= ses.chan_txqcount) {
+					break;
+				}
+				ses.chan_txq = channel->tx_next;
+			}
 			continue;
 		}
+		skipped = 0;
 
-		/* read data and send it over the wire */
-		if (channel->readfd >= 0 && FD_ISSET(channel->readfd, readfds)) {
-			TRACE(("send normal readfd"))
-			send_msg_channel_data(channel, 0);
-			do_check_close = 1;
+		if (channel->tx_deficit == 0) {
+			channel->tx_deficit = channel_tx_quantum(channel);
 		}
+		if (!channel_tx_turn(channel)) {
+			/* rejoins at the back when it is readable again */
+			channel_txq_remove(channel);
+		} else if (channel->tx_deficit == 0) {
+			ses.chan_txq = channel->tx_next;
+		}
+		/* otherwise the writequeue filled, it continues next time */
 
-		/* read stderr data and send it over the wire */
-		if (ERRFD_IS_READ(channel) && channel->errfd >= 0 
-			&& FD_ISSET(channel->errfd, readfds)) {
-				TRACE(("send normal errfd"))
-				send_msg_channel_data(channel, 1);
-			do_check_close = 1;
+		check_close(channel);
+	}
+}
+
+/* Interactive output coalescing. When an interactive channel's readfd is
+ * readable again within CHANNEL_COALESCE_US of the last read, output is
+ * streaming, so the channel goes on ses.chan_held and readfd isn't watched
+ * until the time is up. The output is then read as one packet rather than
+ * one per small write to the pty. */
+
+/* Bytes waiting to be read from fd, or -1 if that can't be told */
+static int channel_fd_pending(int fd) {
+	int pending;
+	if (ioctl(fd, FIONREAD, &pending) < 0) {
+		return -1;
+	}
+	return pending;
+}
+
+/* After the process has exited, whether a short read or EAGAIN from fd
+ * may still be followed by more. A pipe's output has ended at a short
+ * read, EAGAIN only means a background child still holds it open. A pty
+ * (readfd is also writefd) can look empty while the kernel is moving data
+ * into it, so the first time the channel goes on ses.chan_flush for
+ * CHANNEL_FLUSH_WAIT milliseconds, its fds are still watched meanwhile.
+ * Reading more data takes it off again */
+static int channel_flush_more(struct Channel *channel, int fd) {
+	uint64_t now;
+
+	if (channel->readfd != channel->writefd) {
+		return 0;
+	}
+	if (channel_fd_pending(fd) > 0) {
+		return 1;
+	}
+	now = monotonic_now_us();
+	if (channel->flush_until == 0) {
+		channel->flush_until = now + CHANNEL_FLUSH_WAIT * 1000;
+		channel->flush_next = ses.chan_flush;
+		ses.chan_flush = channel;
+		return 1;
+	}
+	/* the second test is in case the clock went backwards */
+	return channel->flush_until > now
+		&& channel->flush_until - now <= CHANNEL_FLUSH_WAIT * 1000;
+}
+
+static void channel_flush_remove(struct Channel *channel) {
+	struct Channel **prev;
+
+	if (channel->flush_until == 0) {
+		return;
+	}
+	for (prev = &ses.chan_flush; *prev; prev = &(*prev)->flush_next) {
+		if (*prev == channel) {
+			*prev = channel->flush_next;
+			break;
+		}
+	}
+	channel->flush_next = NULL;
+	channel->flush_until = 0;
+}
+
+/* Close the fds of flushing channels that had nothing more to read
+ * before their time was up */
+static void channel_flush_expired() {
+	struct Channel **prev, *channel;
+	uint64_t now;
+
+	if (ses.chan_flush == NULL) {
+		return;
+	}
+	now = monotonic_now_us();
+	prev = &ses.chan_flush;
+	while ((channel = *prev) != NULL) {
+		if (channel->flush_until > now
+				&& channel->flush_until - now <= CHANNEL_FLUSH_WAIT * 1000) {
+			prev = &channel->flush_next;
+			continue;
+		}
+		*prev = channel->flush_next;
+		channel->flush_next = NULL;
+		channel->flush_until = 0;
+
+		/* anything waiting is read as usual, and starts a new wait
+		 * if it is short */
+		if (channel->readfd >= 0
+				&& channel_fd_pending(channel->readfd) <= 0) {
+			TRACE(("closing readfd, flush wait is up"))
+			close_chan_fd(channel, channel->readfd, SHUT_RD);
+		}
+		if (ERRFD_IS_READ(channel) && channel->errfd >= 0
+				&& channel_fd_pending(channel->errfd) <= 0) {
+			TRACE(("closing errfd, flush wait is up"))
+			close_chan_fd(channel, channel->errfd, SHUT_RD);
+		}
+		check_close(channel);
+	}
+}
+
+/* Returns 1 if reading readfd should wait so more output collects, and
+ * holds the channel. now is from monotonic_now_us() */
+static int channel_hold_output(struct Channel *channel, uint64_t now) {
+	int pending;
+
+	if (CHANNEL_COALESCE_US == 0 || channel->flushing
+			|| channel->tx_last_time == 0
+			|| now - channel->tx_last_time >= CHANNEL_COALESCE_US) {
+		/* after a pause */
+		return 0;
+	}
+	/* nothing waiting is EOF or an error, which should be read */
+	pending = channel_fd_pending(channel->readfd);
+	if (pending == 0 || pending >= CHANNEL_COALESCE_LEN) {
+		return 0;
+	}
+
+	channel->tx_hold_until = now + CHANNEL_COALESCE_US;
+	channel->hold_next = ses.chan_held;
+	ses.chan_held = channel;
+	channel_events_dirty(channel);
+	return 1;
+}
+
+static void channel_hold_remove(struct Channel *channel) {
+	struct Channel **prev;
+
+	if (channel->tx_hold_until == 0) {
+		return;
+	}
+	for (prev = &ses.chan_held; *prev; prev = &(*prev)->hold_next) {
+		if (*prev == channel) {
+			*prev = channel->hold_next;
+			break;
 		}
+	}
+	channel->hold_next = NULL;
+	channel->tx_hold_until = 0;
+	channel_events_dirty(channel);
+}
 
-		/* write to program/pipe stdin */
-		if (channel->writefd >= 0 && FD_ISSET(channel->writefd, writefds)) {
-			writechannel(channel, channel->writefd, channel->writebuf, NULL, NULL);
-			do_check_close = 1;
+/* Send the output of held channels whose time is up */
+static void channel_release_held() {
+	struct Channel **prev, *channel;
+	uint64_t now;
+
+	if (ses.chan_held == NULL) {
+		return;
+	}
+	now = monotonic_now_us();
+	prev = &ses.chan_held;
+	while ((channel = *prev) != NULL) {
+		/* the second test is in case the clock went backwards */
+		if (channel->tx_hold_until > now
+				&& channel->tx_hold_until - now <= CHANNEL_COALESCE_US) {
+			prev = &channel->hold_next;
+			continue;
 		}
-		
-		/* stderr for client mode */
-		if (ERRFD_IS_WRITE(channel)
-				&& channel->errfd >= 0 && FD_ISSET(channel->errfd, writefds)) {
-			writechannel(channel, channel->errfd, channel->extrabuf, NULL, NULL);
-			do_check_close = 1;
+		*prev = channel->hold_next;
+		channel->hold_next = NULL;
+		channel->tx_hold_until = 0;
+		channel_events_dirty(channel);
+
+		/* otherwise it is read when readfd is ready again */
+		if (ses.chan_reads_allowed && channel->readfd >= 0
+				&& !channel->sent_close
+				&& channel_fd_pending(channel->readfd) > 0) {
+			send_channel_fd_data(channel, 0);
+			channel->tx_last_time = now;
+			check_close(channel);
 		}
+	}
+}
 
-		if (ses.channel_signal_pending) {
-			/* SIGCHLD can change channel state for server sessions */
-			do_check_close = 1;
+/* Milliseconds until a held channel should be sent or a flushing channel's
+ * wait is up, -1 if there are none */
+long channel_timeout() {
+	struct Channel *channel;
+	uint64_t until = 0, now;
+	long limit;
+
+	if (ses.chan_held == NULL && ses.chan_flush == NULL) {
+		return -1;
+	}
+	for (channel = ses.chan_held; channel; channel = channel->hold_next) {
+		if (until == 0 || channel->tx_hold_until < until) {
+			until = channel->tx_hold_until;
+		}
+	}
+	for (channel = ses.chan_flush; channel; channel = channel->flush_next) {
+		if (until == 0 || channel->flush_until < until) {
+			until = channel->flush_until;
 		}
+	}
+	now = monotonic_now_us();
+	if (until <= now) {
+		return 0;
+	}
+	limit = MAX(CHANNEL_COALESCE_US / 1000, CHANNEL_FLUSH_WAIT) + 1;
+	return MIN((until - now + 999) / 1000, (uint64_t)limit);
+}
+
+/* Perform IO for a channel with ready fds. Data read from interactive
+ * channels is sent straight away, or held briefly while output streams
+ * in. Other channels queue for their turn */
+static void channel_ready_io(struct Channel *channel) {
+
+	/* write to program/pipe stdin */
+	if (events_ready(channel->writefd) & DROPBEAR_EV_WRITE) {
+		writechannel(channel, channel->writefd, channel->writebuf, NULL, NULL);
+	}
 	
+	/* stderr for client mode */
+	if (ERRFD_IS_WRITE(channel)
+			&& (events_ready(channel->errfd) & DROPBEAR_EV_WRITE)) {
+		writechannel(channel, channel->errfd, channel->extrabuf, NULL, NULL);
+	}
+
+	if (channel->prio != DROPBEAR_CHANNEL_PRIO_INTERACTIVE) {
+		if (channel_tx_ready(channel)) {
+			channel_txq_add(channel);
+		}
+		return;
+	}
+
+	/* read data and send it over the wire */
+	if (channel_fd_readable(channel->readfd)) {
+		uint64_t now = 0;
+		if (CHANNEL_COALESCE_US > 0) {
+			now = monotonic_now_us();
+		}
+		if (channel_hold_output(channel, now)) {
+			TRACE(("holding readfd output"))
+		} else {
+			TRACE(("send normal readfd"))
+			send_channel_fd_data(channel, 0);
+			channel->tx_last_time = now;
+		}
+	}
+
+	/* read stderr data and send it over the wire */
+	if (ERRFD_IS_READ(channel) && channel_fd_readable(channel->errfd)) {
+		TRACE(("send normal errfd"))
+		send_channel_fd_data(channel, 1);
+	}
+}
+
+/* Perform IO for the channels with ready fds */
+void channelio() {
+
+	struct Channel *channel;
+	unsigned int i;
+
+	/* Only the ready fds are visited. A channel can own several of them
+	 * but is handled once, and a channel removed meanwhile has had its
+	 * fds removed so is skipped */
+	channel_release_held();
+	channel_flush_expired();
+
+	ses.chan_io_round++;
+	for (i = 0; i < events_ready_count(); i++) {
+		channel = events_owner(events_ready_fd(i));
+		if (channel == NULL || channel->io_round == ses.chan_io_round) {
+			continue;
+		}
+		channel->io_round = ses.chan_io_round;
+		channel_events_dirty(channel);
+
+		channel_ready_io(channel);
 		/* handle any channel closing etc */
-		if (do_check_close) {
+		check_close(channel);
+	}
+
+	if (ses.channel_signal_pending) {
+		/* SIGCHLD can change channel state for server sessions.
+		 * Backwards since check_close() may remove the channel */
+		for (i = ses.chancount; i > 0; i--) {
+			channel = ses.chan_active[i-1];
+			channel_events_dirty(channel);
 			check_close(channel);
 		}
 	}
 
+	channel_tx_schedule();
+
 #if DROPBEAR_LISTENERS
-	handle_listeners(readfds);
+	handle_listeners();
 #endif
 }
 
@@ -315,7 +753,11 @@ static void check_close(struct Channel *channel) {
 	if ((channel->recv_eof && !write_pending(channel))
 		/* have a server "session" and child has exited */
 		|| (channel->type->check_close && close_allowed)) {
-		close_chan_fd(channel, channel->writefd, SHUT_WR);
+		/* a pty is both readfd and writefd, closing it would lose any
+		 * output still waiting. It is closed once that has been read */
+		if (!(channel->flushing && channel->writefd == channel->readfd)) {
+			close_chan_fd(channel, channel->writefd, SHUT_WR);
+		}
 	}
 
 	/* Special handling for flushing read data after an exit. We
@@ -325,12 +767,12 @@ static void check_close(struct Channel *channel) {
 		TRACE(("might send data, flushing"))
 		if (channel->readfd >= 0 && channel->transwindow > 0) {
 			TRACE(("send data readfd"))
-			send_msg_channel_data(channel, 0);
+			send_channel_fd_data(channel, 0);
 		}
 		if (ERRFD_IS_READ(channel) && channel->errfd >= 0 
 			&& channel->transwindow > 0) {
 			TRACE(("send data errfd"))
-			send_msg_channel_data(channel, 1);
+			send_channel_fd_data(channel, 1);
 		}
 	}
 
@@ -367,6 +809,9 @@ void channel_connect_done(int result, int sock, void* user_data, const char* UNU
 	{
 		channel->readfd = channel->writefd = sock;
 		channel->conn_pending = NULL;
+		channel_events_dirty(channel);
+		/* recv_msg_channel_open() left it uncounted while connecting */
+		channel_prio_changed(channel);
 		send_msg_channel_open_confirmation(channel, channel->recvwindow,
 				channel->recvmaxpacket);
 		TRACE(("leave channel_connect_done: success"))
@@ -479,6 +924,13 @@ static int writechannel_writev(struct Channel* channel, int fd, circbuffer *cbuf
 		io_count++;
 	}
 
+	if (morelen && circ_len1 + circ_len2 < cbuf_getused(cbuf)) {
+		/* the buffer holds more than the two portions, moredata
+		 * has to wait behind the rest of it */
+		*morelen = 0;
+		morelen = NULL;
+	}
+
 	if (morelen) {
 		assert(moredata);
 		TRACE(("more %d", *morelen))
@@ -535,13 +987,18 @@ static int writechannel(struct Channel* channel, int fd, circbuffer *cbuf,
 #endif
 
 	/* Window adjust handling */
-	if (channel->recvdonelen >= RECV_WINDOWEXTEND) {
-		send_msg_channel_window_adjust(channel, channel->recvdonelen);
-		channel->recvwindow += channel->recvdonelen;
-		channel->recvdonelen = 0;
+	if (channel->recvdonelen >= RECV_WINDOWEXTEND(channel)) {
+#if DROPBEAR_RECV_WINDOW_AUTOTUNE
+		channel_tune_window(channel);
+#endif
+		if (channel->recvdonelen > 0) {
+			send_msg_channel_window_adjust(channel, channel->recvdonelen);
+			channel->recvwindow += channel->recvdonelen;
+			channel->recvdonelen = 0;
+		}
 	}
 
-	dropbear_assert(channel->recvwindow <= opts.recv_window);
+	dropbear_assert(channel->recvwindow <= channel->recvwindowsize);
 	dropbear_assert(channel->recvwindow <= cbuf_getavail(channel->writebuf));
 	dropbear_assert(channel->extrabuf == NULL ||
 			channel->recvwindow <= cbuf_getavail(channel->extrabuf));
@@ -551,53 +1008,181 @@ static int writechannel(struct Channel* channel, int fd, circbuffer *cbuf,
 }
 
 
-/* Set the file descriptors for the main select in session.c
- * This avoid channels which don't have any window available, are closed, etc*/
-void setchannelfds(fd_set *readfds, fd_set *writefds, int allow_reads) {
-	
-	unsigned int i;
-	struct Channel * channel;
-	
-	for (i = 0; i < ses.chansize; i++) {
+#if DROPBEAR_RECV_WINDOW_AUTOTUNE
+static void channel_resize_window(struct Channel *channel, unsigned int size) {
+	cbuf_resize(channel->writebuf, size);
+	if (channel->extrabuf) {
+		cbuf_resize(channel->extrabuf, size);
+	}
+	ses.chan_window_grown -= channel->recvwindowsize;
+	ses.chan_window_grown += size;
+	channel->recvwindowsize = size;
+}
 
-		channel = ses.channels[i];
-		if (channel == NULL) {
-			continue;
+/* Called before sending a window adjust, with recvdonelen the amount
+ * consumed since the last one. The peer has to stop and wait whenever a
+ * round trip's worth of data (the bandwidth-delay product) is more than
+ * the window. Once the data consumed per round trip comes near the
+ * window while we are keeping up with it, the window is doubled and the
+ * extra is given with this adjust. Channels with grown windows that no
+ * longer need them give some back when other channels are short of
+ * memory */
+static void channel_tune_window(struct Channel *channel) {
+
+	const unsigned int size = channel->recvwindowsize;
+	const uint64_t now = monotonic_now_us();
+	uint64_t elapsed, bdp;
+	unsigned int rtt, newsize, room, give;
+
+	if (channel->recvprobe_time == 0) {
+		/* Data past what the peer can already send must have been sent
+		 * after it got this adjust, its arrival gives a round trip time */
+		channel->recvprobe_edge = channel->recvtotal + channel->recvwindow;
+		channel->recvprobe_time = now;
+	}
+
+	channel->recvtune_bytes += channel->recvdonelen;
+	/* microseconds. The TCP round trip time is 0 if sock_in isn't a
+	 * socket, and misses any delay past a proxy */
+	rtt = MAX(get_sock_rtt(ses.sock_in), channel->recvrtt);
+	elapsed = now - channel->recvtune_time;
+	if (rtt == 0 || elapsed < rtt) {
+		/* measure over at least a round trip */
+		return;
+	}
+	bdp = channel->recvtune_bytes * rtt / elapsed;
+	channel->recvtune_bytes = 0;
+	channel->recvtune_time = now;
+
+	if (bdp >= size / 2 && size < RECV_WINDOW_AUTOTUNE_MAX
+			&& cbuf_getused(channel->writebuf) < size / 4) {
+		newsize = MIN((uint64_t)size * 2, RECV_WINDOW_AUTOTUNE_MAX);
+		room = RECV_WINDOW_AUTOTUNE_TOTAL - MIN(ses.chan_window_grown,
+				RECV_WINDOW_AUTOTUNE_TOTAL);
+		if (newsize - size > room) {
+			newsize = size + room;
+			ses.chan_window_pressure = 1;
+		}
+		if (newsize > size) {
+			TRACE(("channel %d window grows to %u, rtt %u bdp %llu",
+				channel->index, newsize, rtt, (unsigned long long)bdp))
+			channel->recvdonelen += newsize - size;
+			channel_resize_window(channel, newsize);
 		}
+	} else if (bdp < size / 4 && ses.chan_window_pressure
+			&& size > opts.recv_window) {
+		newsize = MAX(size / 2, opts.recv_window);
+		newsize = MAX(newsize, 2 * bdp);
+		/* can only hold back what is being returned now */
+		give = MIN(size - newsize, channel->recvdonelen);
+		if (give > 0) {
+			TRACE(("channel %d window shrinks to %u", channel->index, size - give))
+			channel->recvdonelen -= give;
+			channel_resize_window(channel, size - give);
+			ses.chan_window_pressure = 0;
+		}
+	}
+}
+#endif /* DROPBEAR_RECV_WINDOW_AUTOTUNE */
 
-		/* Stuff to put over the wire. 
-		Avoid queueing data to send if we're in the middle of a 
-		key re-exchange (!dataallowed), but still read from the 
-		FD if there's the possibility of "~."" to kill an 
-		interactive session (the read_mangler) */
-		if (channel->transwindow > 0
-		   && ((ses.dataallowed && allow_reads) || channel->read_mangler)) {
+/* Mark a channel as needing its fd events recalculated before the next
+ * wait, after anything that may have changed its state */
+static void channel_events_dirty(struct Channel *channel) {
+	if (channel->events_dirty) {
+		return;
+	}
+	channel->events_dirty = 1;
+	if (ses.chan_dirtycount < ses.chansize) {
+		ses.chan_dirty[ses.chan_dirtycount++] = channel->index;
+	} else {
+		ses.chan_events_all = 1;
+	}
+}
 
-			if (channel->readfd >= 0) {
-				FD_SET(channel->readfd, readfds);
-			}
-			
-			if (ERRFD_IS_READ(channel) && channel->errfd >= 0) {
-					FD_SET(channel->errfd, readfds);
-			}
+static void add_channel_fd_events(int *fds, int *events, int fd, int ev) {
+	int i;
+	for (i = 0; fds[i] >= 0; i++) {
+		if (fds[i] == fd) {
+			events[i] |= ev;
+			return;
 		}
+	}
+	fds[i] = fd;
+	events[i] = ev;
+}
 
-		/* Stuff from the wire */
-		if (channel->writefd >= 0 && cbuf_getused(channel->writebuf) > 0) {
-				FD_SET(channel->writefd, writefds);
-		}
+/* Set the fd events to wait for. This avoids channels which don't have
+ * any window available, are closed, etc */
+static void channel_update_events(struct Channel *channel, int allow_reads) {
+	/* readfd, writefd and errfd, possibly the same socket */
+	int fds[4] = {-1, -1, -1, -1};
+	int events[3];
+	int read_events = 0;
+	int i;
+
+	channel->events_dirty = 0;
+
+	/* Stuff to put over the wire. 
+	Avoid queueing data to send if we're in the middle of a 
+	key re-exchange (!dataallowed), but still read from the 
+	FD if there's the possibility of "~."" to kill an 
+	interactive session (the read_mangler) */
+	if (channel->transwindow > 0
+	   && (allow_reads || channel->read_mangler)) {
+		read_events = DROPBEAR_EV_READ;
+	}
 
-		if (ERRFD_IS_WRITE(channel) && channel->errfd >= 0 
-				&& cbuf_getused(channel->extrabuf) > 0) {
-				FD_SET(channel->errfd, writefds);
-		}
+	if (channel->readfd >= 0) {
+		/* not while holding back interactive output */
+		add_channel_fd_events(fds, events, channel->readfd,
+			channel->tx_hold_until ? 0 : read_events);
+	}
+	if (ERRFD_IS_READ(channel) && channel->errfd >= 0) {
+		add_channel_fd_events(fds, events, channel->errfd, read_events);
+	}
 
-	} /* foreach channel */
+	/* Stuff from the wire */
+	if (channel->writefd >= 0) {
+		add_channel_fd_events(fds, events, channel->writefd,
+			cbuf_getused(channel->writebuf) > 0 ? DROPBEAR_EV_WRITE : 0);
+	}
+	if (ERRFD_IS_WRITE(channel) && channel->errfd >= 0) {
+		add_channel_fd_events(fds, events, channel->errfd,
+			cbuf_getused(channel->extrabuf) > 0 ? DROPBEAR_EV_WRITE : 0);
+	}
 
-#if DROPBEAR_LISTENERS
-	set_listener_fds(readfds);
-#endif
+	for (i = 0; fds[i] >= 0; i++) {
+		events_set(fds[i], events[i], channel);
+	}
+}
+
+/* Update the fd events for channels that have changed since the last
+ * wait, or all of them when reading from channels is enabled/disabled */
+void update_channel_events(int allow_reads) {
+	
+	unsigned int i;
+	struct Channel * channel;
 
+	allow_reads = ses.dataallowed && allow_reads;
+	if (allow_reads != ses.chan_reads_allowed) {
+		ses.chan_reads_allowed = allow_reads;
+		ses.chan_events_all = 1;
+	}
+
+	if (ses.chan_events_all) {
+		for (i = 0; i < ses.chancount; i++) {
+			channel_update_events(ses.chan_active[i], allow_reads);
+		}
+	} else {
+		for (i = 0; i < ses.chan_dirtycount; i++) {
+			channel = ses.channels[ses.chan_dirty[i]];
+			if (channel != NULL && channel->events_dirty) {
+				channel_update_events(channel, allow_reads);
+			}
+		}
+	}
+	ses.chan_dirtycount = 0;
+	ses.chan_events_all = 0;
 }
 
 /* handle the channel EOF event, by closing the channel filedescriptor. The
@@ -649,6 +1234,15 @@ static void remove_channel(struct Channel * channel) {
 		channel->extrabuf = NULL;
 	}
 
+	channel_txq_remove(channel);
+	channel_hold_remove(channel);
+	channel_flush_remove(channel);
+#if DROPBEAR_RECV_WINDOW_AUTOTUNE
+	ses.chan_window_grown -= channel->recvwindowsize - opts.recv_window;
+#endif
+	events_remove(channel->writefd);
+	events_remove(channel->readfd);
+	events_remove(channel->errfd);
 
 	if (IS_DROPBEAR_SERVER || (channel->writefd != STDOUT_FILENO)) {
 		/* close the FDs in case they haven't been done
@@ -671,15 +1265,33 @@ static void remove_channel(struct Channel * channel) {
 		cancel_connect(channel->conn_pending);
 	}
 
-	ses.channels[channel->index] = NULL;
-	m_free(channel);
+	/* the last active channel takes this one's place */
 	ses.chancount--;
+	ses.chan_active[channel->active_pos] = ses.chan_active[ses.chancount];
+	ses.chan_active[channel->active_pos]->active_pos = channel->active_pos;
+	ses.channels[channel->index] = NULL;
+	ses.chan_free[ses.chan_freecount++] = channel->index;
 
-	update_channel_prio();
+	channel->prio = DROPBEAR_CHANNEL_PRIO_EARLY;
+	channel_prio_changed(channel);
+	m_free(channel);
 
 	TRACE(("leave remove_channel"))
 }
 
+/* Called after channel->prio has been changed. Keeps the count of channels
+ * at each priority that update_channel_prio() uses */
+void channel_prio_changed(struct Channel *channel) {
+	if (channel->counted_prio != DROPBEAR_CHANNEL_PRIO_EARLY) {
+		ses.chan_prio_count[channel->counted_prio]--;
+	}
+	if (channel->prio != DROPBEAR_CHANNEL_PRIO_EARLY) {
+		ses.chan_prio_count[channel->prio]++;
+	}
+	channel->counted_prio = channel->prio;
+	update_channel_prio();
+}
+
 /* Handle channel specific requests, passing off to corresponding handlers
  * such as chansession or x11fwd */
 void recv_msg_channel_request() {
@@ -711,15 +1323,30 @@ void recv_msg_channel_request() {
 
 }
 
+/* The most data that can be sent from a channel in one packet */
+static size_t channel_data_maxlen(struct Channel *channel, int isextended) {
+	size_t maxlen;
+
+	maxlen = MIN(channel->transwindow, channel->transmaxpacket);
+	/* -(1+4+4) is SSH_MSG_CHANNEL_DATA, channel number, string length, and 
+	 * exttype if is extended */
+	maxlen = MIN(maxlen, 
+			ses.writepayload->size - 1 - 4 - 4 - (isextended ? 4 : 0));
+	TRACE(("maxlen %zd", maxlen))
+	return maxlen;
+}
+
 /* Reads data from the server's program/shell/etc, and puts it in a
  * channel_data packet to send.
  * chan is the remote channel, isextended is 0 if it is normal data, 1
  * if it is extended data. if it is extended, then the type is in
- * exttype */
-static void send_msg_channel_data(struct Channel *channel, int isextended) {
+ * exttype. At most maxlen bytes are read, which must be non-zero and no
+ * more than channel_data_maxlen(). Returns the number of bytes sent */
+static size_t send_msg_channel_data(struct Channel *channel, int isextended,
+		size_t maxlen) {
 
 	int len;
-	size_t maxlen, size_pos;
+	size_t size_pos;
 	int fd;
 
 	CHECKCLEARTOWRITE();
@@ -734,17 +1361,7 @@ static void send_msg_channel_data(struct Channel *channel, int isextended) {
 	}
 	TRACE(("enter send_msg_channel_data isextended %d fd %d", isextended, fd))
 	dropbear_assert(fd >= 0);
-
-	maxlen = MIN(channel->transwindow, channel->transmaxpacket);
-	/* -(1+4+4) is SSH_MSG_CHANNEL_DATA, channel number, string length, and 
-	 * exttype if is extended */
-	maxlen = MIN(maxlen, 
-			ses.writepayload->size - 1 - 4 - 4 - (isextended ? 4 : 0));
-	TRACE(("maxlen %zd", maxlen))
-	if (maxlen == 0) {
-		TRACE(("leave send_msg_channel_data: no window"))
-		return;
-	}
+	dropbear_assert(maxlen > 0);
 
 	buf_putbyte(ses.writepayload, 
 			isextended ? SSH_MSG_CHANNEL_EXTENDED_DATA : SSH_MSG_CHANNEL_DATA);
@@ -760,7 +1377,10 @@ static void send_msg_channel_data(struct Channel *channel, int isextended) {
 	len = read(fd, buf_getwriteptr(ses.writepayload, maxlen), maxlen);
 
 	if (len <= 0) {
-		if (len == 0 || (errno != EINTR && errno != EAGAIN)) {
+		if (len < 0 && errno == EAGAIN && channel->flushing
+				&& channel_flush_more(channel, fd)) {
+			/* read it next time */
+		} else if (len == 0 || (errno != EINTR && errno != EAGAIN)) {
 			/* This will also get hit in the case of EAGAIN. The only
 			time we expect to receive EAGAIN is when we're flushing a FD,
 			in which case it can be treated the same as EOF */
@@ -770,7 +1390,7 @@ static void send_msg_channel_data(struct Channel *channel, int isextended) {
 		buf_setlen(ses.writepayload, 0);
 		TRACE(("leave send_msg_channel_data: len %d read err %d or EOF for fd %d", 
 					len, errno, fd))
-		return;
+		return 0;
 	}
 
 	if (channel->read_mangler) {
@@ -778,11 +1398,13 @@ static void send_msg_channel_data(struct Channel *channel, int isextended) {
 		if (len == 0) {
 			buf_setpos(ses.writepayload, 0);
 			buf_setlen(ses.writepayload, 0);
-			return;
+			return 0;
 		}
 	}
 
 	TRACE(("send_msg_channel_data: len %d fd %d", len, fd))
+	/* still output, so any flush wait starts again */
+	channel_flush_remove(channel);
 	buf_incrwritepos(ses.writepayload, len);
 	/* ... real size here */
 	buf_setpos(ses.writepayload, size_pos);
@@ -793,13 +1415,16 @@ static void send_msg_channel_data(struct Channel *channel, int isextended) {
 	encrypt_packet();
 	
 	/* If we receive less data than we requested when flushing, we've
-	   reached the equivalent of EOF */
-	if (channel->flushing && len < (ssize_t)maxlen)
+	   reached the equivalent of EOF. A pty may return less than is
+	   waiting, so check for more first */
+	if (channel->flushing && len < (ssize_t)maxlen
+			&& !channel_flush_more(channel, fd))
 	{
 		TRACE(("closing from channel, flushing out."))
 		close_chan_fd(channel, fd, SHUT_RD);
 	}
 	TRACE(("leave send_msg_channel_data"))
+	return len;
 }
 
 /* We receive channel data */
@@ -851,7 +1476,23 @@ void common_recv_msg_channel_data(struct Channel *channel, int fd,
 
 	dropbear_assert(channel->recvwindow >= datalen);
 	channel->recvwindow -= datalen;
-	dropbear_assert(channel->recvwindow <= opts.recv_window);
+	dropbear_assert(channel->recvwindow <= channel->recvwindowsize);
+#if DROPBEAR_RECV_WINDOW_AUTOTUNE
+	channel->recvtotal += datalen;
+	if (channel->recvprobe_time
+			&& (int)(channel->recvtotal - channel->recvprobe_edge) > 0) {
+		/* The smallest recent sample is kept, others include time
+		 * the peer had nothing to send or data queued along the way */
+		const uint64_t now = monotonic_now_us();
+		const unsigned int sample = now - channel->recvprobe_time;
+		if (channel->recvrtt == 0 || sample < channel->recvrtt
+				|| now - channel->recvrtt_time > RECV_RTT_EXPIRY) {
+			channel->recvrtt = sample;
+			channel->recvrtt_time = now;
+		}
+		channel->recvprobe_time = 0;
+	}
+#endif
 
 	/* Attempt to write the data immediately without having to put it in the circular buffer */
 	consumed = datalen;
@@ -861,7 +1502,8 @@ void common_recv_msg_channel_data(struct Channel *channel, int fd,
 	buf_incrpos(ses.payload, consumed);
 
 
-	/* We may have to run throught twice, if the buffer wraps around. Can't
+	/* We may have to run throught twice, if the buffer wraps around and
+	 * isn't mapped twice. Can't
 	 * just "leave it for next time" like with writechannel, since this
 	 * is payload data.
 	 * If the writechannel() failed then remaining data is discarded */
@@ -938,7 +1580,7 @@ void recv_msg_channel_open() {
 	transwindow = buf_getint(ses.payload);
 	transwindow = MIN(transwindow, TRANS_MAX_WINDOW);
 	transmaxpacket = buf_getint(ses.payload);
-	transmaxpacket = MIN(transmaxpacket, TRANS_MAX_PAYLOAD_LEN);
+	transmaxpacket = MIN(transmaxpacket, opts.trans_max_payload);
 
 	/* figure what type of packet it is */
 	if (typelen > MAX_NAME_LEN) {
@@ -989,6 +1631,7 @@ void recv_msg_channel_open() {
 	if (channel->prio == DROPBEAR_CHANNEL_PRIO_EARLY) {
 		channel->prio = DROPBEAR_CHANNEL_PRIO_BULK;
 	}
+	channel_prio_changed(channel);
 
 	/* success */
 	send_msg_channel_open_confirmation(channel, channel->recvwindow,
@@ -1001,8 +1644,6 @@ failure:
 
 cleanup:
 	m_free(type);
-	
-	update_channel_prio();
 
 	TRACE(("leave recv_msg_channel_open"))
 }
@@ -1085,9 +1726,11 @@ static void close_chan_fd(struct Channel *channel, int fd, int how) {
 		}
 	} else {
 		TRACE(("CLOSE some fd %d", fd))
+		events_remove(fd);
 		m_close(fd);
 		closein = closeout = 1;
 	}
+	channel_events_dirty(channel);
 
 	if (closeout && (fd == channel->readfd)) {
 		channel->readfd = FD_CLOSED;
@@ -1108,6 +1751,7 @@ static void close_chan_fd(struct Channel *channel, int fd, int how) {
 	if (channel->type->sepfds && channel->readfd == FD_CLOSED 
 		&& channel->writefd == FD_CLOSED && channel->errfd == FD_CLOSED) {
 		TRACE(("CLOSE (finally) of %d", fd))
+		events_remove(fd);
 		m_close(fd);
 	}
 }
@@ -1173,6 +1817,7 @@ void recv_msg_channel_open_confirmation() {
 	channel->remotechan =  buf_getint(ses.payload);
 	channel->transwindow = buf_getint(ses.payload);
 	channel->transmaxpacket = buf_getint(ses.payload);
+	channel->transmaxpacket = MIN(channel->transmaxpacket, opts.trans_max_payload);
 	
 	TRACE(("new chan remote %d local %d", 
 				channel->remotechan, channel->index))
@@ -1190,7 +1835,7 @@ void recv_msg_channel_open_confirmation() {
 	if (channel->prio == DROPBEAR_CHANNEL_PRIO_EARLY) {
 		channel->prio = DROPBEAR_CHANNEL_PRIO_BULK;
 	}
-	update_channel_prio();
+	channel_prio_changed(channel);
 	
 	TRACE(("leave recv_msg_channel_open_confirmation"))
 }
@@ -1228,10 +1873,9 @@ struct Channel* get_any_ready_channel() {
 	if (ses.chancount == 0) {
 		return NULL;
 	}
-	for (i = 0; i < ses.chansize; i++) {
-		struct Channel *chan = ses.channels[i];
-		if (chan
-				&& !(chan->sent_eof || chan->recv_eof)
+	for (i = 0; i < ses.chancount; i++) {
+		struct Channel *chan = ses.chan_active[i];
+		if (!(chan->sent_eof || chan->recv_eof)
 				&& !(chan->await_open)) {
 			return chan;
 		}
@@ -110,4 +110,17 @@ void print_version() {
 	fprintf(stderr, "Dropbear v%s\n", DROPBEAR_VERSION);
 }
 
+/* -M, the largest packet payload for both directions */
+void parse_max_payload(const char *arg) {
+	unsigned int val;
+
+	/* everyone must accept 32kB, rfc4253 6.1 */
+	if (m_str_to_uint(arg, &val) == DROPBEAR_FAILURE
+			|| val < 32768 || val > MAX_JUMBO_PAYLOAD_LEN) {
+		dropbear_exit("Bad max packet size '%s'", arg);
+	}
+	opts.recv_max_payload = val;
+	opts.trans_max_payload = val;
+}
+
 
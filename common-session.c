@@ -35,6 +35,7 @@
 #include "channel.h"
 #include "runopts.h"
 #include "netio.h"
+#include "event.h"
 
 static void checktimeouts(void);
 static long select_timeout(void);
@@ -90,15 +91,35 @@ void common_session_init(int sock_in, int sock_out) {
 
 	ses.maxfd = MAX(ses.maxfd, ses.signal_pipe[0]);
 	ses.maxfd = MAX(ses.maxfd, ses.signal_pipe[1]);
+
+	events_init();
+	/* We get woken up when signal handlers write to this pipe.
+	   SIGCHLD in svr-chansession is the only one currently. */
+	events_set(ses.signal_pipe[0], DROPBEAR_EV_READ, NULL);
 	
-	ses.writepayload = buf_new(TRANS_MAX_PAYLOAD_LEN);
+	ses.writepayload = buf_new(opts.trans_max_payload);
 	ses.transseq = 0;
 
+	ses.readahead = NULL;
 	ses.readbuf = NULL;
 	ses.payload = NULL;
 	ses.recvseq = 0;
 
-	initqueue(&ses.writequeue);
+	ses.writequeue = buf_new(INIT_WRITEQUEUE);
+	ses.writequeue_len = 0;
+	ses.writequeue_peak = 0;
+#if SEND_QUEUE_DELAY_MS
+	ses.send_paced = 1;
+	ses.sock_unsent = 0;
+	ses.send_queue_limit = SEND_QUEUE_MIN_LEN;
+	ses.send_tune_time = 0;
+#endif
+#if DROPBEAR_TX_ZEROCOPY
+	ses.zerocopy = -1;
+	ses.zerocopy_seq = 0;
+	ses.zerocopy_count = 0;
+	ses.zerocopy_spare = NULL;
+#endif
 
 	ses.requirenext = SSH_MSG_KEXINIT;
 	ses.dataallowed = 1; /* we can send data until we actually 
@@ -145,30 +166,25 @@ void common_session_init(int sock_in, int sock_out) {
 
 void session_loop(void(*loophandler)()) {
 
-	fd_set readfd, writefd;
-	struct timeval timeout;
+	int sock_in_events, sock_out_events;
 	int val;
 
-	/* main loop, select()s for all sockets in use */
+	/* main loop, waits for events on all sockets in use */
 	for(;;) {
-		const int writequeue_has_space = (ses.writequeue_len <= 2*TRANS_MAX_PAYLOAD_LEN);
+		const int writequeue_space = writequeue_has_space();
+		/* Packets that were read ahead but left when the writequeue
+		filled are handled without waiting on the socket */
+		const int readahead = writequeue_space && packet_readahead_pending();
 
-		timeout.tv_sec = select_timeout();
-		timeout.tv_usec = 0;
-		FD_ZERO(&writefd);
-		FD_ZERO(&readfd);
 		dropbear_assert(ses.payload == NULL);
 
-		/* We get woken up when signal handlers write to this pipe.
-		   SIGCHLD in svr-chansession is the only one currently. */
-		FD_SET(ses.signal_pipe[0], &readfd);
 		ses.channel_signal_pending = 0;
 
 		/* set up for channels which can be read/written */
-		setchannelfds(&readfd, &writefd, writequeue_has_space);
+		update_channel_events(writequeue_space);
 
 		/* Pending connections to test */
-		set_connect_fds(&writefd);
+		set_connect_fds();
 
 		/* We delay reading from the input socket during initial setup until
 		after we have written out our initial KEXINIT packet (empty writequeue). 
@@ -176,19 +192,37 @@ void session_loop(void(*loophandler)()) {
 		read for the remote ident.
 		We also avoid reading from the socket if the writequeue is full, that avoids
 		replies backing up */
-		if (ses.sock_in != -1 
-			&& (ses.remoteident || isempty(&ses.writequeue)) 
-			&& writequeue_has_space) {
-			FD_SET(ses.sock_in, &readfd);
+		sock_in_events = 0;
+		if ((ses.remoteident || ses.writequeue_len == 0) 
+			&& writequeue_space) {
+			sock_in_events = DROPBEAR_EV_READ;
 		}
 
 		/* Ordering is important, this test must occur after any other function
 		might have queued packets (such as connection handlers) */
-		if (ses.sock_out != -1 && !isempty(&ses.writequeue)) {
-			FD_SET(ses.sock_out, &writefd);
+		sock_out_events = 0;
+		if (ses.writequeue_len > 0) {
+			sock_out_events = DROPBEAR_EV_WRITE;
+		}
+#if SEND_QUEUE_DELAY_MS
+		/* With TCP_NOTSENT_LOWAT this wakes when the kernel has sent
+		enough of its queue for us to continue */
+		if (!writequeue_space && ses.sock_unsent > 0) {
+			sock_out_events = DROPBEAR_EV_WRITE;
+		}
+#endif
+
+		if (ses.sock_in == ses.sock_out) {
+			events_set(ses.sock_in, sock_in_events | sock_out_events, NULL);
+		} else {
+			events_set(ses.sock_in, sock_in_events, NULL);
+			events_set(ses.sock_out, sock_out_events, NULL);
 		}
 
-		val = select(ses.maxfd+1, &readfd, &writefd, NULL, &timeout);
+		/* If we were interrupted or timed out, we still want to iterate
+		 * over channels etc for reading, to handle server processes
+		 * exiting etc. No fds are ready in that case. */
+		val = events_wait(readahead ? 0 : select_timeout());
 
 		if (exitflag) {
 			dropbear_exit("Terminated by signal");
@@ -198,19 +232,10 @@ void session_loop(void(*loophandler)()) {
 			dropbear_exit("Error in select");
 		}
 
-		if (val <= 0) {
-			/* If we were interrupted or the select timed out, we still
-			 * want to iterate over channels etc for reading, to handle
-			 * server processes exiting etc. 
-			 * We don't want to read/write FDs. */
-			FD_ZERO(&writefd);
-			FD_ZERO(&readfd);
-		}
-		
 		/* We'll just empty out the pipe if required. We don't do
 		any thing with the data, since the pipe's purpose is purely to
-		wake up the select() above. */
-		if (FD_ISSET(ses.signal_pipe[0], &readfd)) {
+		wake up the events_wait() above. */
+		if (events_ready(ses.signal_pipe[0]) & DROPBEAR_EV_READ) {
 			char x;
 			TRACE(("signal pipe set"))
 			while (read(ses.signal_pipe[0], &x, 1) > 0) {}
@@ -222,7 +247,7 @@ void session_loop(void(*loophandler)()) {
 
 		/* process session socket's incoming data */
 		if (ses.sock_in != -1) {
-			if (FD_ISSET(ses.sock_in, &readfd)) {
+			if ((events_ready(ses.sock_in) & DROPBEAR_EV_READ) || readahead) {
 				if (!ses.remoteident) {
 					/* blocking read of the version string */
 					read_session_identification();
@@ -231,10 +256,21 @@ void session_loop(void(*loophandler)()) {
 				}
 			}
 			
-			/* Process the decrypted packet. After this, the read buffer
-			 * will be ready for a new packet */
-			if (ses.payload != NULL) {
+			/* Process the decrypted packet, then any further packets that
+			 * were read along with it. Stop if the replies fill the
+			 * writequeue, the rest are handled by a later iteration. */
+			while (ses.payload != NULL) {
 				process_packet();
+				if (!writequeue_has_space() || !packet_readahead_pending()) {
+					break;
+				}
+				/* the reply queue and loophandler expect to run after
+				 * each packet, as they do below */
+				maybe_flush_reply_queue();
+				if (loophandler) {
+					loophandler();
+				}
+				read_packet();
 			}
 		}
 
@@ -242,17 +278,21 @@ void session_loop(void(*loophandler)()) {
 		were being held up during a KEX */
 		maybe_flush_reply_queue();
 
-		handle_connect_fds(&writefd);
+		handle_connect_fds();
 
 		/* process pipes etc for the channels, ses.dataallowed == 0
 		 * during rekeying ) */
-		channelio(&readfd, &writefd);
+		channelio();
 
 		/* process session socket's outgoing data */
 		if (ses.sock_out != -1) {
-			if (!isempty(&ses.writequeue)) {
+			if (ses.writequeue_len > 0) {
 				write_packet();
 			}
+			update_send_queue();
+#if DROPBEAR_TX_ZEROCOPY
+			zerocopy_reap();
+#endif
 		}
 
 
@@ -302,10 +342,6 @@ void session_cleanup() {
 
 	remove_connect_pending();
 
-	while (!isempty(&ses.writequeue)) {
-		buf_free(dequeue(&ses.writequeue));
-	}
-
 	m_free(ses.remoteident);
 	m_free(ses.authstate.pw_dir);
 	m_free(ses.authstate.pw_name);
@@ -318,24 +354,32 @@ void session_cleanup() {
 	cleanup_buf(&ses.hash);
 	cleanup_buf(&ses.payload);
 	cleanup_buf(&ses.readbuf);
+	cleanup_buf(&ses.readahead);
+#if DROPBEAR_TX_ZEROCOPY
+	zerocopy_cleanup();
+#endif
+	cleanup_buf(&ses.writequeue);
 	cleanup_buf(&ses.writepayload);
 	cleanup_buf(&ses.kexhashbuf);
 	cleanup_buf(&ses.transkexinit);
+	buf_pool_cleanup();
+	cbuf_pool_cleanup();
+	events_cleanup();
 	if (ses.dh_K) {
 		mp_clear(ses.dh_K);
 	}
 	m_free(ses.dh_K);
 
+	kex_cleanup_keys();
 	m_burn(ses.keys, sizeof(struct key_context));
 	m_free(ses.keys);
 
-	TRACE(("leave session_cleanup"))
+	TRACE(("leave session_cleanup: %lu allocations, %u packets sent, %u received",
+		m_alloc_count, ses.transseq, ses.recvseq))
 }
 
 void send_session_identification() {
-	buffer *writebuf = buf_new(strlen(LOCAL_IDENT "\r\n") + 1);
-	buf_putbytes(writebuf, (const unsigned char *) LOCAL_IDENT "\r\n", strlen(LOCAL_IDENT "\r\n"));
-	writebuf_enqueue(writebuf, 0);
+	writequeue_putbytes((const unsigned char *) LOCAL_IDENT "\r\n", strlen(LOCAL_IDENT "\r\n"));
 }
 
 static void read_session_identification() {
@@ -547,11 +591,13 @@ static void update_timeout(long limit, long now, long last_event, long * timeout
 	}
 }
 
+/* In milliseconds */
 static long select_timeout() {
 	/* determine the minimum timeout that might be required, so
 	as to avoid waking when unneccessary */
 	long timeout = KEX_REKEY_TIMEOUT;
 	long now = monotonic_now();
+	long hold;
 
 	if (!ses.kexstate.sentkexinit) {
 		update_timeout(KEX_REKEY_TIMEOUT, now, ses.kexstate.lastkextime, &timeout);
@@ -572,7 +618,15 @@ static long select_timeout() {
 		&timeout);
 
 	/* clamp negative timeouts to zero - event has already triggered */
-	return MAX(timeout, 0);
+	timeout = MAX(timeout, 0) * 1000;
+
+	/* interactive channel output being held back, or exited channels
+	 * waiting for the last of it */
+	hold = channel_timeout();
+	if (hold >= 0) {
+		timeout = MIN(timeout, hold);
+	}
+	return timeout;
 }
 
 const char* get_user_shell() {
@@ -623,8 +677,6 @@ void fill_passwd(const char* username) {
 /* Called when channels are modified */
 void update_channel_prio() {
 	enum dropbear_prio new_prio;
-	int any = 0;
-	unsigned int i;
 
 	TRACE(("update_channel_prio"))
 
@@ -633,30 +685,13 @@ void update_channel_prio() {
 		return;
 	}
 
-	new_prio = DROPBEAR_PRIO_BULK;
-	for (i = 0; i < ses.chansize; i++) {
-		struct Channel *channel = ses.channels[i];
-		if (!channel || channel->prio == DROPBEAR_CHANNEL_PRIO_EARLY) {
-			if (channel && channel->prio == DROPBEAR_CHANNEL_PRIO_EARLY) {
-				TRACE(("update_channel_prio: early %d", channel->index))
-			}
-			continue;
-		}
-		any = 1;
-		if (channel->prio == DROPBEAR_CHANNEL_PRIO_INTERACTIVE)
-		{
-			TRACE(("update_channel_prio: lowdelay %d", channel->index))
-			new_prio = DROPBEAR_PRIO_LOWDELAY;
-			break;
-		} else if (channel->prio == DROPBEAR_CHANNEL_PRIO_UNKNOWABLE
-			&& new_prio == DROPBEAR_PRIO_BULK)
-		{
-			TRACE(("update_channel_prio: unknowable %d", channel->index))
-			new_prio = DROPBEAR_PRIO_DEFAULT;
-		}
-	}
-
-	if (any == 0) {
+	if (ses.chan_prio_count[DROPBEAR_CHANNEL_PRIO_INTERACTIVE] > 0) {
+		new_prio = DROPBEAR_PRIO_LOWDELAY;
+	} else if (ses.chan_prio_count[DROPBEAR_CHANNEL_PRIO_UNKNOWABLE] > 0) {
+		new_prio = DROPBEAR_PRIO_DEFAULT;
+	} else if (ses.chan_prio_count[DROPBEAR_CHANNEL_PRIO_BULK] > 0) {
+		new_prio = DROPBEAR_PRIO_BULK;
+	} else {
 		/* lowdelay during setup */
 		TRACE(("update_channel_prio: not any"))
 		new_prio = DROPBEAR_PRIO_LOWDELAY;
@@ -9,13 +9,33 @@
 #endif
 
 
+#if DROPBEAR_AES
+/* The AES-NI and bitsliced implementations register under the same "aes"
+ * name, so the choice made here is used by everything that looks up "aes".
+ * Without AES instructions the constant time bitsliced code is preferred
+ * over the cache-timing prone table implementation, unless
+ * DROPBEAR_AES_CONSTANT_TIME is turned off. */
+static const struct ltc_cipher_descriptor *aes_desc_for_cpu(void) {
+#ifdef LTC_AESNI
+	if (crypt_cpu_features() & LTC_CPU_AESNI) {
+		return &aesni_desc;
+	}
+#endif
+#if defined(LTC_AES_CT) && DROPBEAR_AES_CONSTANT_TIME
+	return &aes_ct_desc;
+#else
+	return &aes_desc;
+#endif
+}
+#endif
+
 /* Register the compiled in ciphers.
  * This should be run before using any of the ciphers/hashes */
 void crypto_init() {
 
 	const struct ltc_cipher_descriptor *regciphers[] = {
 #if DROPBEAR_AES
-		&aes_desc,
+		aes_desc_for_cpu(),
 #endif
 #if DROPBEAR_BLOWFISH
 		&blowfish_desc,
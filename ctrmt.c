@@ -0,0 +1,288 @@
+/*
+ * Dropbear SSH
+ * 
+ * Copyright (c) 2002,2003 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#include "includes.h"
+#include "algo.h"
+#include "dbutil.h"
+#include "ctrmt.h"
+
+#if DROPBEAR_CTR_THREADS
+
+#include <pthread.h>
+
+/* Counter mode with the keystream generated ahead of time by worker
+ * threads, as in HPN-SSH. The keystream only depends on the key and
+ * the counter, so workers fill a ring of CTR_MT_BUFFERS buffers in any
+ * order and the session thread XORs the data with them in sequence.
+ * A buffer is handed back to be refilled, further along the counter,
+ * once it has been used up. */
+
+#define CTRMT_EMPTY 0
+#define CTRMT_FILLING 1
+#define CTRMT_READY 2
+
+struct ctrmt_buf {
+	/* counter blocks from the initial IV that the keystream starts at */
+	uint64_t block;
+	int state;
+	unsigned char ks[CTR_MT_BUFFER_LEN];
+};
+
+struct ctrmt_ctx {
+	pthread_mutex_t lock;
+	pthread_cond_t ready; /* a buffer was filled */
+	pthread_cond_t empty; /* a buffer was used up, or quit was set */
+	int quit;
+
+	pthread_t threads[DROPBEAR_CTR_THREADS];
+	unsigned int nthreads;
+	/* threads don't survive fork(), a child mustn't wait for them */
+	pid_t pid;
+
+	int cipher;
+	int keylen;
+	unsigned char key[MAX_KEY_LEN];
+	unsigned char iv[MAXBLOCKSIZE];
+	unsigned int blocklen;
+	uint64_t next_block; /* where the next used up buffer continues */
+
+	/* only used by the session thread */
+	unsigned int cur;
+	unsigned int pos;
+	int cur_ready;
+
+	struct ctrmt_buf bufs[CTR_MT_BUFFERS];
+};
+
+/* Set the counter in ctr so that the next keystream is for the given
+ * block of the stream */
+static void ctrmt_setblock(struct ctrmt_ctx *ctx, symmetric_CTR *ctr, uint64_t block) {
+	unsigned int sum, carry = 0;
+	int i;
+
+	/* iv + block, big endian */
+	for (i = ctx->blocklen - 1; i >= 0; i--) {
+		sum = ctx->iv[i] + (unsigned int)(block & 0xff) + carry;
+		ctr->ctr[i] = sum & 0xff;
+		carry = sum >> 8;
+		block >>= 8;
+	}
+	/* less one, ctr_encrypt() increments before each block */
+	for (i = ctx->blocklen - 1; i >= 0; i--) {
+		if (ctr->ctr[i]-- != 0) {
+			break;
+		}
+	}
+	ctr->padlen = ctr->blocklen;
+}
+
+static void* ctrmt_worker(void *arg) {
+	struct ctrmt_ctx *ctx = arg;
+	struct ctrmt_buf *buf;
+	symmetric_CTR ctr;
+	unsigned int i;
+
+	if (ctr_start(ctx->cipher, ctx->iv, ctx->key, ctx->keylen, 0,
+				CTR_COUNTER_BIG_ENDIAN, &ctr) != CRYPT_OK) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		/* the earliest empty buffer is the one needed soonest */
+		buf = NULL;
+		for (i = 0; i < CTR_MT_BUFFERS; i++) {
+			if (ctx->bufs[i].state == CTRMT_EMPTY
+				&& (buf == NULL || ctx->bufs[i].block < buf->block)) {
+				buf = &ctx->bufs[i];
+			}
+		}
+		if (ctx->quit) {
+			break;
+		}
+		if (buf == NULL) {
+			pthread_cond_wait(&ctx->empty, &ctx->lock);
+			continue;
+		}
+
+		buf->state = CTRMT_FILLING;
+		pthread_mutex_unlock(&ctx->lock);
+
+		ctrmt_setblock(ctx, &ctr, buf->block);
+		memset(buf->ks, 0x0, sizeof(buf->ks));
+		ctr_encrypt(buf->ks, buf->ks, sizeof(buf->ks), &ctr);
+
+		pthread_mutex_lock(&ctx->lock);
+		buf->state = CTRMT_READY;
+		pthread_cond_broadcast(&ctx->ready);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	ctr_done(&ctr);
+	m_burn(&ctr, sizeof(ctr));
+	return NULL;
+}
+
+static int dropbear_ctrmt_start(int cipher, const unsigned char *IV,
+			const unsigned char *key, int keylen,
+			int UNUSED(num_rounds), dropbear_ctrmt_state *state) {
+	struct ctrmt_ctx *ctx;
+	uint64_t blocks;
+	unsigned int i;
+
+	TRACE2(("enter dropbear_ctrmt_start"))
+
+	if (keylen > (int)sizeof(ctx->key)
+		|| cipher_descriptor[cipher].block_length > MAXBLOCKSIZE
+		|| CTR_MT_BUFFER_LEN % cipher_descriptor[cipher].block_length != 0) {
+		return CRYPT_INVALID_ARG;
+	}
+
+	ctx = m_malloc(sizeof(*ctx));
+	ctx->cipher = cipher;
+	ctx->keylen = keylen;
+	memcpy(ctx->key, key, keylen);
+	ctx->blocklen = cipher_descriptor[cipher].block_length;
+	memcpy(ctx->iv, IV, ctx->blocklen);
+
+	blocks = CTR_MT_BUFFER_LEN / ctx->blocklen;
+	for (i = 0; i < CTR_MT_BUFFERS; i++) {
+		ctx->bufs[i].block = i * blocks;
+		ctx->bufs[i].state = CTRMT_EMPTY;
+	}
+	ctx->next_block = CTR_MT_BUFFERS * blocks;
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->ready, NULL);
+	pthread_cond_init(&ctx->empty, NULL);
+	ctx->pid = getpid();
+
+	for (i = 0; i < DROPBEAR_CTR_THREADS; i++) {
+		if (pthread_create(&ctx->threads[ctx->nthreads], NULL,
+					ctrmt_worker, ctx) != 0) {
+			TRACE(("dropbear_ctrmt_start: thread %u failed", i))
+			break;
+		}
+		ctx->nthreads++;
+	}
+	state->ctx = ctx;
+	if (ctx->nthreads == 0) {
+		return CRYPT_ERROR;
+	}
+
+	TRACE2(("leave dropbear_ctrmt_start"))
+	return CRYPT_OK;
+}
+
+/* Encryption and decryption are the same, XOR with the keystream */
+static int dropbear_ctrmt_crypt(const unsigned char *in, unsigned char *out,
+			unsigned long len, dropbear_ctrmt_state *state) {
+	struct ctrmt_ctx *ctx = state->ctx;
+	struct ctrmt_buf *buf;
+	const unsigned char *ks;
+	uint64_t word, kword;
+	unsigned long i, n;
+
+	while (len > 0) {
+		buf = &ctx->bufs[ctx->cur];
+		if (!ctx->cur_ready) {
+			pthread_mutex_lock(&ctx->lock);
+			while (buf->state != CTRMT_READY) {
+				pthread_cond_wait(&ctx->ready, &ctx->lock);
+			}
+			pthread_mutex_unlock(&ctx->lock);
+			ctx->cur_ready = 1;
+		}
+
+		n = MIN(len, CTR_MT_BUFFER_LEN - ctx->pos);
+		ks = &buf->ks[ctx->pos];
+		for (i = 0; i + sizeof(word) <= n; i += sizeof(word)) {
+			memcpy(&word, &in[i], sizeof(word));
+			memcpy(&kword, &ks[i], sizeof(kword));
+			word ^= kword;
+			memcpy(&out[i], &word, sizeof(word));
+		}
+		for (; i < n; i++) {
+			out[i] = in[i] ^ ks[i];
+		}
+		in += n;
+		out += n;
+		len -= n;
+		ctx->pos += n;
+
+		if (ctx->pos == CTR_MT_BUFFER_LEN) {
+			/* used up, refill it further along */
+			pthread_mutex_lock(&ctx->lock);
+			buf->block = ctx->next_block;
+			buf->state = CTRMT_EMPTY;
+			ctx->next_block += CTR_MT_BUFFER_LEN / ctx->blocklen;
+			pthread_cond_signal(&ctx->empty);
+			pthread_mutex_unlock(&ctx->lock);
+
+			ctx->cur = (ctx->cur + 1) % CTR_MT_BUFFERS;
+			ctx->pos = 0;
+			ctx->cur_ready = 0;
+		}
+	}
+	return CRYPT_OK;
+}
+
+/* Stop the workers and free the keystream */
+static void dropbear_ctrmt_cleanup(dropbear_ctrmt_state *state) {
+	struct ctrmt_ctx *ctx = state->ctx;
+	unsigned int i;
+
+	if (ctx == NULL) {
+		return;
+	}
+	state->ctx = NULL;
+
+	if (ctx->pid != getpid()) {
+		/* a forked child, the workers only exist in the parent */
+		m_burn(ctx, sizeof(*ctx));
+		m_free(ctx);
+		return;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->quit = 1;
+	pthread_cond_broadcast(&ctx->empty);
+	pthread_mutex_unlock(&ctx->lock);
+	for (i = 0; i < ctx->nthreads; i++) {
+		pthread_join(ctx->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&ctx->empty);
+	pthread_cond_destroy(&ctx->ready);
+	pthread_mutex_destroy(&ctx->lock);
+	m_burn(ctx, sizeof(*ctx));
+	m_free(ctx);
+}
+
+const struct dropbear_cipher_mode dropbear_mode_ctrmt =
+	{(void *)dropbear_ctrmt_start, (void *)dropbear_ctrmt_crypt,
+	 (void *)dropbear_ctrmt_crypt, NULL, NULL, NULL,
+	 (void *)dropbear_ctrmt_cleanup};
+
+#endif /* DROPBEAR_CTR_THREADS */
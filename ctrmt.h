@@ -1,5 +1,5 @@
 /*
- * Dropbear - a SSH2 server
+ * Dropbear SSH
  * 
  * Copyright (c) 2002,2003 Matt Johnston
  * All rights reserved.
@@ -22,28 +22,22 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE. */
 
-#ifndef DROPBEAR_QUEUE_H_
-#define DROPBEAR_QUEUE_H_
+#ifndef DROPBEAR_CTRMT_H_
+#define DROPBEAR_CTRMT_H_
 
-struct Link {
+#include "includes.h"
+#include "algo.h"
 
-	void* item;
-	struct Link* link;
+#if DROPBEAR_CTR_THREADS
 
-};
+struct ctrmt_ctx;
 
-struct Queue {
+typedef struct {
+	struct ctrmt_ctx *ctx;
+} dropbear_ctrmt_state;
 
-	struct Link* head;
-	struct Link* tail;
-	unsigned int count;
+extern const struct dropbear_cipher_mode dropbear_mode_ctrmt;
 
-};
+#endif /* DROPBEAR_CTR_THREADS */
 
-void initqueue(struct Queue* queue);
-int isempty(struct Queue* queue);
-void* dequeue(struct Queue* queue);
-void *examine(struct Queue* queue);
-void enqueue(struct Queue* queue, void* item);
-
-#endif
+#endif /* DROPBEAR_CTRMT_H_ */
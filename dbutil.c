@@ -520,10 +520,19 @@ void m_close(int fd) {
 	}
 }
 	
+#if DEBUG_TRACE
+/* Count of m_malloc() and m_realloc() calls, to check that the
+ * packet path doesn't allocate once a session is running */
+unsigned long m_alloc_count = 0;
+#endif
+
 void * m_malloc(size_t size) {
 
 	void* ret;
 
+#if DEBUG_TRACE
+	m_alloc_count++;
+#endif
 	if (size == 0) {
 		dropbear_exit("m_malloc failed");
 	}
@@ -549,6 +558,9 @@ void * m_realloc(void* ptr, size_t size) {
 
 	void *ret;
 
+#if DEBUG_TRACE
+	m_alloc_count++;
+#endif
 	if (size == 0) {
 		dropbear_exit("m_realloc failed");
 	}
@@ -681,6 +693,32 @@ time_t monotonic_now() {
 	return time(NULL);
 }
 
+uint64_t monotonic_now_us() {
+#if defined(__linux__) && defined(SYS_clock_gettime)
+	/* not the coarse clock, its resolution is a few milliseconds */
+	struct timespec ts;
+	if (syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts) == 0) {
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+#endif /* linux clock_gettime */
+
+#if defined(HAVE_MACH_ABSOLUTE_TIME)
+	static mach_timebase_info_data_t timebase_info;
+	if (timebase_info.denom == 0) {
+		mach_timebase_info(&timebase_info);
+	}
+	return mach_absolute_time() * timebase_info.numer / timebase_info.denom
+		/ 1000;
+#else
+	{
+		/* may go backwards, callers must allow for that */
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+#endif
+}
+
 void fsync_parent_dir(const char* fn) {
 #ifdef HAVE_LIBGEN_H
 	char *fn_dir = m_strdup(fn);
@@ -28,7 +28,6 @@
 
 #include "includes.h"
 #include "buffer.h"
-#include "queue.h"
 #include "dbhelpers.h"
 
 #ifndef DISABLE_SYSLOG
@@ -72,6 +71,9 @@ void m_close(int fd);
 void * m_malloc(size_t size);
 void * m_strdup(const char * str);
 void * m_realloc(void* ptr, size_t size);
+#if DEBUG_TRACE
+extern unsigned long m_alloc_count;
+#endif
 #define m_free(X) do {free(X); (X) = NULL;} while (0)
 void setnonblocking(int fd);
 void disallow_core(void);
@@ -89,6 +91,8 @@ int constant_time_memcmp(const void* a, const void *b, size_t n);
 /* Returns a time in seconds that doesn't go backwards - does not correspond to
 a real-world clock */
 time_t monotonic_now(void);
+/* The same in microseconds, for measuring short intervals */
+uint64_t monotonic_now_us(void);
 
 char * expand_homedir_path(const char *inpath);
 
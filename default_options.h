@@ -138,6 +138,14 @@ much traffic. */
 #define DROPBEAR_TWOFISH128 1
 #endif
 
+/* On CPUs without AES instructions, use a constant time bitsliced AES
+ * rather than the table based code, which can leak key bits through cache
+ * timing. It runs at about 80% of the tables' speed on x86. CPUs with
+ * AES-NI always use the instructions */
+#ifndef DROPBEAR_AES_CONSTANT_TIME
+#define DROPBEAR_AES_CONSTANT_TIME 1
+#endif
+
 /* Enable CBC mode for ciphers. This has security issues though
  * is the most compatible with older SSH implementations */
 #ifndef DROPBEAR_ENABLE_CBC_MODE
@@ -158,6 +166,29 @@ If you test it please contact the Dropbear author */
 #define DROPBEAR_TWOFISH_CTR 0
 #endif
 
+/* Enable AES-GCM authenticated encryption mode (aes128-gcm@openssh.com
+ * and aes256-gcm@openssh.com). Encryption and integrity are done in
+ * a single pass, GHASH uses carry-less multiply where the CPU has it */
+#ifndef DROPBEAR_ENABLE_GCM_MODE
+#define DROPBEAR_ENABLE_GCM_MODE 1
+#endif
+
+/* Number of worker threads per direction that generate the keystream for
+ * aes128-ctr and aes256-ctr ahead of time, taking the block cipher off the
+ * session's thread for fast bulk transfers. Needs pthreads. 0 encrypts
+ * in the session thread as usual */
+#ifndef DROPBEAR_CTR_THREADS
+#define DROPBEAR_CTR_THREADS 0
+#endif
+
+/* Enable Chacha20-Poly1305 authenticated encryption mode. This is
+ * generally faster than AES on CPUs without dedicated AES instructions,
+ * having the same key size. ChaCha20 uses SSE2/AVX2 or NEON vector
+ * code where the CPU supports it. */
+#ifndef DROPBEAR_CHACHA20POLY1305
+#define DROPBEAR_CHACHA20POLY1305 1
+#endif
+
 /* Message integrity. sha2-256 is recommended as a default, 
    sha1 for compatibility */
 #ifndef DROPBEAR_SHA1_HMAC
@@ -179,6 +210,13 @@ If you test it please contact the Dropbear author */
 #define DROPBEAR_MD5_HMAC 0
 #endif
 
+/* UMAC (umac-64-etm@openssh.com and umac-128-etm@openssh.com) is a
+ * universal hash MAC, several times faster than the HMACs and preferred
+ * by OpenSSH. Requires AES. */
+#ifndef DROPBEAR_UMAC
+#define DROPBEAR_UMAC 1
+#endif
+
 /* Hostkey/public key algorithms - at least one required, these are used
  * for hostkey as well as for verifying signatures with pubkey auth.
  * Removing either of these won't save very much space.
@@ -420,6 +458,21 @@ Homedir is prepended unless path begins with / */
 #ifndef DEFAULT_RECV_WINDOW
 #define DEFAULT_RECV_WINDOW 24576
 #endif
+/* Grow a channel's receive window while it is what limits the transfer
+   rate, as on high latency links. The round trip time is taken from the
+   TCP socket, and the window doubles (starting from the size above) while
+   the peer sends a window's worth per round trip. Windows are limited to
+   RECV_WINDOW_AUTOTUNE_MAX per channel, and the memory for grown windows
+   to RECV_WINDOW_AUTOTUNE_TOTAL across a session */
+#ifndef DROPBEAR_RECV_WINDOW_AUTOTUNE
+#define DROPBEAR_RECV_WINDOW_AUTOTUNE 1
+#endif
+#ifndef RECV_WINDOW_AUTOTUNE_MAX
+#define RECV_WINDOW_AUTOTUNE_MAX (16*1024*1024)
+#endif
+#ifndef RECV_WINDOW_AUTOTUNE_TOTAL
+#define RECV_WINDOW_AUTOTUNE_TOTAL (64*1024*1024)
+#endif
 /* Maximum size of a received SSH data packet - this _MUST_ be >= 32768
    in order to interoperate with other implementations */
 #ifndef RECV_MAX_PAYLOAD_LEN
@@ -430,6 +483,52 @@ Homedir is prepended unless path begins with / */
 #ifndef TRANS_MAX_PAYLOAD_LEN
 #define TRANS_MAX_PAYLOAD_LEN 16384
 #endif
+/* Incoming data is read from the socket up to this many bytes at a time,
+   and every complete packet read is handled before waiting on the socket
+   again. Larger values save system calls when receiving bulk data. */
+#ifndef RECV_READAHEAD_LEN
+#define RECV_READAHEAD_LEN 262144
+#endif
+
+/* Map channel buffers twice back to back (a memfd on Linux), so that
+   buffered data is always contiguous and a channel's receive buffer is
+   filled and flushed in a single copy and write() rather than two at the
+   wrap. Costs a few system calls and a descriptor when each buffer is
+   first used. Plain malloc()ed buffers are used if the mapping fails */
+#ifndef DROPBEAR_CBUF_DOUBLE_MAP
+#define DROPBEAR_CBUF_DOUBLE_MAP 0
+#endif
+
+/* Output from interactive (pty) channels that arrives as a continuous
+   stream is held for up to CHANNEL_COALESCE_US microseconds, or until
+   CHANNEL_COALESCE_LEN bytes are waiting, so that it's sent in fewer and
+   larger packets. Output after a pause, such as the echo of a keystroke,
+   is sent straight away. 0 disables */
+#ifndef CHANNEL_COALESCE_US
+#define CHANNEL_COALESCE_US 2000
+#endif
+#ifndef CHANNEL_COALESCE_LEN
+#define CHANNEL_COALESCE_LEN 16384
+#endif
+
+/* Keep the data waiting to go out on the session socket, both dropbear's
+   write queue and what the kernel hasn't sent yet, to about
+   SEND_QUEUE_DELAY_MS milliseconds at the connection's current rate. This
+   stops a bulk transfer from filling the socket buffer ahead of keystrokes.
+   The rate comes from TCP_INFO, which is also used to grow the socket buffers
+   to the bandwidth delay product. Linux only, 0 disables */
+#ifndef SEND_QUEUE_DELAY_MS
+#define SEND_QUEUE_DELAY_MS 10
+#endif
+
+/* Send large bulk writes from the writequeue with MSG_ZEROCOPY, so the
+   kernel sends straight from dropbear's buffer rather than copying it.
+   The buffer is kept until the kernel reports it's done with it. Only
+   helps fast (10GbE and up) links, it is turned off again if the kernel
+   reports copying anyway, as it does for loopback. Linux 4.14 or later */
+#ifndef DROPBEAR_TX_ZEROCOPY
+#define DROPBEAR_TX_ZEROCOPY 0
+#endif
 
 /* Ensure that data is transmitted every KEEPALIVE seconds. This can
 be overridden at runtime with -K. 0 disables keepalives */
@@ -0,0 +1,351 @@
+/*
+ * Dropbear SSH
+ * 
+ * Copyright (c) 2002,2003 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#include "includes.h"
+#include "event.h"
+#include "dbutil.h"
+
+#if DROPBEAR_EPOLL
+#include <sys/epoll.h>
+#endif
+
+struct event_fd {
+	void *owner;
+	unsigned char want; /* DROPBEAR_EV_* being watched */
+	unsigned char ready; /* DROPBEAR_EV_* from the last events_wait() */
+	unsigned char registered; /* known to the epoll set */
+	unsigned char always; /* can't be polled, reported ready like select() does */
+};
+
+/* indexed by fd */
+static struct event_fd *ev_fds = NULL;
+static unsigned int ev_fdsize = 0;
+
+static int *ev_readylist = NULL;
+static unsigned int ev_readycount = 0, ev_readysize = 0;
+
+static unsigned int ev_alwayscount = 0;
+
+/* select() fallback */
+static fd_set ev_readset, ev_writeset;
+static int ev_maxfd = -1;
+
+#if DROPBEAR_EPOLL
+static int ev_epollfd = -1;
+static struct epoll_event *ev_epollevents = NULL;
+static unsigned int ev_epollsize = 0;
+#endif
+
+void events_init() {
+	FD_ZERO(&ev_readset);
+	FD_ZERO(&ev_writeset);
+#if DROPBEAR_EPOLL
+	ev_epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ev_epollfd < 0) {
+		TRACE(("epoll_create1 failed, using select: %s", strerror(errno)))
+	} else {
+		ev_epollsize = 64;
+		ev_epollevents = m_malloc(ev_epollsize * sizeof(struct epoll_event));
+	}
+#endif
+}
+
+void events_cleanup() {
+#if DROPBEAR_EPOLL
+	if (ev_epollfd >= 0) {
+		m_close(ev_epollfd);
+		ev_epollfd = -1;
+	}
+	m_free(ev_epollevents);
+	ev_epollsize = 0;
+#endif
+	m_free(ev_fds);
+	ev_fdsize = 0;
+	m_free(ev_readylist);
+	ev_readycount = ev_readysize = 0;
+	ev_alwayscount = 0;
+	ev_maxfd = -1;
+}
+
+static struct event_fd* get_event_fd(int fd) {
+	unsigned int newsize;
+
+	if ((unsigned int)fd >= ev_fdsize) {
+		newsize = MAX(MAX(ev_fdsize * 2, 64), (unsigned int)fd + 1);
+		ev_fds = m_realloc(ev_fds, newsize * sizeof(struct event_fd));
+		memset(&ev_fds[ev_fdsize], 0x0, (newsize - ev_fdsize) * sizeof(struct event_fd));
+		ev_fdsize = newsize;
+	}
+	return &ev_fds[fd];
+}
+
+static void set_always(struct event_fd *e) {
+	if (!e->always) {
+		e->always = 1;
+		ev_alwayscount++;
+	}
+}
+
+#if DROPBEAR_EPOLL
+static void epoll_update(int fd, struct event_fd *e) {
+	struct epoll_event ev;
+	int op;
+
+	if (e->want == 0) {
+		if (e->registered) {
+			/* may already be gone if the fd was closed */
+			epoll_ctl(ev_epollfd, EPOLL_CTL_DEL, fd, NULL);
+			e->registered = 0;
+		}
+		return;
+	}
+
+	memset(&ev, 0x0, sizeof(ev));
+	ev.data.fd = fd;
+	if (e->want & DROPBEAR_EV_READ) {
+		ev.events |= EPOLLIN;
+	}
+	if (e->want & DROPBEAR_EV_WRITE) {
+		ev.events |= EPOLLOUT;
+	}
+
+	op = e->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(ev_epollfd, op, fd, &ev) < 0) {
+		if (errno == ENOENT || errno == EEXIST) {
+			/* the fd was closed and reused without events_remove() */
+			op = (errno == ENOENT) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+			if (epoll_ctl(ev_epollfd, op, fd, &ev) < 0) {
+				dropbear_exit("epoll_ctl failed: %s", strerror(errno));
+			}
+		} else if (errno == EPERM) {
+			/* regular files and the like can't be polled */
+			set_always(e);
+			return;
+		} else {
+			dropbear_exit("epoll_ctl failed: %s", strerror(errno));
+		}
+	}
+	e->registered = 1;
+}
+#endif
+
+static void select_update(int fd, struct event_fd *e) {
+	if (fd >= FD_SETSIZE) {
+		dropbear_exit("fd %d too large for select", fd);
+	}
+	if (e->want & DROPBEAR_EV_READ) {
+		FD_SET(fd, &ev_readset);
+	} else {
+		FD_CLR(fd, &ev_readset);
+	}
+	if (e->want & DROPBEAR_EV_WRITE) {
+		FD_SET(fd, &ev_writeset);
+	} else {
+		FD_CLR(fd, &ev_writeset);
+	}
+	if (e->want) {
+		ev_maxfd = MAX(ev_maxfd, fd);
+	}
+}
+
+void events_set(int fd, int events, void *owner) {
+	struct event_fd *e;
+
+	if (fd < 0) {
+		return;
+	}
+
+	e = get_event_fd(fd);
+	e->owner = owner;
+	if (e->want == events) {
+		return;
+	}
+	e->want = events;
+	if (e->always) {
+		return;
+	}
+
+#if DROPBEAR_EPOLL
+	if (ev_epollfd >= 0) {
+		epoll_update(fd, e);
+		return;
+	}
+#endif
+	select_update(fd, e);
+}
+
+void events_remove(int fd) {
+	struct event_fd *e;
+
+	if (fd < 0 || (unsigned int)fd >= ev_fdsize) {
+		return;
+	}
+
+	events_set(fd, 0, NULL);
+	e = &ev_fds[fd];
+	if (e->always) {
+		ev_alwayscount--;
+	}
+	memset(e, 0x0, sizeof(*e));
+}
+
+static void add_ready(int fd, int events) {
+	struct event_fd *e = &ev_fds[fd];
+
+	events &= e->want;
+	if (events == 0) {
+		return;
+	}
+	if (ev_readycount == ev_readysize) {
+		ev_readysize = MAX(ev_readysize * 2, 64);
+		ev_readylist = m_realloc(ev_readylist, ev_readysize * sizeof(int));
+	}
+	if (e->ready == 0) {
+		ev_readylist[ev_readycount++] = fd;
+	}
+	e->ready |= events;
+}
+
+#if DROPBEAR_EPOLL
+static int epoll_wait_events(long timeout) {
+	int n, i, events;
+	unsigned int ev;
+
+	n = epoll_wait(ev_epollfd, ev_epollevents, ev_epollsize,
+			timeout > INT_MAX ? INT_MAX : (int)timeout);
+	if (n < 0) {
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		ev = ev_epollevents[i].events;
+		events = 0;
+		/* errors and hangups are reported to whichever of read or
+		 * write is wanted, that call will then see the error */
+		if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+			events |= DROPBEAR_EV_READ;
+		}
+		if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+			events |= DROPBEAR_EV_WRITE;
+		}
+		add_ready(ev_epollevents[i].data.fd, events);
+	}
+
+	if ((unsigned int)n == ev_epollsize) {
+		/* there may have been more, take a larger batch next time */
+		ev_epollsize *= 2;
+		ev_epollevents = m_realloc(ev_epollevents,
+				ev_epollsize * sizeof(struct epoll_event));
+	}
+	return n;
+}
+#endif
+
+static int select_wait_events(long timeout) {
+	fd_set readfds, writefds;
+	struct timeval tv;
+	int n, fd, events;
+
+	readfds = ev_readset;
+	writefds = ev_writeset;
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	n = select(ev_maxfd + 1, &readfds, &writefds, NULL, &tv);
+	if (n <= 0) {
+		return n;
+	}
+
+	for (fd = 0; fd <= ev_maxfd; fd++) {
+		events = 0;
+		if (FD_ISSET(fd, &readfds)) {
+			events |= DROPBEAR_EV_READ;
+		}
+		if (FD_ISSET(fd, &writefds)) {
+			events |= DROPBEAR_EV_WRITE;
+		}
+		if (events) {
+			add_ready(fd, events);
+		}
+	}
+	return n;
+}
+
+int events_wait(long timeout) {
+	unsigned int i;
+	int n;
+
+	for (i = 0; i < ev_readycount; i++) {
+		ev_fds[ev_readylist[i]].ready = 0;
+	}
+	ev_readycount = 0;
+
+	if (ev_alwayscount > 0) {
+		for (i = 0; i < ev_fdsize; i++) {
+			if (ev_fds[i].always) {
+				add_ready(i, ev_fds[i].want);
+			}
+		}
+		if (ev_readycount > 0) {
+			/* don't block, those are ready already */
+			timeout = 0;
+		}
+	}
+
+#if DROPBEAR_EPOLL
+	if (ev_epollfd >= 0) {
+		n = epoll_wait_events(timeout);
+	} else
+#endif
+	{
+		n = select_wait_events(timeout);
+	}
+	if (n < 0) {
+		return -1;
+	}
+
+	return ev_readycount;
+}
+
+int events_ready(int fd) {
+	if (fd < 0 || (unsigned int)fd >= ev_fdsize) {
+		return 0;
+	}
+	return ev_fds[fd].ready;
+}
+
+void* events_owner(int fd) {
+	if (fd < 0 || (unsigned int)fd >= ev_fdsize) {
+		return NULL;
+	}
+	return ev_fds[fd].owner;
+}
+
+unsigned int events_ready_count() {
+	return ev_readycount;
+}
+
+int events_ready_fd(unsigned int i) {
+	return ev_readylist[i];
+}
@@ -0,0 +1,56 @@
+/*
+ * Dropbear SSH
+ * 
+ * Copyright (c) 2002,2003 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#ifndef DROPBEAR_EVENT_H
+#define DROPBEAR_EVENT_H
+
+#include "includes.h"
+
+/* Interest in and readiness of a file descriptor */
+#define DROPBEAR_EV_READ 1
+#define DROPBEAR_EV_WRITE 2
+
+/* The session's file descriptor event backend. Descriptors stay
+ * registered until their interest changes, and each wakeup returns only
+ * the ready ones. epoll is used where available, select() otherwise. */
+void events_init(void);
+void events_cleanup(void);
+
+/* Watch fd for the given DROPBEAR_EV_* events, 0 to stop watching it.
+ * owner is returned by events_owner() for ready descriptors */
+void events_set(int fd, int events, void *owner);
+/* Forget fd entirely. Must be called before a watched fd is closed */
+void events_remove(int fd);
+
+/* Wait up to timeout milliseconds. Returns the number of ready descriptors,
+ * or -1 with errno set (EINTR) */
+int events_wait(long timeout);
+/* Ready DROPBEAR_EV_* events for fd from the last events_wait() */
+int events_ready(int fd);
+void* events_owner(int fd);
+/* Iterate the descriptors that were ready, 0 <= i < events_ready_count() */
+unsigned int events_ready_count(void);
+int events_ready_fd(unsigned int i);
+
+#endif /* DROPBEAR_EVENT_H */
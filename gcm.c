@@ -0,0 +1,132 @@
+/*
+ * Dropbear SSH
+ * 
+ * Copyright (c) 2002,2003 Matt Johnston
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE. */
+
+#include "includes.h"
+#include "algo.h"
+#include "dbutil.h"
+#include "gcm.h"
+
+#if DROPBEAR_ENABLE_GCM_MODE
+
+#define GHASH_LEN 16
+#define GCM_IVFIX_LEN 4
+#define GCM_IVCTR_LEN 8
+
+/* aes128-gcm@openssh.com and aes256-gcm@openssh.com, RFC5647 with the
+ * OpenSSH naming. The 12 byte nonce is a fixed 4 byte field followed by
+ * a 64 bit invocation counter, incremented for every packet. The packet
+ * length is sent in the clear and authenticated as AAD. */
+
+static const struct dropbear_hash dropbear_ghash =
+	{NULL, 0, GHASH_LEN, 0, 0};
+
+static int dropbear_gcm_start(int cipher, const unsigned char *IV,
+			const unsigned char *key, int keylen,
+			int UNUSED(num_rounds), dropbear_gcm_state *state) {
+	int err;
+
+	TRACE2(("enter dropbear_gcm_start"))
+
+	if ((err = gcm_init(&state->gcm, cipher, key, keylen)) != CRYPT_OK) {
+		return err;
+	}
+	memcpy(state->iv, IV, GCM_NONCE_LEN);
+
+	TRACE2(("leave dropbear_gcm_start"))
+	return CRYPT_OK;
+}
+
+/* Encrypt or decrypt a whole packet of len bytes (including the length
+ * field) from in to out, the tag follows the packet. For decryption
+ * the caller must discard the output if this fails. */
+static int dropbear_gcm_crypt(unsigned int UNUSED(seq),
+			const unsigned char *in, unsigned char *out,
+			unsigned long len, unsigned long taglen,
+			dropbear_gcm_state *state, int direction) {
+	unsigned char tag[GHASH_LEN];
+	int i, err;
+
+	TRACE2(("enter dropbear_gcm_crypt"))
+
+	if (len < 4 || taglen != GHASH_LEN) {
+		return CRYPT_ERROR;
+	}
+
+	/* the length field is authenticated but not encrypted */
+	if (out != in) {
+		memcpy(out, in, 4);
+	}
+
+	if ((err = gcm_reset(&state->gcm)) != CRYPT_OK
+		|| (err = gcm_add_iv(&state->gcm, state->iv, GCM_NONCE_LEN)) != CRYPT_OK
+		|| (err = gcm_add_aad(&state->gcm, in, 4)) != CRYPT_OK) {
+		return err;
+	}
+
+	if (direction == DROPBEAR_ENCRYPT) {
+		if ((err = gcm_process(&state->gcm, (unsigned char*)in + 4, len - 4,
+					out + 4, GCM_ENCRYPT)) != CRYPT_OK
+			|| (err = gcm_done(&state->gcm, out + len, &taglen)) != CRYPT_OK) {
+			return err;
+		}
+	} else {
+		if ((err = gcm_process(&state->gcm, out + 4, len - 4,
+					(unsigned char*)in + 4, GCM_DECRYPT)) != CRYPT_OK
+			|| (err = gcm_done(&state->gcm, tag, &taglen)) != CRYPT_OK) {
+			return err;
+		}
+		if (constant_time_memcmp(in + len, tag, taglen) != 0) {
+			return CRYPT_ERROR;
+		}
+	}
+
+	/* increment the invocation counter */
+	for (i = GCM_IVFIX_LEN + GCM_IVCTR_LEN - 1; i >= GCM_IVFIX_LEN; i--) {
+		if (++state->iv[i]) {
+			break;
+		}
+	}
+
+	TRACE2(("leave dropbear_gcm_crypt"))
+	return CRYPT_OK;
+}
+
+/* The packet length isn't encrypted */
+static int dropbear_gcm_getlength(unsigned int UNUSED(seq),
+			const unsigned char *in, unsigned int *outlen,
+			unsigned long len, dropbear_gcm_state* UNUSED(state)) {
+	if (len < 4) {
+		return CRYPT_ERROR;
+	}
+
+	LOAD32H(*outlen, in);
+	return CRYPT_OK;
+}
+
+const struct dropbear_cipher_mode dropbear_mode_gcm =
+	{(void *)dropbear_gcm_start, NULL, NULL,
+	 (void *)dropbear_gcm_crypt,
+	 (void *)dropbear_gcm_getlength, &dropbear_ghash, NULL};
+
+#endif /* DROPBEAR_ENABLE_GCM_MODE */
@@ -1,5 +1,5 @@
 /*
- * Dropbear - a SSH2 server
+ * Dropbear SSH
  * 
  * Copyright (c) 2002,2003 Matt Johnston
  * All rights reserved.
@@ -22,66 +22,23 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE. */
 
-#include "includes.h"
-#include "dbutil.h"
-#include "queue.h"
-
-void initqueue(struct Queue* queue) {
-
-	queue->head = NULL;
-	queue->tail = NULL;
-	queue->count = 0;
-}
-
-int isempty(struct Queue* queue) {
-
-	return (queue->head == NULL);
-}
-	
-void* dequeue(struct Queue* queue) {
+#ifndef DROPBEAR_DROPBEAR_GCM_H_
+#define DROPBEAR_DROPBEAR_GCM_H_
 
-	void* ret;
-	struct Link* oldhead;
-	dropbear_assert(!isempty(queue));
-	
-	ret = queue->head->item;
-	oldhead = queue->head;
-	
-	if (oldhead->link != NULL) {
-		queue->head = oldhead->link;
-	} else {
-		queue->head = NULL;
-		queue->tail = NULL;
-		TRACE(("empty queue dequeing"))
-	}
-
-	m_free(oldhead);
-	queue->count--;
-	return ret;
-}
-
-void *examine(struct Queue* queue) {
-
-	dropbear_assert(!isempty(queue));
-	return queue->head->item;
-}
+#include "includes.h"
+#include "algo.h"
 
-void enqueue(struct Queue* queue, void* item) {
+#if DROPBEAR_ENABLE_GCM_MODE
 
-	struct Link* newlink;
+#define GCM_NONCE_LEN 12
 
-	newlink = (struct Link*)m_malloc(sizeof(struct Link));
+typedef struct {
+	gcm_state gcm;
+	unsigned char iv[GCM_NONCE_LEN];
+} dropbear_gcm_state;
 
-	newlink->item = item;
-	newlink->link = NULL;
+extern const struct dropbear_cipher_mode dropbear_mode_gcm;
 
-	if (queue->tail != NULL) {
-		queue->tail->link = newlink;
-	}
-	queue->tail = newlink;
+#endif /* DROPBEAR_ENABLE_GCM_MODE */
 
-	if (queue->head == NULL) {
-		queue->head = newlink;
-	}
-	queue->count++;
-}
+#endif /* DROPBEAR_DROPBEAR_GCM_H_ */
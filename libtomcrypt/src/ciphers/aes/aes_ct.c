@@ -0,0 +1,544 @@
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ *
+ * Tom St Denis, tomstdenis@gmail.com, http://libtomcrypt.com
+ */
+#include "tomcrypt.h"
+
+/**
+  @file aes_ct.c
+  Constant time bitsliced AES encryption, 4 blocks per pass in 64 bit
+  words, in the style of BearSSL's aes_ct64.
+
+  Every byte of the 4 blocks is spread over eight 64 bit words, one per
+  bit, so SubBytes is a fixed boolean circuit (Boyar and Peralta) and
+  no table is indexed by secret data.  With GCC on SSE2 or NEON the
+  words are 128 bit vectors of two such 64 bit lanes, 8 blocks per pass.
+  Only encryption is bitsliced, which covers CTR and GCM; decryption
+  uses the table based rijndael_ecb_decrypt() with the dK schedule,
+  which is left intact.
+  The encryption round keys are stored in eK in a compressed bitsliced
+  form (two words per round) and expanded on each call.
+*/
+
+#if defined(RIJNDAEL) && defined(LTC_AES_CT)
+
+#if defined(__GNUC__) && (defined(__SSE2__) || defined(__ARM_NEON))
+/* two independent 4 block states side by side */
+typedef ulong64 aes_ct_word __attribute__((vector_size(16)));
+#define AES_CT_LANES 2
+#define AES_CT_LANE(x, l) ((x)[l])
+#define AES_CT_SPLAT(x)   ((aes_ct_word){ (x), (x) })
+#else
+typedef ulong64 aes_ct_word;
+#define AES_CT_LANES 1
+#define AES_CT_LANE(x, l) (x)
+#define AES_CT_SPLAT(x)   (x)
+#endif
+
+#define AES_CT_PAR (4 * AES_CT_LANES)
+
+/* the round steps are small, keeping the state in registers across them
+ * is worth a lot */
+#ifdef __GNUC__
+#define AES_CT_INLINE static inline __attribute__((always_inline))
+#else
+#define AES_CT_INLINE static
+#endif
+
+const struct ltc_cipher_descriptor aes_ct_desc =
+{
+    "aes",
+    6,
+    16, 32, 16, 10,
+    aes_ct_setup, aes_ct_ecb_encrypt, rijndael_ecb_decrypt, rijndael_test, rijndael_done, rijndael_keysize,
+    aes_ct_accel_ecb_encrypt, NULL, NULL, NULL,
+    aes_ct_accel_ctr_encrypt, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+/* SubBytes on the bitsliced state, q[0] holds the least significant bit */
+AES_CT_INLINE void aes_ct_sbox(aes_ct_word *q)
+{
+   aes_ct_word x0, x1, x2, x3, x4, x5, x6, x7;
+   aes_ct_word y1, y2, y3, y4, y5, y6, y7, y8, y9;
+   aes_ct_word y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+   aes_ct_word y20, y21;
+   aes_ct_word z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+   aes_ct_word z10, z11, z12, z13, z14, z15, z16, z17;
+   aes_ct_word t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+   aes_ct_word t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+   aes_ct_word t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+   aes_ct_word t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+   aes_ct_word t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+   aes_ct_word t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+   aes_ct_word t60, t61, t62, t63, t64, t65, t66, t67;
+   aes_ct_word s0, s1, s2, s3, s4, s5, s6, s7;
+
+   x0 = q[7]; x1 = q[6]; x2 = q[5]; x3 = q[4];
+   x4 = q[3]; x5 = q[2]; x6 = q[1]; x7 = q[0];
+
+   /* top linear transformation */
+   y14 = x3 ^ x5;
+   y13 = x0 ^ x6;
+   y9  = x0 ^ x3;
+   y8  = x0 ^ x5;
+   t0  = x1 ^ x2;
+   y1  = t0 ^ x7;
+   y4  = y1 ^ x3;
+   y12 = y13 ^ y14;
+   y2  = y1 ^ x0;
+   y5  = y1 ^ x6;
+   y3  = y5 ^ y8;
+   t1  = x4 ^ y12;
+   y15 = t1 ^ x5;
+   y20 = t1 ^ x1;
+   y6  = y15 ^ x7;
+   y10 = y15 ^ t0;
+   y11 = y20 ^ y9;
+   y7  = x7 ^ y11;
+   y17 = y10 ^ y11;
+   y19 = y10 ^ y8;
+   y16 = t0 ^ y11;
+   y21 = y13 ^ y16;
+   y18 = x0 ^ y16;
+
+   /* non-linear section */
+   t2  = y12 & y15;
+   t3  = y3 & y6;
+   t4  = t3 ^ t2;
+   t5  = y4 & x7;
+   t6  = t5 ^ t2;
+   t7  = y13 & y16;
+   t8  = y5 & y1;
+   t9  = t8 ^ t7;
+   t10 = y2 & y7;
+   t11 = t10 ^ t7;
+   t12 = y9 & y11;
+   t13 = y14 & y17;
+   t14 = t13 ^ t12;
+   t15 = y8 & y10;
+   t16 = t15 ^ t12;
+   t17 = t4 ^ t14;
+   t18 = t6 ^ t16;
+   t19 = t9 ^ t14;
+   t20 = t11 ^ t16;
+   t21 = t17 ^ y20;
+   t22 = t18 ^ y19;
+   t23 = t19 ^ y21;
+   t24 = t20 ^ y18;
+
+   t25 = t21 ^ t22;
+   t26 = t21 & t23;
+   t27 = t24 ^ t26;
+   t28 = t25 & t27;
+   t29 = t28 ^ t22;
+   t30 = t23 ^ t24;
+   t31 = t22 ^ t26;
+   t32 = t31 & t30;
+   t33 = t32 ^ t24;
+   t34 = t23 ^ t33;
+   t35 = t27 ^ t33;
+   t36 = t24 & t35;
+   t37 = t36 ^ t34;
+   t38 = t27 ^ t36;
+   t39 = t29 & t38;
+   t40 = t25 ^ t39;
+
+   t41 = t40 ^ t37;
+   t42 = t29 ^ t33;
+   t43 = t29 ^ t40;
+   t44 = t33 ^ t37;
+   t45 = t42 ^ t41;
+   z0  = t44 & y15;
+   z1  = t37 & y6;
+   z2  = t33 & x7;
+   z3  = t43 & y16;
+   z4  = t40 & y1;
+   z5  = t29 & y7;
+   z6  = t42 & y11;
+   z7  = t45 & y17;
+   z8  = t41 & y10;
+   z9  = t44 & y12;
+   z10 = t37 & y3;
+   z11 = t33 & y4;
+   z12 = t43 & y13;
+   z13 = t40 & y5;
+   z14 = t29 & y2;
+   z15 = t42 & y9;
+   z16 = t45 & y14;
+   z17 = t41 & y8;
+
+   /* bottom linear transformation */
+   t46 = z15 ^ z16;
+   t47 = z10 ^ z11;
+   t48 = z5 ^ z13;
+   t49 = z9 ^ z10;
+   t50 = z2 ^ z12;
+   t51 = z2 ^ z5;
+   t52 = z7 ^ z8;
+   t53 = z0 ^ z3;
+   t54 = z6 ^ z7;
+   t55 = z16 ^ z17;
+   t56 = z12 ^ t48;
+   t57 = t50 ^ t53;
+   t58 = z4 ^ t46;
+   t59 = z3 ^ t54;
+   t60 = t46 ^ t57;
+   t61 = z14 ^ t57;
+   t62 = t52 ^ t58;
+   t63 = t49 ^ t58;
+   t64 = z4 ^ t59;
+   t65 = t61 ^ t62;
+   t66 = z1 ^ t63;
+   s0  = t59 ^ t63;
+   s6  = t56 ^ ~t62;
+   s7  = t48 ^ ~t60;
+   t67 = t64 ^ t65;
+   s3  = t53 ^ t66;
+   s4  = t51 ^ t66;
+   s5  = t47 ^ t65;
+   s1  = t64 ^ ~s3;
+   s2  = t55 ^ ~t67;
+
+   q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3;
+   q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+/* transpose between byte and bit order, in both directions */
+AES_CT_INLINE void aes_ct_ortho(aes_ct_word *q)
+{
+#define SWAPN(cl, ch, s, x, y) do { \
+      aes_ct_word a_, b_; \
+      a_ = (x); b_ = (y); \
+      (x) = (a_ & CONST64(cl)) | ((b_ & CONST64(cl)) << (s)); \
+      (y) = ((a_ & CONST64(ch)) >> (s)) | (b_ & CONST64(ch)); \
+   } while (0)
+#define SWAP2(x, y) SWAPN(0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1, x, y)
+#define SWAP4(x, y) SWAPN(0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2, x, y)
+#define SWAP8(x, y) SWAPN(0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4, x, y)
+
+   SWAP2(q[0], q[1]); SWAP2(q[2], q[3]); SWAP2(q[4], q[5]); SWAP2(q[6], q[7]);
+   SWAP4(q[0], q[2]); SWAP4(q[1], q[3]); SWAP4(q[4], q[6]); SWAP4(q[5], q[7]);
+   SWAP8(q[0], q[4]); SWAP8(q[1], q[5]); SWAP8(q[2], q[6]); SWAP8(q[3], q[7]);
+
+#undef SWAP8
+#undef SWAP4
+#undef SWAP2
+#undef SWAPN
+}
+
+/* spread one block (as little endian words) over two words */
+static void aes_ct_interleave_in(ulong64 *q0, ulong64 *q1, const ulong32 *w)
+{
+   ulong64 x0, x1, x2, x3;
+
+   x0 = w[0]; x1 = w[1]; x2 = w[2]; x3 = w[3];
+   x0 |= (x0 << 16); x1 |= (x1 << 16); x2 |= (x2 << 16); x3 |= (x3 << 16);
+   x0 &= CONST64(0x0000FFFF0000FFFF); x1 &= CONST64(0x0000FFFF0000FFFF);
+   x2 &= CONST64(0x0000FFFF0000FFFF); x3 &= CONST64(0x0000FFFF0000FFFF);
+   x0 |= (x0 << 8); x1 |= (x1 << 8); x2 |= (x2 << 8); x3 |= (x3 << 8);
+   x0 &= CONST64(0x00FF00FF00FF00FF); x1 &= CONST64(0x00FF00FF00FF00FF);
+   x2 &= CONST64(0x00FF00FF00FF00FF); x3 &= CONST64(0x00FF00FF00FF00FF);
+   *q0 = x0 | (x2 << 8);
+   *q1 = x1 | (x3 << 8);
+}
+
+static void aes_ct_interleave_out(ulong32 *w, ulong64 q0, ulong64 q1)
+{
+   ulong64 x0, x1, x2, x3;
+
+   x0 = q0 & CONST64(0x00FF00FF00FF00FF);
+   x1 = q1 & CONST64(0x00FF00FF00FF00FF);
+   x2 = (q0 >> 8) & CONST64(0x00FF00FF00FF00FF);
+   x3 = (q1 >> 8) & CONST64(0x00FF00FF00FF00FF);
+   x0 |= (x0 >> 8); x1 |= (x1 >> 8); x2 |= (x2 >> 8); x3 |= (x3 >> 8);
+   x0 &= CONST64(0x0000FFFF0000FFFF); x1 &= CONST64(0x0000FFFF0000FFFF);
+   x2 &= CONST64(0x0000FFFF0000FFFF); x3 &= CONST64(0x0000FFFF0000FFFF);
+   w[0] = (ulong32)x0 | (ulong32)(x0 >> 16);
+   w[1] = (ulong32)x1 | (ulong32)(x1 >> 16);
+   w[2] = (ulong32)x2 | (ulong32)(x2 >> 16);
+   w[3] = (ulong32)x3 | (ulong32)(x3 >> 16);
+}
+
+AES_CT_INLINE void aes_ct_add_round_key(aes_ct_word *q, const aes_ct_word *sk)
+{
+   q[0] ^= sk[0]; q[1] ^= sk[1]; q[2] ^= sk[2]; q[3] ^= sk[3];
+   q[4] ^= sk[4]; q[5] ^= sk[5]; q[6] ^= sk[6]; q[7] ^= sk[7];
+}
+
+AES_CT_INLINE void aes_ct_shift_rows(aes_ct_word *q)
+{
+#define SHIFT_ROW(x) \
+     (((x) & CONST64(0x000000000000FFFF)) \
+    | (((x) & CONST64(0x00000000FFF00000)) >> 4) \
+    | (((x) & CONST64(0x00000000000F0000)) << 12) \
+    | (((x) & CONST64(0x0000FF0000000000)) >> 8) \
+    | (((x) & CONST64(0x000000FF00000000)) << 8) \
+    | (((x) & CONST64(0xF000000000000000)) >> 12) \
+    | (((x) & CONST64(0x0FFF000000000000)) << 4))
+   q[0] = SHIFT_ROW(q[0]); q[1] = SHIFT_ROW(q[1]); q[2] = SHIFT_ROW(q[2]); q[3] = SHIFT_ROW(q[3]);
+   q[4] = SHIFT_ROW(q[4]); q[5] = SHIFT_ROW(q[5]); q[6] = SHIFT_ROW(q[6]); q[7] = SHIFT_ROW(q[7]);
+#undef SHIFT_ROW
+}
+
+#define ROTR32(x) (((x) << 32) | ((x) >> 32))
+
+AES_CT_INLINE void aes_ct_mix_columns(aes_ct_word *q)
+{
+   aes_ct_word q0, q1, q2, q3, q4, q5, q6, q7;
+   aes_ct_word r0, r1, r2, r3, r4, r5, r6, r7;
+
+   q0 = q[0]; q1 = q[1]; q2 = q[2]; q3 = q[3];
+   q4 = q[4]; q5 = q[5]; q6 = q[6]; q7 = q[7];
+   r0 = (q0 >> 16) | (q0 << 48);
+   r1 = (q1 >> 16) | (q1 << 48);
+   r2 = (q2 >> 16) | (q2 << 48);
+   r3 = (q3 >> 16) | (q3 << 48);
+   r4 = (q4 >> 16) | (q4 << 48);
+   r5 = (q5 >> 16) | (q5 << 48);
+   r6 = (q6 >> 16) | (q6 << 48);
+   r7 = (q7 >> 16) | (q7 << 48);
+
+   q[0] = q7 ^ r7 ^ r0 ^ ROTR32(q0 ^ r0);
+   q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ ROTR32(q1 ^ r1);
+   q[2] = q1 ^ r1 ^ r2 ^ ROTR32(q2 ^ r2);
+   q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ ROTR32(q3 ^ r3);
+   q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ ROTR32(q4 ^ r4);
+   q[5] = q4 ^ r4 ^ r5 ^ ROTR32(q5 ^ r5);
+   q[6] = q5 ^ r5 ^ r6 ^ ROTR32(q6 ^ r6);
+   q[7] = q6 ^ r6 ^ r7 ^ ROTR32(q7 ^ r7);
+}
+
+/* expand the two word per round compressed keys to eight words per round,
+   the same in every lane */
+static void aes_ct_expand_keys(aes_ct_word *sk, const symmetric_key *skey)
+{
+   ulong64 comp[2 * 15], x0, x1, x2, x3;
+   int u, n = 2 * (skey->rijndael.Nr + 1);
+
+   XMEMCPY(comp, skey->rijndael.eK, n * sizeof(ulong64));
+   for (u = 0; u < n; u++, sk += 4) {
+      x0 = x1 = x2 = x3 = comp[u];
+      x0 &= CONST64(0x1111111111111111);
+      x1 &= CONST64(0x2222222222222222);
+      x2 &= CONST64(0x4444444444444444);
+      x3 &= CONST64(0x8888888888888888);
+      x1 >>= 1;
+      x2 >>= 2;
+      x3 >>= 3;
+      sk[0] = AES_CT_SPLAT((x0 << 4) - x0);
+      sk[1] = AES_CT_SPLAT((x1 << 4) - x1);
+      sk[2] = AES_CT_SPLAT((x2 << 4) - x2);
+      sk[3] = AES_CT_SPLAT((x3 << 4) - x3);
+   }
+}
+
+/* encrypt AES_CT_PAR blocks in place */
+static void aes_ct_encrypt_par(unsigned char *blk, const aes_ct_word *sk, int Nr)
+{
+   ulong32 w[4];
+   ulong64 q0, q1;
+   aes_ct_word q[8];
+   int i, j, l;
+
+   for (l = 0; l < AES_CT_LANES; l++) {
+      for (i = 0; i < 4; i++) {
+         for (j = 0; j < 4; j++) {
+            LOAD32L(w[j], blk + 64*l + 16*i + 4*j);
+         }
+         aes_ct_interleave_in(&q0, &q1, w);
+         AES_CT_LANE(q[i], l) = q0;
+         AES_CT_LANE(q[i + 4], l) = q1;
+      }
+   }
+   aes_ct_ortho(q);
+
+   aes_ct_add_round_key(q, sk);
+   for (i = 1; i < Nr; i++) {
+      aes_ct_sbox(q);
+      aes_ct_shift_rows(q);
+      aes_ct_mix_columns(q);
+      aes_ct_add_round_key(q, sk + (i << 3));
+   }
+   aes_ct_sbox(q);
+   aes_ct_shift_rows(q);
+   aes_ct_add_round_key(q, sk + (Nr << 3));
+
+   aes_ct_ortho(q);
+   for (l = 0; l < AES_CT_LANES; l++) {
+      for (i = 0; i < 4; i++) {
+         aes_ct_interleave_out(w, AES_CT_LANE(q[i], l), AES_CT_LANE(q[i + 4], l));
+         for (j = 0; j < 4; j++) {
+            STORE32L(w[j], blk + 64*l + 16*i + 4*j);
+         }
+      }
+   }
+}
+
+/**
+   Initialize the bitsliced key schedule
+   @param key The symmetric key you wish to pass
+   @param keylen The key length in bytes
+   @param num_rounds The number of rounds desired (0 for default)
+   @param skey The key in as scheduled by this function.
+   @return CRYPT_OK if successful
+*/
+int aes_ct_setup(const unsigned char *key, int keylen, int num_rounds, symmetric_key *skey)
+{
+   ulong64 comp[2 * 15], q0, q1;
+   aes_ct_word q[8];
+   ulong32 w[4];
+   int err, i, l, r;
+
+   if ((err = rijndael_setup(key, keylen, num_rounds, skey)) != CRYPT_OK) {
+      return err;
+   }
+
+   for (r = 0; r <= skey->rijndael.Nr; r++) {
+      /* the round key words as little endian loads of their bytes */
+      for (i = 0; i < 4; i++) {
+         w[i] = BSWAP(skey->rijndael.eK[4*r + i]);
+      }
+      aes_ct_interleave_in(&q0, &q1, w);
+      for (i = 0; i < 4; i++) {
+         for (l = 0; l < AES_CT_LANES; l++) {
+            AES_CT_LANE(q[i], l) = q0;
+            AES_CT_LANE(q[i + 4], l) = q1;
+         }
+      }
+      aes_ct_ortho(q);
+      comp[2*r]     = (AES_CT_LANE(q[0], 0) & CONST64(0x1111111111111111))
+                    | (AES_CT_LANE(q[1], 0) & CONST64(0x2222222222222222))
+                    | (AES_CT_LANE(q[2], 0) & CONST64(0x4444444444444444))
+                    | (AES_CT_LANE(q[3], 0) & CONST64(0x8888888888888888));
+      comp[2*r + 1] = (AES_CT_LANE(q[4], 0) & CONST64(0x1111111111111111))
+                    | (AES_CT_LANE(q[5], 0) & CONST64(0x2222222222222222))
+                    | (AES_CT_LANE(q[6], 0) & CONST64(0x4444444444444444))
+                    | (AES_CT_LANE(q[7], 0) & CONST64(0x8888888888888888));
+   }
+
+   /* 2 words per round fit exactly in eK */
+   XMEMCPY(skey->rijndael.eK, comp, 2 * (skey->rijndael.Nr + 1) * sizeof(ulong64));
+
+#ifdef LTC_CLEAN_STACK
+   zeromem(comp, sizeof(comp));
+   zeromem(q, sizeof(q));
+   zeromem(w, sizeof(w));
+#endif
+   return CRYPT_OK;
+}
+
+/**
+  Encrypts a block of text with the bitsliced AES
+  @param pt The input plaintext (16 bytes)
+  @param ct The output ciphertext (16 bytes)
+  @param skey The key as scheduled by aes_ct_setup()
+  @return CRYPT_OK if successful
+*/
+int aes_ct_ecb_encrypt(const unsigned char *pt, unsigned char *ct, symmetric_key *skey)
+{
+   return aes_ct_accel_ecb_encrypt(pt, ct, 1, skey);
+}
+
+/**
+  ECB encrypt several blocks, AES_CT_PAR at a time (accelerator hook)
+  @param pt     The plaintext
+  @param ct     [out] The ciphertext
+  @param blocks The number of 16 byte blocks
+  @param skey   The key as scheduled by aes_ct_setup()
+  @return CRYPT_OK if successful
+*/
+int aes_ct_accel_ecb_encrypt(const unsigned char *pt, unsigned char *ct, unsigned long blocks, symmetric_key *skey)
+{
+   aes_ct_word sk[8 * 15];
+   unsigned char buf[16 * AES_CT_PAR];
+   unsigned long n;
+
+   LTC_ARGCHK(pt != NULL);
+   LTC_ARGCHK(ct != NULL);
+   LTC_ARGCHK(skey != NULL);
+
+   aes_ct_expand_keys(sk, skey);
+   while (blocks > 0) {
+      n = MIN(blocks, AES_CT_PAR);
+      XMEMCPY(buf, pt, 16 * n);
+      aes_ct_encrypt_par(buf, sk, skey->rijndael.Nr);
+      XMEMCPY(ct, buf, 16 * n);
+      pt += 16 * n;
+      ct += 16 * n;
+      blocks -= n;
+   }
+#ifdef LTC_CLEAN_STACK
+   zeromem(sk, sizeof(sk));
+   zeromem(buf, sizeof(buf));
+#endif
+   return CRYPT_OK;
+}
+
+/**
+  CTR encrypt several blocks, AES_CT_PAR at a time (accelerator hook).  As in
+  ctr_encrypt() the counter is incremented before each block is
+  encrypted, and is left holding the last counter used.
+  @param pt     The plaintext
+  @param ct     [out] The ciphertext
+  @param blocks The number of 16 byte blocks
+  @param IV     [in/out] The 128 bit counter
+  @param mode   CTR_COUNTER_LITTLE_ENDIAN or CTR_COUNTER_BIG_ENDIAN
+  @param skey   The key as scheduled by aes_ct_setup()
+  @return CRYPT_OK if successful
+*/
+int aes_ct_accel_ctr_encrypt(const unsigned char *pt, unsigned char *ct, unsigned long blocks,
+                             unsigned char *IV, int mode, symmetric_key *skey)
+{
+   aes_ct_word sk[8 * 15];
+   unsigned char buf[16 * AES_CT_PAR];
+   unsigned long n, i;
+   int x;
+
+   LTC_ARGCHK(pt != NULL);
+   LTC_ARGCHK(ct != NULL);
+   LTC_ARGCHK(IV != NULL);
+   LTC_ARGCHK(skey != NULL);
+
+   aes_ct_expand_keys(sk, skey);
+   while (blocks > 0) {
+      n = MIN(blocks, AES_CT_PAR);
+      for (i = 0; i < n; i++) {
+         if (mode == CTR_COUNTER_LITTLE_ENDIAN) {
+            for (x = 0; x < 16; x++) {
+               if (++IV[x] != 0) break;
+            }
+         } else {
+            for (x = 15; x >= 0; x--) {
+               if (++IV[x] != 0) break;
+            }
+         }
+         XMEMCPY(buf + 16*i, IV, 16);
+      }
+      aes_ct_encrypt_par(buf, sk, skey->rijndael.Nr);
+#ifdef LTC_FAST
+      for (i = 0; i < 16 * n; i += sizeof(LTC_FAST_TYPE)) {
+         *((LTC_FAST_TYPE*)(ct + i)) = *((LTC_FAST_TYPE*)(pt + i)) ^ *((LTC_FAST_TYPE*)(buf + i));
+      }
+#else
+      for (i = 0; i < 16 * n; i++) {
+         ct[i] = pt[i] ^ buf[i];
+      }
+#endif
+      pt += 16 * n;
+      ct += 16 * n;
+      blocks -= n;
+   }
+#ifdef LTC_CLEAN_STACK
+   zeromem(sk, sizeof(sk));
+   zeromem(buf, sizeof(buf));
+#endif
+   return CRYPT_OK;
+}
+
+#endif /* RIJNDAEL && LTC_AES_CT */
@@ -0,0 +1,401 @@
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ *
+ * Tom St Denis, tomstdenis@gmail.com, http://libtomcrypt.com
+ */
+#include "tomcrypt.h"
+
+/**
+  @file aes_ni.c
+  AES using the x86 AES-NI instructions, and VAES (two blocks per
+  instruction) where available.
+
+  The key is scheduled by rijndael_setup() and then rewritten in place
+  as the byte ordered round keys AES-NI expects, so a key set up through
+  aesni_desc must only be used with aesni_desc.  The multi-block hooks
+  run 8 independent blocks at a time to cover the AESENC latency.
+  Callers pick aesni_desc over aes_desc once, after checking
+  crypt_cpu_features() for LTC_CPU_AESNI.
+*/
+
+#if defined(RIJNDAEL) && defined(LTC_AESNI)
+
+#include <immintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+#define VAES_TARGET  __attribute__((target("vaes,aes,avx2")))
+
+#define AESNI_PAR 8
+
+const struct ltc_cipher_descriptor aesni_desc =
+{
+    "aes",
+    6,
+    16, 32, 16, 10,
+    aesni_setup, aesni_ecb_encrypt, aesni_ecb_decrypt, rijndael_test, rijndael_done, rijndael_keysize,
+    aesni_accel_ecb_encrypt, aesni_accel_ecb_decrypt, aesni_accel_cbc_encrypt, aesni_accel_cbc_decrypt,
+    aesni_accel_ctr_encrypt, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+static int use_vaes = -1;
+
+static int aesni_use_vaes(void)
+{
+   if (use_vaes < 0) {
+      use_vaes = (crypt_cpu_features() & (LTC_CPU_VAES | LTC_CPU_AVX2)) == (LTC_CPU_VAES | LTC_CPU_AVX2);
+   }
+   return use_vaes;
+}
+
+/* all 15 slots of the schedule, whatever the number of rounds, so rk is
+   always fully written */
+AESNI_TARGET static void aesni_load_keys(const ulong32 *K, __m128i *rk)
+{
+   int r;
+   for (r = 0; r < 15; r++) {
+      rk[r] = _mm_loadu_si128((const __m128i *)K + r);
+   }
+}
+
+/**
+   Initialize the AES-NI key schedule
+   @param key The symmetric key you wish to pass
+   @param keylen The key length in bytes
+   @param num_rounds The number of rounds desired (0 for default)
+   @param skey The key in as scheduled by this function.
+   @return CRYPT_OK if successful
+*/
+AESNI_TARGET int aesni_setup(const unsigned char *key, int keylen, int num_rounds, symmetric_key *skey)
+{
+   __m128i rk[15];
+   ulong32 w;
+   int err, i, Nr;
+
+   if ((err = rijndael_setup(key, keylen, num_rounds, skey)) != CRYPT_OK) {
+      return err;
+   }
+   Nr = skey->rijndael.Nr;
+
+   /* round key words to byte order, in place */
+   for (i = 0; i < 4 * (Nr + 1); i++) {
+      w = skey->rijndael.eK[i];
+      skey->rijndael.eK[i] = BSWAP(w);
+   }
+
+   /* equivalent inverse cipher keys for AESDEC */
+   aesni_load_keys(skey->rijndael.eK, rk);
+   _mm_storeu_si128((__m128i *)skey->rijndael.dK, rk[Nr]);
+   for (i = 1; i < Nr; i++) {
+      _mm_storeu_si128((__m128i *)skey->rijndael.dK + i, _mm_aesimc_si128(rk[Nr - i]));
+   }
+   _mm_storeu_si128((__m128i *)skey->rijndael.dK + Nr, rk[0]);
+
+   return CRYPT_OK;
+}
+
+AESNI_TARGET static inline __m128i aesni_enc1(__m128i b, const __m128i *rk, int Nr)
+{
+   int r;
+   b = _mm_xor_si128(b, rk[0]);
+   for (r = 1; r < Nr; r++) {
+      b = _mm_aesenc_si128(b, rk[r]);
+   }
+   return _mm_aesenclast_si128(b, rk[Nr]);
+}
+
+AESNI_TARGET static inline __m128i aesni_dec1(__m128i b, const __m128i *rk, int Nr)
+{
+   int r;
+   b = _mm_xor_si128(b, rk[0]);
+   for (r = 1; r < Nr; r++) {
+      b = _mm_aesdec_si128(b, rk[r]);
+   }
+   return _mm_aesdeclast_si128(b, rk[Nr]);
+}
+
+AESNI_TARGET static inline void aesni_enc8(__m128i *b, const __m128i *rk, int Nr)
+{
+   int r, i;
+   for (i = 0; i < AESNI_PAR; i++) b[i] = _mm_xor_si128(b[i], rk[0]);
+   for (r = 1; r < Nr; r++) {
+      for (i = 0; i < AESNI_PAR; i++) b[i] = _mm_aesenc_si128(b[i], rk[r]);
+   }
+   for (i = 0; i < AESNI_PAR; i++) b[i] = _mm_aesenclast_si128(b[i], rk[Nr]);
+}
+
+AESNI_TARGET static inline void aesni_dec8(__m128i *b, const __m128i *rk, int Nr)
+{
+   int r, i;
+   for (i = 0; i < AESNI_PAR; i++) b[i] = _mm_xor_si128(b[i], rk[0]);
+   for (r = 1; r < Nr; r++) {
+      for (i = 0; i < AESNI_PAR; i++) b[i] = _mm_aesdec_si128(b[i], rk[r]);
+   }
+   for (i = 0; i < AESNI_PAR; i++) b[i] = _mm_aesdeclast_si128(b[i], rk[Nr]);
+}
+
+/* the same 8 blocks as 4 x 2 with VAES */
+VAES_TARGET static void vaes_crypt8(__m128i *b, const __m128i *rk, int Nr, int decrypt)
+{
+   __m256i v[AESNI_PAR / 2], k;
+   int r, i;
+
+   for (i = 0; i < AESNI_PAR / 2; i++) {
+      v[i] = _mm256_set_m128i(b[2*i+1], b[2*i]);
+   }
+   k = _mm256_broadcastsi128_si256(rk[0]);
+   for (i = 0; i < AESNI_PAR / 2; i++) v[i] = _mm256_xor_si256(v[i], k);
+   if (decrypt) {
+      for (r = 1; r < Nr; r++) {
+         k = _mm256_broadcastsi128_si256(rk[r]);
+         for (i = 0; i < AESNI_PAR / 2; i++) v[i] = _mm256_aesdec_epi128(v[i], k);
+      }
+      k = _mm256_broadcastsi128_si256(rk[Nr]);
+      for (i = 0; i < AESNI_PAR / 2; i++) v[i] = _mm256_aesdeclast_epi128(v[i], k);
+   } else {
+      for (r = 1; r < Nr; r++) {
+         k = _mm256_broadcastsi128_si256(rk[r]);
+         for (i = 0; i < AESNI_PAR / 2; i++) v[i] = _mm256_aesenc_epi128(v[i], k);
+      }
+      k = _mm256_broadcastsi128_si256(rk[Nr]);
+      for (i = 0; i < AESNI_PAR / 2; i++) v[i] = _mm256_aesenclast_epi128(v[i], k);
+   }
+   for (i = 0; i < AESNI_PAR / 2; i++) {
+      b[2*i]   = _mm256_castsi256_si128(v[i]);
+      b[2*i+1] = _mm256_extracti128_si256(v[i], 1);
+   }
+}
+
+AESNI_TARGET static inline void aesni_crypt8(__m128i *b, const __m128i *rk, int Nr, int decrypt, int vaes)
+{
+   if (vaes) {
+      vaes_crypt8(b, rk, Nr, decrypt);
+   } else if (decrypt) {
+      aesni_dec8(b, rk, Nr);
+   } else {
+      aesni_enc8(b, rk, Nr);
+   }
+}
+
+/**
+  Encrypts a block of text with AES-NI
+  @param pt The input plaintext (16 bytes)
+  @param ct The output ciphertext (16 bytes)
+  @param skey The key as scheduled by aesni_setup()
+  @return CRYPT_OK if successful
+*/
+AESNI_TARGET int aesni_ecb_encrypt(const unsigned char *pt, unsigned char *ct, symmetric_key *skey)
+{
+   __m128i rk[15];
+
+   LTC_ARGCHK(pt != NULL);
+   LTC_ARGCHK(ct != NULL);
+   LTC_ARGCHK(skey != NULL);
+
+   aesni_load_keys(skey->rijndael.eK, rk);
+   _mm_storeu_si128((__m128i *)ct,
+      aesni_enc1(_mm_loadu_si128((const __m128i *)pt), rk, skey->rijndael.Nr));
+   return CRYPT_OK;
+}
+
+/**
+  Decrypts a block of text with AES-NI
+  @param ct The input ciphertext (16 bytes)
+  @param pt The output plaintext (16 bytes)
+  @param skey The key as scheduled by aesni_setup()
+  @return CRYPT_OK if successful
+*/
+AESNI_TARGET int aesni_ecb_decrypt(const unsigned char *ct, unsigned char *pt, symmetric_key *skey)
+{
+   __m128i rk[15];
+
+   LTC_ARGCHK(pt != NULL);
+   LTC_ARGCHK(ct != NULL);
+   LTC_ARGCHK(skey != NULL);
+
+   aesni_load_keys(skey->rijndael.dK, rk);
+   _mm_storeu_si128((__m128i *)pt,
+      aesni_dec1(_mm_loadu_si128((const __m128i *)ct), rk, skey->rijndael.Nr));
+   return CRYPT_OK;
+}
+
+AESNI_TARGET static void aesni_ecb(const unsigned char *in, unsigned char *out, unsigned long blocks,
+                                   const ulong32 *K, int Nr, int decrypt)
+{
+   __m128i rk[15], b[AESNI_PAR];
+   int i, vaes = aesni_use_vaes();
+
+   aesni_load_keys(K, rk);
+   for (; blocks >= AESNI_PAR; blocks -= AESNI_PAR, in += 16*AESNI_PAR, out += 16*AESNI_PAR) {
+      for (i = 0; i < AESNI_PAR; i++) b[i] = _mm_loadu_si128((const __m128i *)in + i);
+      aesni_crypt8(b, rk, Nr, decrypt, vaes);
+      for (i = 0; i < AESNI_PAR; i++) _mm_storeu_si128((__m128i *)out + i, b[i]);
+   }
+   for (; blocks > 0; blocks--, in += 16, out += 16) {
+      b[0] = _mm_loadu_si128((const __m128i *)in);
+      b[0] = decrypt ? aesni_dec1(b[0], rk, Nr) : aesni_enc1(b[0], rk, Nr);
+      _mm_storeu_si128((__m128i *)out, b[0]);
+   }
+}
+
+/**
+  ECB encrypt several blocks (accelerator hook)
+  @param pt     The plaintext
+  @param ct     [out] The ciphertext
+  @param blocks The number of 16 byte blocks
+  @param skey   The key as scheduled by aesni_setup()
+  @return CRYPT_OK if successful
+*/
+int aesni_accel_ecb_encrypt(const unsigned char *pt, unsigned char *ct, unsigned long blocks, symmetric_key *skey)
+{
+   aesni_ecb(pt, ct, blocks, skey->rijndael.eK, skey->rijndael.Nr, 0);
+   return CRYPT_OK;
+}
+
+/**
+  ECB decrypt several blocks (accelerator hook)
+  @param ct     The ciphertext
+  @param pt     [out] The plaintext
+  @param blocks The number of 16 byte blocks
+  @param skey   The key as scheduled by aesni_setup()
+  @return CRYPT_OK if successful
+*/
+int aesni_accel_ecb_decrypt(const unsigned char *ct, unsigned char *pt, unsigned long blocks, symmetric_key *skey)
+{
+   aesni_ecb(ct, pt, blocks, skey->rijndael.dK, skey->rijndael.Nr, 1);
+   return CRYPT_OK;
+}
+
+/**
+  CBC encrypt several blocks (accelerator hook).  CBC encryption is
+  inherently serial, this only saves the table lookups.
+  @param pt     The plaintext
+  @param ct     [out] The ciphertext
+  @param blocks The number of 16 byte blocks
+  @param IV     [in/out] The chaining value
+  @param skey   The key as scheduled by aesni_setup()
+  @return CRYPT_OK if successful
+*/
+AESNI_TARGET int aesni_accel_cbc_encrypt(const unsigned char *pt, unsigned char *ct, unsigned long blocks,
+                                         unsigned char *IV, symmetric_key *skey)
+{
+   __m128i rk[15], iv;
+   int Nr = skey->rijndael.Nr;
+
+   aesni_load_keys(skey->rijndael.eK, rk);
+   iv = _mm_loadu_si128((const __m128i *)IV);
+   for (; blocks > 0; blocks--, pt += 16, ct += 16) {
+      iv = aesni_enc1(_mm_xor_si128(iv, _mm_loadu_si128((const __m128i *)pt)), rk, Nr);
+      _mm_storeu_si128((__m128i *)ct, iv);
+   }
+   _mm_storeu_si128((__m128i *)IV, iv);
+   return CRYPT_OK;
+}
+
+/**
+  CBC decrypt several blocks (accelerator hook), ct and pt may be the same
+  @param ct     The ciphertext
+  @param pt     [out] The plaintext
+  @param blocks The number of 16 byte blocks
+  @param IV     [in/out] The chaining value
+  @param skey   The key as scheduled by aesni_setup()
+  @return CRYPT_OK if successful
+*/
+AESNI_TARGET int aesni_accel_cbc_decrypt(const unsigned char *ct, unsigned char *pt, unsigned long blocks,
+                                         unsigned char *IV, symmetric_key *skey)
+{
+   __m128i rk[15], b[AESNI_PAR], c[AESNI_PAR], iv;
+   int i, Nr = skey->rijndael.Nr, vaes = aesni_use_vaes();
+
+   aesni_load_keys(skey->rijndael.dK, rk);
+   iv = _mm_loadu_si128((const __m128i *)IV);
+   for (; blocks >= AESNI_PAR; blocks -= AESNI_PAR, ct += 16*AESNI_PAR, pt += 16*AESNI_PAR) {
+      for (i = 0; i < AESNI_PAR; i++) b[i] = c[i] = _mm_loadu_si128((const __m128i *)ct + i);
+      aesni_crypt8(b, rk, Nr, 1, vaes);
+      _mm_storeu_si128((__m128i *)pt, _mm_xor_si128(b[0], iv));
+      for (i = 1; i < AESNI_PAR; i++) {
+         _mm_storeu_si128((__m128i *)pt + i, _mm_xor_si128(b[i], c[i-1]));
+      }
+      iv = c[AESNI_PAR-1];
+   }
+   for (; blocks > 0; blocks--, ct += 16, pt += 16) {
+      c[0] = _mm_loadu_si128((const __m128i *)ct);
+      _mm_storeu_si128((__m128i *)pt, _mm_xor_si128(aesni_dec1(c[0], rk, Nr), iv));
+      iv = c[0];
+   }
+   _mm_storeu_si128((__m128i *)IV, iv);
+   return CRYPT_OK;
+}
+
+/**
+  CTR encrypt several blocks (accelerator hook).  As in ctr_encrypt() the
+  counter is incremented before each block is encrypted, and is left
+  holding the last counter used.
+  @param pt     The plaintext
+  @param ct     [out] The ciphertext
+  @param blocks The number of 16 byte blocks
+  @param IV     [in/out] The 128 bit counter
+  @param mode   CTR_COUNTER_LITTLE_ENDIAN or CTR_COUNTER_BIG_ENDIAN
+  @param skey   The key as scheduled by aesni_setup()
+  @return CRYPT_OK if successful
+*/
+AESNI_TARGET int aesni_accel_ctr_encrypt(const unsigned char *pt, unsigned char *ct, unsigned long blocks,
+                                         unsigned char *IV, int mode, symmetric_key *skey)
+{
+   __m128i rk[15], b[AESNI_PAR];
+   ulong64 hi, lo;
+   unsigned long n;
+   int i, Nr = skey->rijndael.Nr, vaes = aesni_use_vaes();
+   int be = (mode == CTR_COUNTER_BIG_ENDIAN);
+
+   /* keep the counter as two native words, hi:lo */
+   if (be) {
+      LOAD64H(hi, IV);
+      LOAD64H(lo, IV + 8);
+   } else {
+      LOAD64L(lo, IV);
+      LOAD64L(hi, IV + 8);
+   }
+
+   aesni_load_keys(skey->rijndael.eK, rk);
+   while (blocks > 0) {
+      n = MIN(blocks, AESNI_PAR);
+      for (i = 0; i < (int)n; i++) {
+         if (++lo == 0) {
+            hi++;
+         }
+         if (be) {
+            b[i] = _mm_set_epi64x((long long)__builtin_bswap64(lo), (long long)__builtin_bswap64(hi));
+         } else {
+            b[i] = _mm_set_epi64x((long long)hi, (long long)lo);
+         }
+      }
+      if (n == AESNI_PAR) {
+         aesni_crypt8(b, rk, Nr, 0, vaes);
+      } else {
+         for (i = 0; i < (int)n; i++) b[i] = aesni_enc1(b[i], rk, Nr);
+      }
+      for (i = 0; i < (int)n; i++) {
+         _mm_storeu_si128((__m128i *)ct + i,
+            _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i *)pt + i)));
+      }
+      pt += 16 * n;
+      ct += 16 * n;
+      blocks -= n;
+   }
+
+   if (be) {
+      STORE64H(hi, IV);
+      STORE64H(lo, IV + 8);
+   } else {
+      STORE64L(lo, IV);
+      STORE64L(hi, IV + 8);
+   }
+   return CRYPT_OK;
+}
+
+#endif /* RIJNDAEL && LTC_AESNI */
@@ -0,0 +1,314 @@
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ *
+ * Tom St Denis, tomstdenis@gmail.com, http://libtomcrypt.com
+ */
+#include "tomcrypt.h"
+
+/**
+  @file aes_ni_sha.c
+  AES-NI counter mode stitched with SHA-256 or SHA-1.
+
+  Each step encrypts 4 counter blocks (64 bytes of keystream) and
+  compresses one 64 byte hash block.  The AES rounds are spread between
+  the hash rounds, so the AESENC latency is hidden behind the scalar
+  hash arithmetic instead of being waited out, and the data is only
+  brought into the cache once for both.
+
+  The hash input and the cipher input are separate pointers so the
+  caller can run the hash ahead of or behind the cipher.  Within a step
+  the hash block is read before the cipher output is written, so they
+  may overlap by up to a block.  The hash state must not hold a partial
+  block.  The key must have been set up by aesni_setup().
+*/
+
+#if defined(RIJNDAEL) && defined(LTC_AESNI)
+
+#include <immintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+#define STITCH_BLOCKS 4
+
+/* one AES round on the 4 blocks, round r of Nr, nothing past the last */
+#define AES_STEP(r)                                                         \
+   if ((r) < Nr) {                                                          \
+      b[0] = _mm_aesenc_si128(b[0], rk[r]);                                 \
+      b[1] = _mm_aesenc_si128(b[1], rk[r]);                                 \
+      b[2] = _mm_aesenc_si128(b[2], rk[r]);                                 \
+      b[3] = _mm_aesenc_si128(b[3], rk[r]);                                 \
+   } else if ((r) == Nr) {                                                  \
+      b[0] = _mm_aesenclast_si128(b[0], rk[r]);                             \
+      b[1] = _mm_aesenclast_si128(b[1], rk[r]);                             \
+      b[2] = _mm_aesenclast_si128(b[2], rk[r]);                             \
+      b[3] = _mm_aesenclast_si128(b[3], rk[r]);                             \
+   }
+
+/* next 4 counter blocks, after the first AES round key */
+AESNI_TARGET static inline void stitch_counters(__m128i *b, ulong64 *hi, ulong64 *lo, int be, __m128i rk0)
+{
+   int i;
+   for (i = 0; i < STITCH_BLOCKS; i++) {
+      if (++*lo == 0) {
+         ++*hi;
+      }
+      if (be) {
+         b[i] = _mm_set_epi64x((long long)__builtin_bswap64(*lo), (long long)__builtin_bswap64(*hi));
+      } else {
+         b[i] = _mm_set_epi64x((long long)*hi, (long long)*lo);
+      }
+      b[i] = _mm_xor_si128(b[i], rk0);
+   }
+}
+
+AESNI_TARGET static inline void stitch_xor(const unsigned char *in, unsigned char *out, const __m128i *b)
+{
+   int i;
+   for (i = 0; i < STITCH_BLOCKS; i++) {
+      _mm_storeu_si128((__m128i *)out + i,
+         _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i *)in + i)));
+   }
+}
+
+static void stitch_load_ctr(const unsigned char *IV, int be, ulong64 *hi, ulong64 *lo)
+{
+   if (be) {
+      LOAD64H(*hi, IV);
+      LOAD64H(*lo, IV + 8);
+   } else {
+      LOAD64L(*lo, IV);
+      LOAD64L(*hi, IV + 8);
+   }
+}
+
+static void stitch_store_ctr(unsigned char *IV, int be, ulong64 hi, ulong64 lo)
+{
+   if (be) {
+      STORE64H(hi, IV);
+      STORE64H(lo, IV + 8);
+   } else {
+      STORE64L(lo, IV);
+      STORE64L(hi, IV + 8);
+   }
+}
+
+#ifdef SHA256
+
+static const ulong32 stitch_K256[64] = {
+    0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL,
+    0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL, 0xd807aa98UL, 0x12835b01UL,
+    0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL,
+    0xc19bf174UL, 0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+    0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL, 0x983e5152UL,
+    0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL,
+    0x06ca6351UL, 0x14292967UL, 0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL,
+    0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+    0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL,
+    0xd6990624UL, 0xf40e3585UL, 0x106aa070UL, 0x19a4c116UL, 0x1e376c08UL,
+    0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL,
+    0x682e6ff3UL, 0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+    0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+#define Ch(x,y,z)       (z ^ (x & (y ^ z)))
+#define Maj(x,y,z)      (((x | y) & z) | (x & y))
+#define Sigma0(x)       (RORc(x, 2) ^ RORc(x, 13) ^ RORc(x, 22))
+#define Sigma1(x)       (RORc(x, 6) ^ RORc(x, 11) ^ RORc(x, 25))
+#define Gamma0(x)       (RORc(x, 7) ^ RORc(x, 18) ^ (((x)&0xFFFFFFFFUL)>>3))
+#define Gamma1(x)       (RORc(x, 17) ^ RORc(x, 19) ^ (((x)&0xFFFFFFFFUL)>>10))
+
+#define RND256(a,b,c,d,e,f,g,h,i)                              \
+     t0 = h + Sigma1(e) + Ch(e, f, g) + stitch_K256[i] + W[i]; \
+     t1 = Sigma0(a) + Maj(a, b, c);                            \
+     d += t0;                                                  \
+     h  = t0 + t1;
+
+/**
+  CTR encrypt (or decrypt) and SHA-256 hash in one pass
+  @param in     The cipher input
+  @param out    [out] The cipher output, may be the same as in
+  @param hin    The hash input
+  @param steps  The number of 64 byte steps, for each of in, out and hin
+  @param IV     [in/out] The 128 bit counter, as for aesni_accel_ctr_encrypt()
+  @param mode   CTR_COUNTER_LITTLE_ENDIAN or CTR_COUNTER_BIG_ENDIAN
+  @param skey   The key as scheduled by aesni_setup()
+  @param md     [in/out] The SHA-256 state, with no partial block
+  @return CRYPT_OK if successful
+*/
+AESNI_TARGET int aesni_ctr_sha256_stitch(const unsigned char *in, unsigned char *out,
+                                         const unsigned char *hin, unsigned long steps,
+                                         unsigned char *IV, int mode, symmetric_key *skey,
+                                         hash_state *md)
+{
+   __m128i rk[15], b[STITCH_BLOCKS];
+   ulong32 W[64], a, bb, c, d, e, f, g, h, t0, t1;
+   ulong64 hi, lo;
+   int i, Nr = skey->rijndael.Nr;
+   int be = (mode == CTR_COUNTER_BIG_ENDIAN);
+
+   LTC_ARGCHK(md != NULL);
+   if (md->sha256.curlen != 0) {
+      return CRYPT_INVALID_ARG;
+   }
+
+   for (i = 0; i <= Nr; i++) {
+      rk[i] = _mm_loadu_si128((const __m128i *)skey->rijndael.eK + i);
+   }
+   stitch_load_ctr(IV, be, &hi, &lo);
+
+   for (; steps > 0; steps--, in += 64, out += 64, hin += 64) {
+      for (i = 0; i < 16; i++) {
+         LOAD32H(W[i], hin + 4*i);
+      }
+      stitch_counters(b, &hi, &lo, be, rk[0]);
+      for (i = 16; i < 64; i++) {
+         W[i] = Gamma1(W[i - 2]) + W[i - 7] + Gamma0(W[i - 15]) + W[i - 16];
+      }
+
+      a  = md->sha256.state[0];
+      bb = md->sha256.state[1];
+      c  = md->sha256.state[2];
+      d  = md->sha256.state[3];
+      e  = md->sha256.state[4];
+      f  = md->sha256.state[5];
+      g  = md->sha256.state[6];
+      h  = md->sha256.state[7];
+
+      /* AES rounds 1..16 after every 4 hash rounds, Nr is at most 14 */
+      for (i = 0; i < 64; i += 8) {
+         RND256(a,bb,c,d,e,f,g,h,i);
+         RND256(h,a,bb,c,d,e,f,g,i+1);
+         RND256(g,h,a,bb,c,d,e,f,i+2);
+         RND256(f,g,h,a,bb,c,d,e,i+3);
+         AES_STEP(i/4 + 1)
+         RND256(e,f,g,h,a,bb,c,d,i+4);
+         RND256(d,e,f,g,h,a,bb,c,i+5);
+         RND256(c,d,e,f,g,h,a,bb,i+6);
+         RND256(bb,c,d,e,f,g,h,a,i+7);
+         AES_STEP(i/4 + 2)
+      }
+
+      md->sha256.state[0] += a;
+      md->sha256.state[1] += bb;
+      md->sha256.state[2] += c;
+      md->sha256.state[3] += d;
+      md->sha256.state[4] += e;
+      md->sha256.state[5] += f;
+      md->sha256.state[6] += g;
+      md->sha256.state[7] += h;
+      md->sha256.length += 512;
+
+      stitch_xor(in, out, b);
+   }
+
+   stitch_store_ctr(IV, be, hi, lo);
+#ifdef LTC_CLEAN_STACK
+   zeromem(W, sizeof(W));
+#endif
+   return CRYPT_OK;
+}
+
+#endif /* SHA256 */
+
+#ifdef SHA1
+
+#define F0(x,y,z)  (z ^ (x & (y ^ z)))
+#define F1(x,y,z)  (x ^ y ^ z)
+#define F2(x,y,z)  ((x & y) | (z & (x | y)))
+#define F3(x,y,z)  (x ^ y ^ z)
+
+#define FF0(a,b,c,d,e,i) e = (ROLc(a, 5) + F0(b,c,d) + e + W[i] + 0x5a827999UL); b = ROLc(b, 30);
+#define FF1(a,b,c,d,e,i) e = (ROLc(a, 5) + F1(b,c,d) + e + W[i] + 0x6ed9eba1UL); b = ROLc(b, 30);
+#define FF2(a,b,c,d,e,i) e = (ROLc(a, 5) + F2(b,c,d) + e + W[i] + 0x8f1bbcdcUL); b = ROLc(b, 30);
+#define FF3(a,b,c,d,e,i) e = (ROLc(a, 5) + F3(b,c,d) + e + W[i] + 0xca62c1d6UL); b = ROLc(b, 30);
+
+/* 5 hash rounds then one AES round */
+#define SHA1_GROUP(FF, s)     \
+   FF(a,bb,c,d,e,i); i++;     \
+   FF(e,a,bb,c,d,i); i++;     \
+   FF(d,e,a,bb,c,i); i++;     \
+   FF(c,d,e,a,bb,i); i++;     \
+   FF(bb,c,d,e,a,i); i++;     \
+   AES_STEP(s)
+
+/**
+  CTR encrypt (or decrypt) and SHA-1 hash in one pass
+  @param in     The cipher input
+  @param out    [out] The cipher output, may be the same as in
+  @param hin    The hash input
+  @param steps  The number of 64 byte steps, for each of in, out and hin
+  @param IV     [in/out] The 128 bit counter, as for aesni_accel_ctr_encrypt()
+  @param mode   CTR_COUNTER_LITTLE_ENDIAN or CTR_COUNTER_BIG_ENDIAN
+  @param skey   The key as scheduled by aesni_setup()
+  @param md     [in/out] The SHA-1 state, with no partial block
+  @return CRYPT_OK if successful
+*/
+AESNI_TARGET int aesni_ctr_sha1_stitch(const unsigned char *in, unsigned char *out,
+                                       const unsigned char *hin, unsigned long steps,
+                                       unsigned char *IV, int mode, symmetric_key *skey,
+                                       hash_state *md)
+{
+   __m128i rk[15], b[STITCH_BLOCKS];
+   ulong32 W[80], a, bb, c, d, e;
+   ulong64 hi, lo;
+   int i, s, Nr = skey->rijndael.Nr;
+   int be = (mode == CTR_COUNTER_BIG_ENDIAN);
+
+   LTC_ARGCHK(md != NULL);
+   if (md->sha1.curlen != 0) {
+      return CRYPT_INVALID_ARG;
+   }
+
+   for (i = 0; i <= Nr; i++) {
+      rk[i] = _mm_loadu_si128((const __m128i *)skey->rijndael.eK + i);
+   }
+   stitch_load_ctr(IV, be, &hi, &lo);
+
+   for (; steps > 0; steps--, in += 64, out += 64, hin += 64) {
+      for (i = 0; i < 16; i++) {
+         LOAD32H(W[i], hin + 4*i);
+      }
+      stitch_counters(b, &hi, &lo, be, rk[0]);
+      for (i = 16; i < 80; i++) {
+         W[i] = ROL(W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16], 1);
+      }
+
+      a  = md->sha1.state[0];
+      bb = md->sha1.state[1];
+      c  = md->sha1.state[2];
+      d  = md->sha1.state[3];
+      e  = md->sha1.state[4];
+
+      /* AES rounds 1..16 after every 5 hash rounds */
+      i = 0;
+      s = 1;
+      for (; i < 20; s++) { SHA1_GROUP(FF0, s) }
+      for (; i < 40; s++) { SHA1_GROUP(FF1, s) }
+      for (; i < 60; s++) { SHA1_GROUP(FF2, s) }
+      for (; i < 80; s++) { SHA1_GROUP(FF3, s) }
+
+      md->sha1.state[0] += a;
+      md->sha1.state[1] += bb;
+      md->sha1.state[2] += c;
+      md->sha1.state[3] += d;
+      md->sha1.state[4] += e;
+      md->sha1.length += 512;
+
+      stitch_xor(in, out, b);
+   }
+
+   stitch_store_ctr(IV, be, hi, lo);
+#ifdef LTC_CLEAN_STACK
+   zeromem(W, sizeof(W));
+#endif
+   return CRYPT_OK;
+}
+
+#endif /* SHA1 */
+
+#endif /* RIJNDAEL && LTC_AESNI */
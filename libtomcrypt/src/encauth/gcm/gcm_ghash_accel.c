@@ -0,0 +1,181 @@
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ *
+ * Tom St Denis, tomstdenis@gmail.com, http://libtomcrypt.com
+ */
+#include "tomcrypt.h"
+
+/**
+  @file gcm_ghash_accel.c
+  GCM GHASH using carry-less multiply (PCLMULQDQ).
+
+  Operands are byte reversed on load so the bit-reflected GCM field
+  elements can be multiplied with PCLMULQDQ, then the 256 bit product is
+  shifted left one bit and reduced modulo x^128 + x^7 + x^2 + x + 1
+  (Gueron & Kounavis, "Intel Carry-Less Multiplication Instruction and
+  its Usage for Computing the GCM Mode").  Four blocks are folded per
+  reduction using the precomputed powers H^1..H^4.
+*/
+
+#ifdef GCM_MODE
+
+#ifdef LTC_GCM_PCLMUL
+
+#include <immintrin.h>
+
+#define GCM_TARGET __attribute__((target("pclmul,ssse3")))
+
+GCM_TARGET static inline __m128i gcm_bswap(__m128i x)
+{
+   return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                           8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+/* 256 bit carry-less product a*b, accumulated into hi:lo */
+GCM_TARGET static inline void gcm_clmul(__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+   __m128i t0, t1, t2, t3;
+
+   t0 = _mm_clmulepi64_si128(a, b, 0x00);
+   t1 = _mm_clmulepi64_si128(a, b, 0x10);
+   t2 = _mm_clmulepi64_si128(a, b, 0x01);
+   t3 = _mm_clmulepi64_si128(a, b, 0x11);
+   t1 = _mm_xor_si128(t1, t2);
+   *lo = _mm_xor_si128(*lo, _mm_xor_si128(t0, _mm_slli_si128(t1, 8)));
+   *hi = _mm_xor_si128(*hi, _mm_xor_si128(t3, _mm_srli_si128(t1, 8)));
+}
+
+/* reduce the reflected 256 bit product hi:lo to 128 bits */
+GCM_TARGET static inline __m128i gcm_reduce(__m128i lo, __m128i hi)
+{
+   __m128i t0, t1, t2;
+
+   /* shift hi:lo left by one bit */
+   t0 = _mm_srli_epi32(lo, 31);
+   t1 = _mm_srli_epi32(hi, 31);
+   lo = _mm_slli_epi32(lo, 1);
+   hi = _mm_slli_epi32(hi, 1);
+   t2 = _mm_srli_si128(t0, 12);
+   t1 = _mm_slli_si128(t1, 4);
+   t0 = _mm_slli_si128(t0, 4);
+   lo = _mm_or_si128(lo, t0);
+   hi = _mm_or_si128(hi, t1);
+   hi = _mm_or_si128(hi, t2);
+
+   /* first phase */
+   t0 = _mm_slli_epi32(lo, 31);
+   t1 = _mm_slli_epi32(lo, 30);
+   t2 = _mm_slli_epi32(lo, 25);
+   t0 = _mm_xor_si128(t0, t1);
+   t0 = _mm_xor_si128(t0, t2);
+   t1 = _mm_srli_si128(t0, 4);
+   t0 = _mm_slli_si128(t0, 12);
+   lo = _mm_xor_si128(lo, t0);
+
+   /* second phase */
+   t2 = _mm_srli_epi32(lo, 1);
+   t0 = _mm_srli_epi32(lo, 2);
+   t2 = _mm_xor_si128(t2, t0);
+   t0 = _mm_srli_epi32(lo, 7);
+   t2 = _mm_xor_si128(t2, t0);
+   t2 = _mm_xor_si128(t2, t1);
+   lo = _mm_xor_si128(lo, t2);
+   return _mm_xor_si128(hi, lo);
+}
+
+GCM_TARGET static __m128i gcm_mul(__m128i a, __m128i b)
+{
+   __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+   gcm_clmul(a, b, &lo, &hi);
+   return gcm_reduce(lo, hi);
+}
+
+/**
+  Set up the accelerated GHASH if the CPU supports it (internal use only)
+  @param gcm   The GCM state, with H already computed
+  @return 1 if gcm_ghash_accel() may be used
+*/
+GCM_TARGET int gcm_ghash_accel_init(gcm_state *gcm)
+{
+   __m128i h, p;
+   int x;
+
+   gcm->accel = 0;
+   if ((crypt_cpu_features() & (LTC_CPU_PCLMUL | LTC_CPU_SSSE3)) != (LTC_CPU_PCLMUL | LTC_CPU_SSSE3)) {
+      return 0;
+   }
+
+   /* HP[3-i] = H^(i+1), kept byte reversed */
+   h = gcm_bswap(_mm_loadu_si128((const __m128i *)gcm->H));
+   p = h;
+   for (x = 3; x >= 0; x--) {
+      _mm_storeu_si128((__m128i *)gcm->HP[x], p);
+      p = gcm_mul(p, h);
+   }
+   gcm->accel = 1;
+   return 1;
+}
+
+/**
+  X = (X ^ in[0]) * H ... for whole blocks (internal use only)
+  @param gcm     The GCM state
+  @param in      The blocks to hash
+  @param blocks  The number of 16 byte blocks
+*/
+GCM_TARGET void gcm_ghash_accel(gcm_state *gcm, const unsigned char *in, unsigned long blocks)
+{
+   __m128i x, lo, hi, h1, h2, h3, h4;
+
+   x  = gcm_bswap(_mm_loadu_si128((const __m128i *)gcm->X));
+   h4 = _mm_loadu_si128((const __m128i *)gcm->HP[0]);
+   h3 = _mm_loadu_si128((const __m128i *)gcm->HP[1]);
+   h2 = _mm_loadu_si128((const __m128i *)gcm->HP[2]);
+   h1 = _mm_loadu_si128((const __m128i *)gcm->HP[3]);
+
+   for (; blocks >= 4; blocks -= 4, in += 64) {
+      lo = hi = _mm_setzero_si128();
+      x = _mm_xor_si128(x, gcm_bswap(_mm_loadu_si128((const __m128i *)in)));
+      gcm_clmul(x, h4, &lo, &hi);
+      gcm_clmul(gcm_bswap(_mm_loadu_si128((const __m128i *)(in + 16))), h3, &lo, &hi);
+      gcm_clmul(gcm_bswap(_mm_loadu_si128((const __m128i *)(in + 32))), h2, &lo, &hi);
+      gcm_clmul(gcm_bswap(_mm_loadu_si128((const __m128i *)(in + 48))), h1, &lo, &hi);
+      x = gcm_reduce(lo, hi);
+   }
+   for (; blocks > 0; blocks--, in += 16) {
+      x = _mm_xor_si128(x, gcm_bswap(_mm_loadu_si128((const __m128i *)in)));
+      x = gcm_mul(x, h1);
+   }
+
+   _mm_storeu_si128((__m128i *)gcm->X, gcm_bswap(x));
+}
+
+/**
+  I = I * H (internal use only)
+  @param gcm   The GCM state
+  @param I     The value to multiply H by
+*/
+GCM_TARGET void gcm_mult_h_accel(gcm_state *gcm, unsigned char *I)
+{
+   __m128i x;
+
+   x = gcm_bswap(_mm_loadu_si128((const __m128i *)I));
+   x = gcm_mul(x, _mm_loadu_si128((const __m128i *)gcm->HP[3]));
+   _mm_storeu_si128((__m128i *)I, gcm_bswap(x));
+}
+
+#else
+
+int gcm_ghash_accel_init(gcm_state *gcm)
+{
+   gcm->accel = 0;
+   return 0;
+}
+
+#endif /* LTC_GCM_PCLMUL */
+
+#endif /* GCM_MODE */
@@ -72,6 +72,11 @@ int gcm_init(gcm_state *gcm, int cipher,
    gcm->totlen   = 0;
    gcm->pttotlen = 0;
 
+   /* the tables aren't needed with carry-less multiply */
+   if (gcm_ghash_accel_init(gcm)) {
+      return CRYPT_OK;
+   }
+
 #ifdef GCM_TABLES
    /* setup tables */
 
@@ -26,6 +26,16 @@ void gcm_mult_h(gcm_state *gcm, unsigned char *I)
    unsigned char T[16];
 #ifdef GCM_TABLES
    int x, y;
+#endif
+
+#ifdef LTC_GCM_PCLMUL
+   if (gcm->accel) {
+      gcm_mult_h_accel(gcm, I);
+      return;
+   }
+#endif
+
+#ifdef GCM_TABLES
 #ifdef GCM_TABLES_SSE2
    asm("movdqa (%0),%%xmm0"::"r"(&gcm->PC[0][I[0]][0]));
    for (x = 1; x < 16; x++) {
@@ -34,6 +34,9 @@ int gcm_process(gcm_state *gcm,
    unsigned long x;
    int           y, err;
    unsigned char b;
+#if defined(LTC_GCM_PCLMUL) && defined(LTC_FAST)
+   unsigned long z;
+#endif
 
    LTC_ARGCHK(gcm != NULL);
    if (ptlen > 0) {
@@ -75,10 +78,64 @@ int gcm_process(gcm_state *gcm,
    }
 
    x = 0;
+#if defined(LTC_GCM_PCLMUL) && defined(LTC_FAST)
+   /* whole blocks with the accelerated GHASH, in chunks of up to 16 blocks.
+      The first block of a chunk uses the pending keystream in buf, the
+      rest come from the cipher's CTR accelerator when it has one */
+   if (gcm->buflen == 0 && gcm->accel) {
+      unsigned char *in  = (direction == GCM_ENCRYPT) ? pt : ct;
+      unsigned char *out = (direction == GCM_ENCRYPT) ? ct : pt;
+      unsigned long n;
+      ulong32 ctr32;
+
+      while (ptlen - x >= 64) {
+          n = MIN((ptlen - x) / 16, 16) & ~3UL;
+          if (direction == GCM_DECRYPT) {
+             gcm_ghash_accel(gcm, ct + x, n);
+          }
+          for (y = 0; y < 16; y += sizeof(LTC_FAST_TYPE)) {
+              *((LTC_FAST_TYPE*)(&out[x + y])) = *((LTC_FAST_TYPE*)(&in[x+y])) ^ *((LTC_FAST_TYPE*)(&gcm->buf[y]));
+          }
+          LOAD32H(ctr32, gcm->Y + 12);
+          if (cipher_descriptor[gcm->cipher].accel_ctr_encrypt != NULL && ctr32 <= 0xFFFFFFFFUL - n) {
+             /* no 32 bit wrap, so a 128 bit counter gives the same result */
+             if ((err = cipher_descriptor[gcm->cipher].accel_ctr_encrypt(in + x + 16, out + x + 16, n - 1,
+                        gcm->Y, CTR_COUNTER_BIG_ENDIAN, &gcm->K)) != CRYPT_OK) {
+                return err;
+             }
+          } else {
+             for (z = x + 16; z < x + 16 * n; z += 16) {
+                 for (y = 15; y >= 12; y--) {
+                     if (++gcm->Y[y] & 255) { break; }
+                 }
+                 if ((err = cipher_descriptor[gcm->cipher].ecb_encrypt(gcm->Y, gcm->buf, &gcm->K)) != CRYPT_OK) {
+                    return err;
+                 }
+                 for (y = 0; y < 16; y += sizeof(LTC_FAST_TYPE)) {
+                     *((LTC_FAST_TYPE*)(&out[z + y])) = *((LTC_FAST_TYPE*)(&in[z+y])) ^ *((LTC_FAST_TYPE*)(&gcm->buf[y]));
+                 }
+             }
+          }
+          /* keystream for the next block */
+          for (y = 15; y >= 12; y--) {
+              if (++gcm->Y[y] & 255) { break; }
+          }
+          if ((err = cipher_descriptor[gcm->cipher].ecb_encrypt(gcm->Y, gcm->buf, &gcm->K)) != CRYPT_OK) {
+             return err;
+          }
+          if (direction == GCM_ENCRYPT) {
+             gcm_ghash_accel(gcm, ct + x, n);
+          }
+          gcm->pttotlen += 128 * n;
+          x += 16 * n;
+      }
+   }
+#endif
+
 #ifdef LTC_FAST
    if (gcm->buflen == 0) {
       if (direction == GCM_ENCRYPT) { 
-         for (x = 0; x < (ptlen & ~15); x += 16) {
+         for (; x < (ptlen & ~15); x += 16) {
              /* ctr encrypt */
              for (y = 0; y < 16; y += sizeof(LTC_FAST_TYPE)) {
                  *((LTC_FAST_TYPE*)(&ct[x + y])) = *((LTC_FAST_TYPE*)(&pt[x+y])) ^ *((LTC_FAST_TYPE*)(&gcm->buf[y]));
@@ -96,7 +153,7 @@ int gcm_process(gcm_state *gcm,
              }
          }
       } else {
-         for (x = 0; x < (ptlen & ~15); x += 16) {
+         for (; x < (ptlen & ~15); x += 16) {
              /* ctr encrypt */
              for (y = 0; y < 16; y += sizeof(LTC_FAST_TYPE)) {
                  *((LTC_FAST_TYPE*)(&gcm->X[y])) ^= *((LTC_FAST_TYPE*)(&ct[x+y]));
@@ -0,0 +1,241 @@
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ *
+ * Tom St Denis, tomstdenis@gmail.com, http://libtomcrypt.com
+ */
+#include "tomcrypt.h"
+
+/**
+  @file sha_mb.c
+  Multi-buffer SHA-256 and SHA-1.
+
+  A single SHA chain is serial, so it can't use SIMD.  Here each 32 bit
+  lane of a vector holds a different message instead, and one call
+  compresses a block of each of SHA_MB_LANES independent messages.
+  With AVX2 the 8 lanes are one ymm register, otherwise the same code
+  runs as two 4 lane SSE2 halves.
+
+  The states are kept word-major in a sha_mb_state, h[word][lane], and
+  lanes that are not active keep their state.  Padding and lengths are
+  left to the caller, which passes complete blocks.
+*/
+
+#ifdef LTC_SHA_MB
+
+typedef unsigned int mb_vec __attribute__((vector_size(4 * SHA_MB_LANES)));
+
+#define MB_INLINE  static inline __attribute__((always_inline))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#define SSE2_TARGET __attribute__((target("sse2")))
+
+#define MB_ROR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define MB_ROL(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* word i of each lane's block, big endian */
+MB_INLINE void mb_load(mb_vec *w, const unsigned char *const *blocks, int i)
+{
+   ulong32 x;
+   int l;
+   for (l = 0; l < SHA_MB_LANES; l++) {
+      LOAD32H(x, blocks[l] + 4*i);
+      (*w)[l] = (unsigned int)x;
+   }
+}
+
+MB_INLINE void mb_mask(mb_vec *m, unsigned int active)
+{
+   int l;
+   for (l = 0; l < SHA_MB_LANES; l++) {
+      (*m)[l] = (active >> l) & 1 ? 0xffffffffU : 0;
+   }
+}
+
+#ifdef SHA256
+
+static const ulong32 K256[64] = {
+    0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL,
+    0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL, 0xd807aa98UL, 0x12835b01UL,
+    0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL,
+    0xc19bf174UL, 0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+    0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL, 0x983e5152UL,
+    0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL,
+    0x06ca6351UL, 0x14292967UL, 0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL,
+    0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+    0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL,
+    0xd6990624UL, 0xf40e3585UL, 0x106aa070UL, 0x19a4c116UL, 0x1e376c08UL,
+    0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL,
+    0x682e6ff3UL, 0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+    0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+#define Ch(x,y,z)       (z ^ (x & (y ^ z)))
+#define Maj(x,y,z)      (((x | y) & z) | (x & y))
+#define Sigma0(x)       (MB_ROR(x, 2) ^ MB_ROR(x, 13) ^ MB_ROR(x, 22))
+#define Sigma1(x)       (MB_ROR(x, 6) ^ MB_ROR(x, 11) ^ MB_ROR(x, 25))
+#define Gamma0(x)       (MB_ROR(x, 7) ^ MB_ROR(x, 18) ^ ((x) >> 3))
+#define Gamma1(x)       (MB_ROR(x, 17) ^ MB_ROR(x, 19) ^ ((x) >> 10))
+
+MB_INLINE void sha256_mb_block(sha_mb_state *st, const unsigned char *const *blocks, unsigned int active)
+{
+   mb_vec W[64], S[8], a, b, c, d, e, f, g, h, t0, t1, m;
+   int i;
+
+   for (i = 0; i < 16; i++) {
+      mb_load(&W[i], blocks, i);
+   }
+   for (i = 16; i < 64; i++) {
+      W[i] = Gamma1(W[i - 2]) + W[i - 7] + Gamma0(W[i - 15]) + W[i - 16];
+   }
+   for (i = 0; i < 8; i++) {
+      XMEMCPY(&S[i], st->h[i], sizeof(mb_vec));
+   }
+
+   a = S[0]; b = S[1]; c = S[2]; d = S[3];
+   e = S[4]; f = S[5]; g = S[6]; h = S[7];
+   for (i = 0; i < 64; i++) {
+      t0 = h + Sigma1(e) + Ch(e, f, g) + (unsigned int)K256[i] + W[i];
+      t1 = Sigma0(a) + Maj(a, b, c);
+      h = g; g = f; f = e; e = d + t0;
+      d = c; c = b; b = a; a = t0 + t1;
+   }
+
+   mb_mask(&m, active);
+   S[0] += a & m; S[1] += b & m; S[2] += c & m; S[3] += d & m;
+   S[4] += e & m; S[5] += f & m; S[6] += g & m; S[7] += h & m;
+   for (i = 0; i < 8; i++) {
+      XMEMCPY(st->h[i], &S[i], sizeof(mb_vec));
+   }
+}
+
+AVX2_TARGET static void sha256_mb_block_avx2(sha_mb_state *st, const unsigned char *const *blocks, unsigned int active)
+{
+   sha256_mb_block(st, blocks, active);
+}
+
+SSE2_TARGET static void sha256_mb_block_sse2(sha_mb_state *st, const unsigned char *const *blocks, unsigned int active)
+{
+   sha256_mb_block(st, blocks, active);
+}
+
+/**
+  Compress one block for each active lane
+  @param st      [in/out] The SHA-256 states, h[0..7][lane]
+  @param blocks  The 64 byte block for each lane, inactive lanes must still point to readable memory
+  @param active  Bit l set if lane l is to be updated
+*/
+void sha256_mb_compress(sha_mb_state *st, const unsigned char *const blocks[SHA_MB_LANES], unsigned int active)
+{
+   if (crypt_cpu_features() & LTC_CPU_AVX2) {
+      sha256_mb_block_avx2(st, blocks, active);
+   } else {
+      sha256_mb_block_sse2(st, blocks, active);
+   }
+}
+
+#endif /* SHA256 */
+
+#ifdef SHA1
+
+#define F0(x,y,z)  (z ^ (x & (y ^ z)))
+#define F1(x,y,z)  (x ^ y ^ z)
+#define F2(x,y,z)  ((x & y) | (z & (x | y)))
+#define F3(x,y,z)  (x ^ y ^ z)
+
+#define MB_SHA1_RND(F, k)                                     \
+   t = MB_ROL(a, 5) + F(b, c, d) + e + W[i] + (unsigned int)(k); \
+   e = d; d = c; c = MB_ROL(b, 30); b = a; a = t;
+
+MB_INLINE void sha1_mb_block(sha_mb_state *st, const unsigned char *const *blocks, unsigned int active)
+{
+   mb_vec W[80], S[5], a, b, c, d, e, t, m;
+   int i;
+
+   for (i = 0; i < 16; i++) {
+      mb_load(&W[i], blocks, i);
+   }
+   for (i = 16; i < 80; i++) {
+      t = W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16];
+      W[i] = MB_ROL(t, 1);
+   }
+   for (i = 0; i < 5; i++) {
+      XMEMCPY(&S[i], st->h[i], sizeof(mb_vec));
+   }
+
+   a = S[0]; b = S[1]; c = S[2]; d = S[3]; e = S[4];
+   for (i = 0; i < 20; i++) {
+      MB_SHA1_RND(F0, 0x5a827999UL)
+   }
+   for (; i < 40; i++) {
+      MB_SHA1_RND(F1, 0x6ed9eba1UL)
+   }
+   for (; i < 60; i++) {
+      MB_SHA1_RND(F2, 0x8f1bbcdcUL)
+   }
+   for (; i < 80; i++) {
+      MB_SHA1_RND(F3, 0xca62c1d6UL)
+   }
+
+   mb_mask(&m, active);
+   S[0] += a & m; S[1] += b & m; S[2] += c & m; S[3] += d & m; S[4] += e & m;
+   for (i = 0; i < 5; i++) {
+      XMEMCPY(st->h[i], &S[i], sizeof(mb_vec));
+   }
+}
+
+AVX2_TARGET static void sha1_mb_block_avx2(sha_mb_state *st, const unsigned char *const *blocks, unsigned int active)
+{
+   sha1_mb_block(st, blocks, active);
+}
+
+SSE2_TARGET static void sha1_mb_block_sse2(sha_mb_state *st, const unsigned char *const *blocks, unsigned int active)
+{
+   sha1_mb_block(st, blocks, active);
+}
+
+/**
+  Compress one block for each active lane
+  @param st      [in/out] The SHA-1 states, h[0..4][lane]
+  @param blocks  The 64 byte block for each lane, inactive lanes must still point to readable memory
+  @param active  Bit l set if lane l is to be updated
+*/
+void sha1_mb_compress(sha_mb_state *st, const unsigned char *const blocks[SHA_MB_LANES], unsigned int active)
+{
+   if (crypt_cpu_features() & LTC_CPU_AVX2) {
+      sha1_mb_block_avx2(st, blocks, active);
+   } else {
+      sha1_mb_block_sse2(st, blocks, active);
+   }
+}
+
+#endif /* SHA1 */
+
+/**
+  Whether a multi-buffer version of a hash is usable, and faster than
+  hashing the messages one at a time, on this CPU.  SHA-1's rotates are
+  too costly with SSE2 alone.
+  @param hash   The hash descriptor
+  @return 1 if it is, 0 otherwise
+*/
+int sha_mb_available(const struct ltc_hash_descriptor *hash)
+{
+   int features = crypt_cpu_features();
+
+#ifdef SHA256
+   if (hash == &sha256_desc) {
+      return (features & (LTC_CPU_SSE2 | LTC_CPU_AVX2)) ? 1 : 0;
+   }
+#endif
+#ifdef SHA1
+   if (hash == &sha1_desc) {
+      return (features & LTC_CPU_AVX2) ? 1 : 0;
+   }
+#endif
+   return 0;
+}
+
+#endif /* LTC_SHA_MB */
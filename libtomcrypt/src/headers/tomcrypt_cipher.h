@@ -624,6 +624,28 @@ void rijndael_enc_done(symmetric_key *skey);
 int rijndael_enc_keysize(int *keysize);
 extern const struct ltc_cipher_descriptor rijndael_desc, aes_desc;
 extern const struct ltc_cipher_descriptor rijndael_enc_desc, aes_enc_desc;
+
+/* AES-NI, only usable if crypt_cpu_features() reports LTC_CPU_AESNI */
+#if !defined(LTC_NO_ASM) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LTC_AESNI
+int aesni_setup(const unsigned char *key, int keylen, int num_rounds, symmetric_key *skey);
+int aesni_ecb_encrypt(const unsigned char *pt, unsigned char *ct, symmetric_key *skey);
+int aesni_ecb_decrypt(const unsigned char *ct, unsigned char *pt, symmetric_key *skey);
+int aesni_accel_ecb_encrypt(const unsigned char *pt, unsigned char *ct, unsigned long blocks, symmetric_key *skey);
+int aesni_accel_ecb_decrypt(const unsigned char *ct, unsigned char *pt, unsigned long blocks, symmetric_key *skey);
+int aesni_accel_cbc_encrypt(const unsigned char *pt, unsigned char *ct, unsigned long blocks, unsigned char *IV, symmetric_key *skey);
+int aesni_accel_cbc_decrypt(const unsigned char *ct, unsigned char *pt, unsigned long blocks, unsigned char *IV, symmetric_key *skey);
+int aesni_accel_ctr_encrypt(const unsigned char *pt, unsigned char *ct, unsigned long blocks, unsigned char *IV, int mode, symmetric_key *skey);
+extern const struct ltc_cipher_descriptor aesni_desc;
+#endif
+
+/* constant time bitsliced encryption, for CPUs without AES instructions */
+#define LTC_AES_CT
+int aes_ct_setup(const unsigned char *key, int keylen, int num_rounds, symmetric_key *skey);
+int aes_ct_ecb_encrypt(const unsigned char *pt, unsigned char *ct, symmetric_key *skey);
+int aes_ct_accel_ecb_encrypt(const unsigned char *pt, unsigned char *ct, unsigned long blocks, symmetric_key *skey);
+int aes_ct_accel_ctr_encrypt(const unsigned char *pt, unsigned char *ct, unsigned long blocks, unsigned char *IV, int mode, symmetric_key *skey);
+extern const struct ltc_cipher_descriptor aes_ct_desc;
 #endif
 
 #ifdef XTEA
@@ -825,6 +847,26 @@ int f8_test_mode(void);
 #endif
 
 
+
+#ifdef LTC_CHACHA
+typedef struct {
+   ulong32 input[16];
+   unsigned char kstream[64];
+   unsigned long ksleft;
+   unsigned long ivlen;
+   int rounds;
+} chacha_state;
+
+int chacha_setup(chacha_state *st, const unsigned char *key, unsigned long keylen, int rounds);
+int chacha_ivctr64(chacha_state *st, const unsigned char *iv, unsigned long ivlen, ulong64 counter);
+int chacha_crypt(chacha_state *st, const unsigned char *in, unsigned long inlen, unsigned char *out);
+int chacha_keystream(chacha_state *st, unsigned char *out, unsigned long outlen);
+int chacha_done(chacha_state *st);
+
+/* don't call */
+unsigned long chacha_blocks_accel(chacha_state *st, const unsigned char *in, unsigned char *out, unsigned long blocks);
+#endif
+
 int find_cipher(const char *name);
 int find_cipher_any(const char *name, int blocklen, int keylen);
 int find_cipher_id(unsigned char ID);
@@ -118,6 +118,23 @@
 #define LTC_CTR_MODE
 #endif
 
+#if DROPBEAR_ENABLE_GCM_MODE
+#define GCM_MODE
+/* 64kB of tables per key, only used without carry-less multiply */
+#if !DROPBEAR_SMALL_CODE
+#define GCM_TABLES
+#endif
+#endif
+
+#if DROPBEAR_CHACHA20POLY1305
+#define LTC_CHACHA
+#define LTC_POLY1305
+#endif
+
+#if DROPBEAR_UMAC
+#define LTC_UMAC
+#endif
+
 #define SHA1
 
 #ifdef DROPBEAR_MD5
@@ -254,6 +254,40 @@ int sha1_test(void);
 extern const struct ltc_hash_descriptor sha1_desc;
 #endif
 
+/* AES-NI counter mode stitched with SHA-256/SHA-1, see aes_ni_sha.c */
+#if defined(RIJNDAEL) && defined(LTC_AESNI)
+#ifdef SHA256
+int aesni_ctr_sha256_stitch(const unsigned char *in, unsigned char *out,
+                            const unsigned char *hin, unsigned long steps,
+                            unsigned char *IV, int mode, symmetric_key *skey,
+                            hash_state *md);
+#endif
+#ifdef SHA1
+int aesni_ctr_sha1_stitch(const unsigned char *in, unsigned char *out,
+                          const unsigned char *hin, unsigned long steps,
+                          unsigned char *IV, int mode, symmetric_key *skey,
+                          hash_state *md);
+#endif
+#endif
+
+/* Multi-buffer SHA-256/SHA-1, one block of each of several messages at
+ * once in SIMD lanes, see sha_mb.c */
+#if !defined(LTC_NO_ASM) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LTC_SHA_MB
+#define SHA_MB_LANES 8
+typedef struct {
+    unsigned int h[8][SHA_MB_LANES];
+} sha_mb_state;
+
+int sha_mb_available(const struct ltc_hash_descriptor *hash);
+#ifdef SHA256
+void sha256_mb_compress(sha_mb_state *st, const unsigned char *const blocks[SHA_MB_LANES], unsigned int active);
+#endif
+#ifdef SHA1
+void sha1_mb_compress(sha_mb_state *st, const unsigned char *const blocks[SHA_MB_LANES], unsigned int active);
+#endif
+#endif
+
 #ifdef MD5
 int md5_init(hash_state * md);
 int md5_process(hash_state * md, const unsigned char *in, unsigned long inlen);
@@ -23,6 +23,57 @@ int hmac_file(int hash, const char *fname, const unsigned char *key,
               unsigned char *dst, unsigned long *dstlen);
 #endif
 
+#ifdef LTC_POLY1305
+typedef struct {
+   ulong32 r[5];
+   ulong32 h[5];
+   ulong32 pad[4];
+   unsigned long leftover;
+   unsigned char buffer[16];
+   int final;
+} poly1305_state;
+
+int poly1305_init(poly1305_state *st, const unsigned char *key, unsigned long keylen);
+int poly1305_process(poly1305_state *st, const unsigned char *in, unsigned long inlen);
+int poly1305_done(poly1305_state *st, unsigned char *mac, unsigned long *maclen);
+#endif /* LTC_POLY1305 */
+
+#ifdef LTC_UMAC
+#define LTC_UMAC_MAX_ITERS 4
+
+typedef struct {
+   int             cipher;
+   symmetric_key   key;
+   unsigned long   taglen, iters;
+   int             accel;
+
+   /* L1 (NH), L2 (64 and 128 bit polynomial) and L3 keys */
+   ulong32         nhkey[256 + 4 * (LTC_UMAC_MAX_ITERS - 1)];
+   ulong64         polykey[LTC_UMAC_MAX_ITERS];
+   ulong32         poly128key[LTC_UMAC_MAX_ITERS][4];
+   ulong64         l3key1[LTC_UMAC_MAX_ITERS][8];
+   ulong32         l3key2[LTC_UMAC_MAX_ITERS];
+
+   /* the enciphered nonce, kept for the next nonce sharing the block */
+   unsigned char   pad_nonce[16], pad[16];
+   int             pad_valid;
+
+   /* message state */
+   unsigned char   buf[1024];
+   unsigned long   buflen;
+   ulong64         chunks;
+   ulong64         y64[LTC_UMAC_MAX_ITERS];
+   ulong32         y128[LTC_UMAC_MAX_ITERS][4];
+   ulong64         pending[LTC_UMAC_MAX_ITERS];
+} umac_state;
+
+int umac_init(umac_state *umac, int cipher, const unsigned char *key, unsigned long keylen,
+              unsigned long taglen);
+int umac_process(umac_state *umac, const unsigned char *in, unsigned long inlen);
+int umac_done(umac_state *umac, const unsigned char *nonce, unsigned long noncelen,
+              unsigned char *out, unsigned long *outlen);
+#endif /* LTC_UMAC */
+
 #ifdef LTC_OMAC
 
 typedef struct {
@@ -231,6 +282,11 @@ extern const unsigned char gcm_shift_table[];
 #define GCM_MODE_AAD   1
 #define GCM_MODE_TEXT  2
 
+/* GHASH with carry-less multiply, selected at runtime */
+#if !defined(LTC_NO_ASM) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LTC_GCM_PCLMUL
+#endif
+
 typedef struct { 
    symmetric_key       K;
    unsigned char       H[16],        /* multiplier */
@@ -247,6 +303,9 @@ typedef struct {
    ulong64             totlen,       /* 64-bit counter used for IV and AAD */
                        pttotlen;     /* 64-bit counter for the PT */
 
+   int                 accel;        /* use the accelerated GHASH */
+   unsigned char       HP[4][16];    /* H^4..H^1 for the accelerated GHASH */
+
 #ifdef GCM_TABLES
    unsigned char       PC[16][256][16]  /* 16 tables of 8x128 */
 #ifdef GCM_TABLES_SSE2
@@ -258,6 +317,11 @@ __attribute__ ((aligned (16)))
 
 void gcm_mult_h(gcm_state *gcm, unsigned char *I);
 
+/* don't call */
+int gcm_ghash_accel_init(gcm_state *gcm);
+void gcm_ghash_accel(gcm_state *gcm, const unsigned char *in, unsigned long blocks);
+void gcm_mult_h_accel(gcm_state *gcm, unsigned char *I);
+
 int gcm_init(gcm_state *gcm, int cipher,
              const unsigned char *key, int keylen);
 
@@ -18,6 +18,20 @@ extern const char *crypt_build_settings;
 /* ---- HMM ---- */
 int crypt_fsa(void *mp, ...);
 
+/* ---- CPU feature detection ---- */
+#define LTC_CPU_SSE2     0x0001
+#define LTC_CPU_SSSE3    0x0002
+#define LTC_CPU_SSE41    0x0004
+#define LTC_CPU_AVX2     0x0008
+#define LTC_CPU_AESNI    0x0010
+#define LTC_CPU_PCLMUL   0x0020
+#define LTC_CPU_VAES     0x0040
+#define LTC_CPU_VPCLMUL  0x0080
+#define LTC_CPU_NEON     0x0100
+
+int crypt_cpu_features(void);
+void crypt_cpu_features_mask(int mask);
+
 /* $Source: /cvs/libtom/libtomcrypt/src/headers/tomcrypt_misc.h,v $ */
 /* $Revision: 1.4 $ */
 /* $Date: 2006/11/06 03:03:01 $ */
@@ -0,0 +1,574 @@
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ *
+ * Tom St Denis, tomstdenis@gmail.com, http://libtomcrypt.com
+ */
+#include "tomcrypt.h"
+
+/**
+  @file umac.c
+  UMAC message authentication, RFC 4418.
+
+  The message is hashed in 1024 byte chunks by NH (L1), the chunk hashes
+  are compressed by a polynomial hash (L2) and the result is reduced to
+  32 bits by an inner product hash (L3), once per 32 bits of tag.  The
+  tag is the UHASH output xored with a pad made by enciphering the nonce.
+  NH dominates the cost, so it has SSE2 and NEON kernels which compute
+  all the iterations from a single load of the message.
+*/
+
+#ifdef LTC_UMAC
+
+#if !defined(LTC_NO_ASM) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UMAC_SSE2
+#include <immintrin.h>
+#endif
+
+#if !defined(LTC_NO_ASM) && defined(__ARM_NEON) && defined(__BYTE_ORDER__) \
+   && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define UMAC_NEON
+#include <arm_neon.h>
+#endif
+
+#define UMAC_CHUNK      1024
+/* L2 switches from the 64 to the 128 bit polynomial after 2^17 bytes of
+   L1 output, 16MB of message */
+#define UMAC_POLY64_MAX 16384
+
+static const ulong64 p64 = CONST64(0xFFFFFFFFFFFFFFC5); /* 2^64 - 59 */
+static const ulong64 p36 = CONST64(0x0000000FFFFFFFFB); /* 2^36 - 5 */
+
+/* Y = KDF(K, index, len), the key derivation of RFC 4418 section 3.2 */
+static int _umac_kdf(int cipher, symmetric_key *skey, unsigned char index,
+      unsigned char *out, unsigned long len)
+{
+   unsigned char in[16], t[16];
+   unsigned long i, n;
+   int err;
+
+   zeromem(in, sizeof(in));
+   in[7] = index;
+   for (i = 1; len > 0; i++) {
+      in[15] = (unsigned char)i;
+      if ((err = cipher_descriptor[cipher].ecb_encrypt(in, t, skey)) != CRYPT_OK) {
+         return err;
+      }
+      n = MIN(len, 16);
+      XMEMCPY(out, t, n);
+      out += n;
+      len -= n;
+   }
+   zeromem(t, sizeof(t));
+   return CRYPT_OK;
+}
+
+/* NH over len bytes (a multiple of 32) for each iteration, the key for
+   iteration i starts 4 words after that of iteration i - 1 */
+static void _umac_nh(const umac_state *umac, const unsigned char *in,
+      unsigned long len, ulong64 *out)
+{
+   const ulong32 *k = umac->nhkey;
+   ulong32 m[8];
+   unsigned long i, j, x;
+
+   for (i = 0; i < umac->iters; i++) {
+      out[i] = 0;
+   }
+   for (x = 0; x < len; x += 32, k += 8) {
+      for (j = 0; j < 8; j++) {
+         LOAD32L(m[j], in + x + 4*j);
+      }
+      for (i = 0; i < umac->iters; i++) {
+         const ulong32 *ki = k + 4*i;
+         out[i] += (ulong64)((m[0] + ki[0]) & 0xFFFFFFFFUL) * ((m[4] + ki[4]) & 0xFFFFFFFFUL)
+                 + (ulong64)((m[1] + ki[1]) & 0xFFFFFFFFUL) * ((m[5] + ki[5]) & 0xFFFFFFFFUL)
+                 + (ulong64)((m[2] + ki[2]) & 0xFFFFFFFFUL) * ((m[6] + ki[6]) & 0xFFFFFFFFUL)
+                 + (ulong64)((m[3] + ki[3]) & 0xFFFFFFFFUL) * ((m[7] + ki[7]) & 0xFFFFFFFFUL);
+      }
+   }
+}
+
+#ifdef UMAC_SSE2
+/* two of the four products in each _mm_mul_epu32, summed in 64 bit lanes */
+__attribute__((target("sse2")))
+static void _umac_nh_sse2(const umac_state *umac, const unsigned char *in,
+      unsigned long len, ulong64 *out)
+{
+   const ulong32 *k = umac->nhkey;
+   __m128i acc[LTC_UMAC_MAX_ITERS], kv[LTC_UMAC_MAX_ITERS + 1];
+   __m128i mlo, mhi, a, b;
+   unsigned long i, x, iters = umac->iters;
+   ulong64 t[2];
+
+   for (i = 0; i < iters; i++) {
+      acc[i] = _mm_setzero_si128();
+   }
+   for (x = 0; x < len; x += 32, k += 8) {
+      mlo = _mm_loadu_si128((const __m128i*)(in + x));
+      mhi = _mm_loadu_si128((const __m128i*)(in + x + 16));
+      for (i = 0; i <= iters; i++) {
+         kv[i] = _mm_loadu_si128((const __m128i*)(k + 4*i));
+      }
+      for (i = 0; i < iters; i++) {
+         a = _mm_add_epi32(mlo, kv[i]);
+         b = _mm_add_epi32(mhi, kv[i+1]);
+         acc[i] = _mm_add_epi64(acc[i], _mm_mul_epu32(a, b));
+         acc[i] = _mm_add_epi64(acc[i], _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32)));
+      }
+   }
+   for (i = 0; i < iters; i++) {
+      _mm_storeu_si128((__m128i*)t, acc[i]);
+      out[i] = t[0] + t[1];
+   }
+}
+#endif
+
+#ifdef UMAC_NEON
+static void _umac_nh_neon(const umac_state *umac, const unsigned char *in,
+      unsigned long len, ulong64 *out)
+{
+   const ulong32 *k = umac->nhkey;
+   uint64x2_t acc[LTC_UMAC_MAX_ITERS];
+   uint32x4_t kv[LTC_UMAC_MAX_ITERS + 1];
+   uint32x4_t mlo, mhi, a, b;
+   unsigned long i, x, iters = umac->iters;
+
+   for (i = 0; i < iters; i++) {
+      acc[i] = vdupq_n_u64(0);
+   }
+   for (x = 0; x < len; x += 32, k += 8) {
+      mlo = vreinterpretq_u32_u8(vld1q_u8(in + x));
+      mhi = vreinterpretq_u32_u8(vld1q_u8(in + x + 16));
+      for (i = 0; i <= iters; i++) {
+         kv[i] = vld1q_u32(k + 4*i);
+      }
+      for (i = 0; i < iters; i++) {
+         a = vaddq_u32(mlo, kv[i]);
+         b = vaddq_u32(mhi, kv[i+1]);
+         acc[i] = vmlal_u32(acc[i], vget_low_u32(a), vget_low_u32(b));
+         acc[i] = vmlal_u32(acc[i], vget_high_u32(a), vget_high_u32(b));
+      }
+   }
+   for (i = 0; i < iters; i++) {
+      out[i] = vgetq_lane_u64(acc[i], 0) + vgetq_lane_u64(acc[i], 1);
+   }
+}
+#endif
+
+/* L1 hash of one chunk of len message bytes, padded to a multiple of 32 */
+static void _umac_l1(const umac_state *umac, const unsigned char *in,
+      unsigned long len, unsigned long bytes, ulong64 *out)
+{
+   unsigned long i;
+
+#if defined(UMAC_NEON)
+   _umac_nh_neon(umac, in, len, out);
+#else
+#if defined(UMAC_SSE2)
+   if (umac->accel) {
+      _umac_nh_sse2(umac, in, len, out);
+   } else
+#endif
+   {
+      _umac_nh(umac, in, len, out);
+   }
+#endif
+   for (i = 0; i < umac->iters; i++) {
+      out[i] += (ulong64)bytes * 8;
+   }
+}
+
+/* hi:lo = a * b */
+static void _umac_mul64(ulong64 a, ulong64 b, ulong64 *hi, ulong64 *lo)
+{
+   ulong64 a0 = a & 0xFFFFFFFFUL, a1 = a >> 32;
+   ulong64 b0 = b & 0xFFFFFFFFUL, b1 = b >> 32;
+   ulong64 p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+   ulong64 mid = (p00 >> 32) + (p01 & 0xFFFFFFFFUL) + (p10 & 0xFFFFFFFFUL);
+
+   *lo = (mid << 32) | (p00 & 0xFFFFFFFFUL);
+   *hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+}
+
+/* (k * y + m) mod 2^64 - 59, for k < 2^57 */
+static ulong64 _umac_poly64_step(ulong64 y, ulong64 k, ulong64 m)
+{
+   ulong64 hi, lo, r;
+
+   _umac_mul64(k, y, &hi, &lo);
+   /* 2^64 = 59 mod p64 */
+   hi *= 59;
+   r = lo + hi;
+   if (r < hi) {
+      r += 59;
+   }
+   r += m;
+   if (r < m) {
+      r += 59;
+   }
+   if (r >= p64) {
+      r -= p64;
+   }
+   return r;
+}
+
+static ulong64 _umac_poly64(ulong64 y, ulong64 k, ulong64 m)
+{
+   /* words at or above 2^64 - 2^32 go in as a marker and m - 59 */
+   if ((m >> 32) == 0xFFFFFFFFUL) {
+      y = _umac_poly64_step(y, k, p64 - 1);
+      m -= 59;
+   }
+   return _umac_poly64_step(y, k, m);
+}
+
+/* y = (k * y + m) mod 2^128 - 159, as 32 bit limbs, least significant first */
+static void _umac_poly128_step(ulong32 *y, const ulong32 *k, const ulong32 *m)
+{
+   ulong32 p[8];
+   ulong64 c;
+   int i, j;
+
+   for (i = 0; i < 8; i++) {
+      p[i] = 0;
+   }
+   for (i = 0; i < 4; i++) {
+      c = 0;
+      for (j = 0; j < 4; j++) {
+         c += (ulong64)k[i] * y[j] + p[i+j];
+         p[i+j] = (ulong32)c;
+         c >>= 32;
+      }
+      p[i+4] = (ulong32)c;
+   }
+
+   /* 2^128 = 159 mod p128 */
+   c = 0;
+   for (i = 0; i < 4; i++) {
+      c += (ulong64)p[i+4] * 159 + p[i] + m[i];
+      y[i] = (ulong32)c;
+      c >>= 32;
+   }
+   while (c) {
+      c *= 159;
+      for (i = 0; i < 4; i++) {
+         c += y[i];
+         y[i] = (ulong32)c;
+         c >>= 32;
+      }
+   }
+   if (y[3] == 0xFFFFFFFFUL && y[2] == 0xFFFFFFFFUL && y[1] == 0xFFFFFFFFUL
+         && y[0] >= 0xFFFFFF61UL) {
+      y[0] = (y[0] + 159) & 0xFFFFFFFFUL;
+      y[1] = y[2] = y[3] = 0;
+   }
+}
+
+/* the 128 bit word hi:lo */
+static void _umac_poly128(ulong32 *y, const ulong32 *k, ulong64 hi, ulong64 lo)
+{
+   static const ulong32 marker[4] = { 0xFFFFFF60UL, 0xFFFFFFFFUL, 0xFFFFFFFFUL, 0xFFFFFFFFUL };
+   ulong32 m[4];
+
+   /* words at or above 2^128 - 2^96 go in as a marker and m - 159 */
+   if ((hi >> 32) == 0xFFFFFFFFUL) {
+      _umac_poly128_step(y, k, marker);
+      if (lo < 159) {
+         hi--;
+      }
+      lo -= 159;
+   }
+   m[0] = (ulong32)lo;
+   m[1] = (ulong32)(lo >> 32);
+   m[2] = (ulong32)hi;
+   m[3] = (ulong32)(hi >> 32);
+   _umac_poly128_step(y, k, m);
+}
+
+/* feed one L1 output per iteration into L2 */
+static void _umac_l2(umac_state *umac, const ulong64 *a)
+{
+   unsigned long i;
+
+   for (i = 0; i < umac->iters; i++) {
+      if (umac->chunks < UMAC_POLY64_MAX) {
+         umac->y64[i] = _umac_poly64(umac->y64[i], umac->polykey[i], a[i]);
+      } else if (umac->chunks == UMAC_POLY64_MAX) {
+         /* the 64 bit result is the first word of the 128 bit hash */
+         umac->y128[i][0] = 1;
+         umac->y128[i][1] = umac->y128[i][2] = umac->y128[i][3] = 0;
+         _umac_poly128(umac->y128[i], umac->poly128key[i], 0, umac->y64[i]);
+         umac->pending[i] = a[i];
+      } else if (umac->chunks & 1) {
+         _umac_poly128(umac->y128[i], umac->poly128key[i], umac->pending[i], a[i]);
+      } else {
+         umac->pending[i] = a[i];
+      }
+   }
+   umac->chunks++;
+}
+
+/* 32 bit L3 hash of the 128 bit hi:lo */
+static ulong32 _umac_l3(const umac_state *umac, unsigned long i, ulong64 hi, ulong64 lo)
+{
+   ulong64 y = 0;
+   int j;
+
+   for (j = 0; j < 4; j++) {
+      y += ((hi >> (48 - 16*j)) & 0xFFFF) * umac->l3key1[i][j];
+      y += ((lo >> (48 - 16*j)) & 0xFFFF) * umac->l3key1[i][j+4];
+   }
+   y %= p36;
+   return (ulong32)y ^ umac->l3key2[i];
+}
+
+static void _umac_reset(umac_state *umac)
+{
+   unsigned long i;
+
+   umac->buflen = 0;
+   umac->chunks = 0;
+   for (i = 0; i < umac->iters; i++) {
+      umac->y64[i] = 1;
+   }
+}
+
+/**
+   Initialize a UMAC state
+   @param umac    The UMAC state
+   @param cipher  The index of the cipher to use, which must have a 16 byte block (AES for RFC 4418)
+   @param key     The secret key
+   @param keylen  The length of the secret key (octets)
+   @param taglen  The length of the tag to produce, 4, 8, 12 or 16 (octets)
+   @return CRYPT_OK if successful
+*/
+int umac_init(umac_state *umac, int cipher, const unsigned char *key, unsigned long keylen,
+      unsigned long taglen)
+{
+   unsigned char buf[(256 + 4 * (LTC_UMAC_MAX_ITERS - 1)) * 4];
+   symmetric_key skey;
+   unsigned long i, j;
+   int err;
+
+   LTC_ARGCHK(umac != NULL);
+   LTC_ARGCHK(key  != NULL);
+
+   if ((err = cipher_is_valid(cipher)) != CRYPT_OK) {
+      return err;
+   }
+   if (cipher_descriptor[cipher].block_length != 16) {
+      return CRYPT_INVALID_CIPHER;
+   }
+   if (taglen == 0 || taglen > 16 || (taglen & 3) != 0) {
+      return CRYPT_INVALID_ARG;
+   }
+   if ((err = cipher_descriptor[cipher].setup(key, keylen, 0, &skey)) != CRYPT_OK) {
+      return err;
+   }
+
+   umac->cipher = cipher;
+   umac->taglen = taglen;
+   umac->iters = taglen / 4;
+
+   /* the pad key, K' = KDF(K, 0, keylen) */
+   if ((err = _umac_kdf(cipher, &skey, 0, buf, keylen)) != CRYPT_OK) {
+      goto done;
+   }
+   if ((err = cipher_descriptor[cipher].setup(buf, keylen, 0, &umac->key)) != CRYPT_OK) {
+      goto done;
+   }
+
+   /* L1, the NH key words are big endian */
+   if ((err = _umac_kdf(cipher, &skey, 1, buf, (256 + 4 * (umac->iters - 1)) * 4)) != CRYPT_OK) {
+      goto done;
+   }
+   for (i = 0; i < 256 + 4 * (umac->iters - 1); i++) {
+      LOAD32H(umac->nhkey[i], buf + 4*i);
+   }
+
+   /* L2 */
+   if ((err = _umac_kdf(cipher, &skey, 2, buf, umac->iters * 24)) != CRYPT_OK) {
+      goto done;
+   }
+   for (i = 0; i < umac->iters; i++) {
+      LOAD64H(umac->polykey[i], buf + 24*i);
+      umac->polykey[i] &= CONST64(0x01FFFFFF01FFFFFF);
+      for (j = 0; j < 4; j++) {
+         LOAD32H(umac->poly128key[i][3-j], buf + 24*i + 8 + 4*j);
+         umac->poly128key[i][3-j] &= 0x01FFFFFFUL;
+      }
+   }
+
+   /* L3 */
+   if ((err = _umac_kdf(cipher, &skey, 3, buf, umac->iters * 64)) != CRYPT_OK) {
+      goto done;
+   }
+   for (i = 0; i < umac->iters; i++) {
+      for (j = 0; j < 8; j++) {
+         LOAD64H(umac->l3key1[i][j], buf + 64*i + 8*j);
+         umac->l3key1[i][j] %= p36;
+      }
+   }
+   if ((err = _umac_kdf(cipher, &skey, 4, buf, umac->iters * 4)) != CRYPT_OK) {
+      goto done;
+   }
+   for (i = 0; i < umac->iters; i++) {
+      LOAD32H(umac->l3key2[i], buf + 4*i);
+   }
+
+   umac->accel = 0;
+#ifdef UMAC_SSE2
+   umac->accel = (crypt_cpu_features() & LTC_CPU_SSE2) != 0;
+#endif
+   umac->pad_valid = 0;
+   _umac_reset(umac);
+
+done:
+   cipher_descriptor[cipher].done(&skey);
+   zeromem(buf, sizeof(buf));
+#ifdef LTC_CLEAN_STACK
+   zeromem(&skey, sizeof(skey));
+#endif
+   return err;
+}
+
+/**
+  Process data through UMAC
+  @param umac    The UMAC state
+  @param in      The data to send through UMAC
+  @param inlen   The length of the data to UMAC (octets)
+  @return CRYPT_OK if successful
+*/
+int umac_process(umac_state *umac, const unsigned char *in, unsigned long inlen)
+{
+   ulong64 a[LTC_UMAC_MAX_ITERS];
+   unsigned long n;
+
+   LTC_ARGCHK(umac != NULL);
+   LTC_ARGCHK(in != NULL || inlen == 0);
+
+   /* the final chunk is only hashed by umac_done(), since its length
+      goes into the hash */
+   if (umac->buflen > 0) {
+      n = MIN(inlen, UMAC_CHUNK - umac->buflen);
+      XMEMCPY(umac->buf + umac->buflen, in, n);
+      umac->buflen += n;
+      in += n;
+      inlen -= n;
+      if (inlen == 0) {
+         return CRYPT_OK;
+      }
+      _umac_l1(umac, umac->buf, UMAC_CHUNK, UMAC_CHUNK, a);
+      _umac_l2(umac, a);
+      umac->buflen = 0;
+   }
+
+   /* whole chunks straight from the input */
+   while (inlen > UMAC_CHUNK) {
+      _umac_l1(umac, in, UMAC_CHUNK, UMAC_CHUNK, a);
+      _umac_l2(umac, a);
+      in += UMAC_CHUNK;
+      inlen -= UMAC_CHUNK;
+   }
+
+   XMEMCPY(umac->buf, in, inlen);
+   umac->buflen = inlen;
+   return CRYPT_OK;
+}
+
+/**
+  Terminate a UMAC session.  The state is left ready for another message
+  under the same key.
+  @param umac      The UMAC state
+  @param nonce     The nonce, unique for each message
+  @param noncelen  The length of the nonce, 1 to 16 (octets)
+  @param out       [out] The destination of the UMAC tag
+  @param outlen    [in/out]  The max size and resulting size of the UMAC tag
+  @return CRYPT_OK if successful
+*/
+int umac_done(umac_state *umac, const unsigned char *nonce, unsigned long noncelen,
+      unsigned char *out, unsigned long *outlen)
+{
+   ulong64 a[LTC_UMAC_MAX_ITERS], hi, lo;
+   unsigned char block[16];
+   unsigned long i, len, index = 0;
+   ulong32 y;
+   int err;
+
+   LTC_ARGCHK(umac   != NULL);
+   LTC_ARGCHK(nonce  != NULL);
+   LTC_ARGCHK(out    != NULL);
+   LTC_ARGCHK(outlen != NULL);
+
+   if (noncelen == 0 || noncelen > 16) {
+      return CRYPT_INVALID_ARG;
+   }
+   if (*outlen < umac->taglen) {
+      *outlen = umac->taglen;
+      return CRYPT_BUFFER_OVERFLOW;
+   }
+
+   /* pad, short tags use part of the block so the low nonce bits select
+      which part and the enciphered block can be reused */
+   zeromem(block, sizeof(block));
+   XMEMCPY(block, nonce, noncelen);
+   if (umac->taglen <= 8) {
+      index = block[noncelen-1] & (16 / umac->taglen - 1);
+      block[noncelen-1] ^= (unsigned char)index;
+   }
+   if (!umac->pad_valid || XMEMCMP(block, umac->pad_nonce, 16) != 0) {
+      if ((err = cipher_descriptor[umac->cipher].ecb_encrypt(block, umac->pad, &umac->key)) != CRYPT_OK) {
+         return err;
+      }
+      XMEMCPY(umac->pad_nonce, block, 16);
+      umac->pad_valid = 1;
+   }
+
+   /* the last chunk, zero padded to a non-zero multiple of 32 bytes */
+   len = (umac->buflen + 31) & ~31UL;
+   if (len == 0) {
+      len = 32;
+   }
+   zeromem(umac->buf + umac->buflen, len - umac->buflen);
+   _umac_l1(umac, umac->buf, len, umac->buflen, a);
+
+   if (umac->chunks > 0) {
+      _umac_l2(umac, a);
+   }
+
+   for (i = 0; i < umac->iters; i++) {
+      if (umac->chunks == 0) {
+         /* a single chunk skips L2 */
+         hi = 0;
+         lo = a[i];
+      } else if (umac->chunks <= UMAC_POLY64_MAX) {
+         hi = 0;
+         lo = umac->y64[i];
+      } else {
+         /* terminate the 128 bit words with 0x80 and zero pad */
+         if (umac->chunks & 1) {
+            _umac_poly128(umac->y128[i], umac->poly128key[i], umac->pending[i], CONST64(0x8000000000000000));
+         } else {
+            _umac_poly128(umac->y128[i], umac->poly128key[i], CONST64(0x8000000000000000), 0);
+         }
+         hi = ((ulong64)umac->y128[i][3] << 32) | umac->y128[i][2];
+         lo = ((ulong64)umac->y128[i][1] << 32) | umac->y128[i][0];
+      }
+      y = _umac_l3(umac, i, hi, lo);
+      STORE32H(y, out + 4*i);
+   }
+   for (i = 0; i < umac->taglen; i++) {
+      out[i] ^= umac->pad[index * umac->taglen + i];
+   }
+   *outlen = umac->taglen;
+
+   _umac_reset(umac);
+   return CRYPT_OK;
+}
+
+#endif /* LTC_UMAC */
@@ -0,0 +1,83 @@
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ *
+ * Tom St Denis, tomstdenis@gmail.com, http://libtomcrypt.com
+ */
+#include "tomcrypt.h"
+
+/**
+  @file crypt_cpu_features.c
+  Runtime detection of CPU vector and crypto extensions, used to select
+  accelerated code paths.
+*/
+
+#if !defined(LTC_NO_ASM) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+
+static int detect_features(void)
+{
+   unsigned int a, b, c, d, xcr0_lo, xcr0_hi;
+   int features = 0;
+
+   if (!__get_cpuid(1, &a, &b, &c, &d)) {
+      return 0;
+   }
+   if (d & (1u << 26)) features |= LTC_CPU_SSE2;
+   if (c & (1u << 9))  features |= LTC_CPU_SSSE3;
+   if (c & (1u << 19)) features |= LTC_CPU_SSE41;
+   if (c & (1u << 25)) features |= LTC_CPU_AESNI;
+   if (c & (1u << 1))  features |= LTC_CPU_PCLMUL;
+
+   /* AVX state must also be enabled by the OS (OSXSAVE + XCR0 bits 1,2) */
+   if ((c & (1u << 27)) && (c & (1u << 28))) {
+      __asm__ __volatile__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+      if ((xcr0_lo & 6) == 6 && __get_cpuid_max(0, NULL) >= 7) {
+         __cpuid_count(7, 0, a, b, c, d);
+         if (b & (1u << 5))  features |= LTC_CPU_AVX2;
+         if (c & (1u << 9))  features |= LTC_CPU_VAES;
+         if (c & (1u << 10)) features |= LTC_CPU_VPCLMUL;
+      }
+   }
+   return features;
+}
+#else
+static int detect_features(void)
+{
+#if !defined(LTC_NO_ASM) && defined(__ARM_NEON) && defined(__BYTE_ORDER__) \
+   && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+   return LTC_CPU_NEON;
+#else
+   return 0;
+#endif
+}
+#endif
+
+static int cpu_features = -1;
+static int cpu_features_allowed = ~0;
+
+/**
+  Return the set of LTC_CPU_* extensions usable on this machine.
+  Detection runs once, the result is cached.
+*/
+int crypt_cpu_features(void)
+{
+   if (cpu_features < 0) {
+      cpu_features = detect_features();
+   }
+   return cpu_features & cpu_features_allowed;
+}
+
+/**
+  Restrict the extensions reported by crypt_cpu_features(), eg to
+  exercise the portable code paths.
+  @param mask   LTC_CPU_* bits which may be used, ~0 for all
+*/
+void crypt_cpu_features_mask(int mask)
+{
+   cpu_features_allowed = mask;
+}
@@ -0,0 +1,120 @@
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ *
+ * Tom St Denis, tomstdenis@gmail.com, http://libtomcrypt.com
+ */
+#include "tomcrypt.h"
+
+/**
+  @file chacha_crypt.c
+  ChaCha stream cipher, encrypt or decrypt data (D. J. Bernstein)
+*/
+
+#ifdef LTC_CHACHA
+
+#define QUARTERROUND(a,b,c,d) \
+  x[a] += x[b]; x[d] = ROL(x[d] ^ x[a], 16); \
+  x[c] += x[d]; x[b] = ROL(x[b] ^ x[c], 12); \
+  x[a] += x[b]; x[d] = ROL(x[d] ^ x[a],  8); \
+  x[c] += x[d]; x[b] = ROL(x[b] ^ x[c],  7);
+
+static void _chacha_block(unsigned char *output, const ulong32 *input, int rounds)
+{
+   ulong32 x[16];
+   int i;
+   XMEMCPY(x, input, sizeof(x));
+   for (i = rounds; i > 0; i -= 2) {
+      QUARTERROUND(0, 4, 8,12)
+      QUARTERROUND(1, 5, 9,13)
+      QUARTERROUND(2, 6,10,14)
+      QUARTERROUND(3, 7,11,15)
+      QUARTERROUND(0, 5,10,15)
+      QUARTERROUND(1, 6,11,12)
+      QUARTERROUND(2, 7, 8,13)
+      QUARTERROUND(3, 4, 9,14)
+   }
+   for (i = 0; i < 16; ++i) {
+     x[i] += input[i];
+     STORE32L(x[i], output + 4 * i);
+   }
+}
+
+/**
+  Encrypt (or decrypt) bytes of ciphertext (or plaintext) with ChaCha
+  @param st      The ChaCha state
+  @param in      The plaintext (or ciphertext)
+  @param inlen   The length of the input (octets)
+  @param out     [out] The ciphertext (or plaintext), length inlen
+  @return CRYPT_OK if successful
+*/
+int chacha_crypt(chacha_state *st, const unsigned char *in, unsigned long inlen, unsigned char *out)
+{
+   unsigned char buf[64];
+   unsigned long i, j;
+
+   if (inlen == 0) return CRYPT_OK; /* nothing to do */
+
+   LTC_ARGCHK(st        != NULL);
+   LTC_ARGCHK(in        != NULL);
+   LTC_ARGCHK(out       != NULL);
+   LTC_ARGCHK(st->ivlen != 0);
+
+   if (st->ksleft > 0) {
+      j = MIN(st->ksleft, inlen);
+      for (i = 0; i < j; ++i, st->ksleft--) out[i] = in[i] ^ st->kstream[64 - st->ksleft];
+      inlen -= j;
+      if (inlen == 0) return CRYPT_OK;
+      out += j;
+      in  += j;
+   }
+
+   /* whole blocks go through the vector kernels where available */
+   if (inlen >= 64) {
+      j = chacha_blocks_accel(st, in, out, inlen / 64);
+      in    += 64 * j;
+      out   += 64 * j;
+      inlen -= 64 * j;
+   }
+
+   while (inlen > 0) {
+      _chacha_block(buf, st->input, st->rounds);
+      /* 64-bit block counter */
+      if (++st->input[12] == 0) {
+         st->input[13]++;
+      }
+      if (inlen < 64) {
+         for (i = 0; i < inlen; ++i) out[i] = in[i] ^ buf[i];
+         st->ksleft = 64 - inlen;
+         for (i = inlen; i < 64; ++i) st->kstream[i] = buf[i];
+         break;
+      }
+      for (i = 0; i < 64; ++i) out[i] = in[i] ^ buf[i];
+      inlen -= 64;
+      out   += 64;
+      in    += 64;
+   }
+   zeromem(buf, sizeof(buf));
+   return CRYPT_OK;
+}
+
+/**
+  Generate a stream of random bytes via ChaCha
+  @param st      The ChaCha state
+  @param out     [out] The output buffer
+  @param outlen  The output length
+  @return CRYPT_OK on success
+*/
+int chacha_keystream(chacha_state *st, unsigned char *out, unsigned long outlen)
+{
+   if (outlen == 0) return CRYPT_OK; /* nothing to do */
+   LTC_ARGCHK(out != NULL);
+   XMEMSET(out, 0, outlen);
+   return chacha_crypt(st, out, outlen, out);
+}
+
+#endif
@@ -0,0 +1,81 @@
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ *
+ * Tom St Denis, tomstdenis@gmail.com, http://libtomcrypt.com
+ */
+#include "tomcrypt.h"
+
+/**
+  @file chacha_setup.c
+  ChaCha stream cipher, key setup (D. J. Bernstein)
+*/
+
+#ifdef LTC_CHACHA
+
+static const char * const sigma = "expand 32-byte k";
+static const char * const tau   = "expand 16-byte k";
+
+/**
+  Initialize a ChaCha state with a key
+  @param st      [out] The destination of the ChaCha state
+  @param key     The secret key
+  @param keylen  The length of the secret key (16 or 32 octets)
+  @param rounds  Number of rounds (eg 20 for ChaCha20)
+  @return CRYPT_OK if successful
+*/
+int chacha_setup(chacha_state *st, const unsigned char *key, unsigned long keylen, int rounds)
+{
+   const char *constants;
+
+   LTC_ARGCHK(st  != NULL);
+   LTC_ARGCHK(key != NULL);
+
+   if (keylen != 32 && keylen != 16) {
+      return CRYPT_INVALID_KEYSIZE;
+   }
+   if (rounds <= 0 || (rounds & 1) != 0) {
+      return CRYPT_INVALID_ROUNDS;
+   }
+
+   LOAD32L(st->input[4], key + 0);
+   LOAD32L(st->input[5], key + 4);
+   LOAD32L(st->input[6], key + 8);
+   LOAD32L(st->input[7], key + 12);
+   if (keylen == 32) {
+      key += 16;
+      constants = sigma;
+   } else {
+      constants = tau;
+   }
+   LOAD32L(st->input[8],  key + 0);
+   LOAD32L(st->input[9],  key + 4);
+   LOAD32L(st->input[10], key + 8);
+   LOAD32L(st->input[11], key + 12);
+   LOAD32L(st->input[0], constants + 0);
+   LOAD32L(st->input[1], constants + 4);
+   LOAD32L(st->input[2], constants + 8);
+   LOAD32L(st->input[3], constants + 12);
+   st->rounds = rounds;
+   st->ivlen = 0;
+   st->ksleft = 0;
+   return CRYPT_OK;
+}
+
+/**
+  Wipe a ChaCha state
+  @param st    The ChaCha state
+  @return CRYPT_OK if successful
+*/
+int chacha_done(chacha_state *st)
+{
+   LTC_ARGCHK(st != NULL);
+   zeromem(st, sizeof(chacha_state));
+   return CRYPT_OK;
+}
+
+#endif
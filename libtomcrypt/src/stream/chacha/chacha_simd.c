@@ -0,0 +1,295 @@
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ *
+ * Tom St Denis, tomstdenis@gmail.com, http://libtomcrypt.com
+ */
+#include "tomcrypt.h"
+
+/**
+  @file chacha_simd.c
+  ChaCha stream cipher, multi-block SSE2/AVX2/NEON kernels.
+
+  Each kernel keeps one state word per vector register, with one block
+  per lane ("vertical" layout), so 4 (SSE2, NEON) or 8 (AVX2) blocks are
+  computed per pass and transposed back to byte order at the end.
+  The implementation is picked at runtime from crypt_cpu_features().
+*/
+
+#ifdef LTC_CHACHA
+
+#if !defined(LTC_NO_ASM) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHACHA_X86
+#include <immintrin.h>
+#endif
+
+#if !defined(LTC_NO_ASM) && defined(__ARM_NEON) && defined(__BYTE_ORDER__) \
+   && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define CHACHA_NEON
+#include <arm_neon.h>
+#endif
+
+#define VQUARTERROUND(a,b,c,d) \
+   x[a] = VADD(x[a], x[b]); x[d] = VROT16(VXOR(x[d], x[a])); \
+   x[c] = VADD(x[c], x[d]); x[b] = VROTL(VXOR(x[b], x[c]), 12); \
+   x[a] = VADD(x[a], x[b]); x[d] = VROT8(VXOR(x[d], x[a])); \
+   x[c] = VADD(x[c], x[d]); x[b] = VROTL(VXOR(x[b], x[c]), 7);
+
+#define VDOUBLEROUND \
+   VQUARTERROUND(0, 4, 8,12) \
+   VQUARTERROUND(1, 5, 9,13) \
+   VQUARTERROUND(2, 6,10,14) \
+   VQUARTERROUND(3, 7,11,15) \
+   VQUARTERROUND(0, 5,10,15) \
+   VQUARTERROUND(1, 6,11,12) \
+   VQUARTERROUND(2, 7, 8,13) \
+   VQUARTERROUND(3, 4, 9,14)
+
+#ifdef CHACHA_X86
+
+#define VADD(a,b)   _mm_add_epi32(a, b)
+#define VXOR(a,b)   _mm_xor_si128(a, b)
+#define VROTL(v,n)  _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define VROT16(v)   VROTL(v, 16)
+#define VROT8(v)    VROTL(v, 8)
+
+/* 4 blocks per pass */
+__attribute__((target("sse2")))
+static void _chacha_blocks_sse2(const ulong32 *input, const unsigned char *in,
+      unsigned char *out, unsigned long passes, int rounds)
+{
+   __m128i x[16], orig[16], t0, t1, t2, t3;
+   ulong32 ctr = input[12];
+   int i, j;
+
+   for (i = 0; i < 16; i++) {
+      orig[i] = _mm_set1_epi32((int)input[i]);
+   }
+   while (passes--) {
+      orig[12] = _mm_add_epi32(_mm_set1_epi32((int)ctr), _mm_set_epi32(3, 2, 1, 0));
+      ctr += 4;
+      for (i = 0; i < 16; i++) x[i] = orig[i];
+      for (i = rounds; i > 0; i -= 2) {
+         VDOUBLEROUND
+      }
+      for (i = 0; i < 16; i++) x[i] = _mm_add_epi32(x[i], orig[i]);
+
+      /* transpose each group of four words into the four blocks */
+      for (j = 0; j < 4; j++) {
+         t0 = _mm_unpacklo_epi32(x[4*j+0], x[4*j+1]);
+         t1 = _mm_unpacklo_epi32(x[4*j+2], x[4*j+3]);
+         t2 = _mm_unpackhi_epi32(x[4*j+0], x[4*j+1]);
+         t3 = _mm_unpackhi_epi32(x[4*j+2], x[4*j+3]);
+         x[4*j+0] = _mm_unpacklo_epi64(t0, t1);
+         x[4*j+1] = _mm_unpackhi_epi64(t0, t1);
+         x[4*j+2] = _mm_unpacklo_epi64(t2, t3);
+         x[4*j+3] = _mm_unpackhi_epi64(t2, t3);
+      }
+      for (i = 0; i < 4; i++) {
+         for (j = 0; j < 4; j++) {
+            __m128i m = _mm_loadu_si128((const __m128i*)(in + 64*i + 16*j));
+            _mm_storeu_si128((__m128i*)(out + 64*i + 16*j), _mm_xor_si128(m, x[4*j+i]));
+         }
+      }
+      in += 256;
+      out += 256;
+   }
+}
+
+#undef VADD
+#undef VXOR
+#undef VROTL
+#undef VROT16
+#undef VROT8
+
+#define VADD(a,b)   _mm256_add_epi32(a, b)
+#define VXOR(a,b)   _mm256_xor_si256(a, b)
+#define VROTL(v,n)  _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define VROT16(v)   _mm256_shuffle_epi8(v, rot16)
+#define VROT8(v)    _mm256_shuffle_epi8(v, rot8)
+
+/* 8 blocks per pass */
+__attribute__((target("avx2")))
+static void _chacha_blocks_avx2(const ulong32 *input, const unsigned char *in,
+      unsigned char *out, unsigned long passes, int rounds)
+{
+   __m256i x[16], orig[16], t0, t1, t2, t3;
+   const __m256i rot16 = _mm256_set_epi8(
+         13,12,15,14, 9,8,11,10, 5,4,7,6, 1,0,3,2,
+         13,12,15,14, 9,8,11,10, 5,4,7,6, 1,0,3,2);
+   const __m256i rot8 = _mm256_set_epi8(
+         14,13,12,15, 10,9,8,11, 6,5,4,7, 2,1,0,3,
+         14,13,12,15, 10,9,8,11, 6,5,4,7, 2,1,0,3);
+   ulong32 ctr = input[12];
+   int i, j;
+
+   for (i = 0; i < 16; i++) {
+      orig[i] = _mm256_set1_epi32((int)input[i]);
+   }
+   while (passes--) {
+      orig[12] = _mm256_add_epi32(_mm256_set1_epi32((int)ctr),
+            _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+      ctr += 8;
+      for (i = 0; i < 16; i++) x[i] = orig[i];
+      for (i = rounds; i > 0; i -= 2) {
+         VDOUBLEROUND
+      }
+      for (i = 0; i < 16; i++) x[i] = _mm256_add_epi32(x[i], orig[i]);
+
+      /* 4x4 transpose within each 128-bit lane: afterwards x[4*j+k] holds
+       * words 4j..4j+3 of block k (low lane) and block k+4 (high lane) */
+      for (j = 0; j < 4; j++) {
+         t0 = _mm256_unpacklo_epi32(x[4*j+0], x[4*j+1]);
+         t1 = _mm256_unpacklo_epi32(x[4*j+2], x[4*j+3]);
+         t2 = _mm256_unpackhi_epi32(x[4*j+0], x[4*j+1]);
+         t3 = _mm256_unpackhi_epi32(x[4*j+2], x[4*j+3]);
+         x[4*j+0] = _mm256_unpacklo_epi64(t0, t1);
+         x[4*j+1] = _mm256_unpackhi_epi64(t0, t1);
+         x[4*j+2] = _mm256_unpacklo_epi64(t2, t3);
+         x[4*j+3] = _mm256_unpackhi_epi64(t2, t3);
+      }
+      for (i = 0; i < 4; i++) {
+         for (j = 0; j < 4; j += 2) {
+            /* 32 bytes of block i and of block i+4 */
+            __m256i lo = _mm256_permute2x128_si256(x[4*j+i], x[4*(j+1)+i], 0x20);
+            __m256i hi = _mm256_permute2x128_si256(x[4*j+i], x[4*(j+1)+i], 0x31);
+            __m256i m;
+            m = _mm256_loadu_si256((const __m256i*)(in + 64*i + 16*j));
+            _mm256_storeu_si256((__m256i*)(out + 64*i + 16*j), _mm256_xor_si256(m, lo));
+            m = _mm256_loadu_si256((const __m256i*)(in + 64*(i+4) + 16*j));
+            _mm256_storeu_si256((__m256i*)(out + 64*(i+4) + 16*j), _mm256_xor_si256(m, hi));
+         }
+      }
+      in += 512;
+      out += 512;
+   }
+}
+
+#undef VADD
+#undef VXOR
+#undef VROTL
+#undef VROT16
+#undef VROT8
+
+#endif /* CHACHA_X86 */
+
+#ifdef CHACHA_NEON
+
+#define VADD(a,b)   vaddq_u32(a, b)
+#define VXOR(a,b)   veorq_u32(a, b)
+#define VROTL(v,n)  vorrq_u32(vshlq_n_u32(v, n), vshrq_n_u32(v, 32 - (n)))
+#define VROT16(v)   vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(v)))
+#define VROT8(v)    VROTL(v, 8)
+
+/* 4 blocks per pass */
+static void _chacha_blocks_neon(const ulong32 *input, const unsigned char *in,
+      unsigned char *out, unsigned long passes, int rounds)
+{
+   static const uint32_t lanes[4] = { 0, 1, 2, 3 };
+   uint32x4_t x[16], orig[16];
+   uint32x4x2_t p01, p23;
+   ulong32 ctr = input[12];
+   int i, j;
+
+   for (i = 0; i < 16; i++) {
+      orig[i] = vdupq_n_u32(input[i]);
+   }
+   while (passes--) {
+      orig[12] = vaddq_u32(vdupq_n_u32(ctr), vld1q_u32(lanes));
+      ctr += 4;
+      for (i = 0; i < 16; i++) x[i] = orig[i];
+      for (i = rounds; i > 0; i -= 2) {
+         VDOUBLEROUND
+      }
+      for (i = 0; i < 16; i++) x[i] = vaddq_u32(x[i], orig[i]);
+
+      for (j = 0; j < 4; j++) {
+         p01 = vtrnq_u32(x[4*j+0], x[4*j+1]);
+         p23 = vtrnq_u32(x[4*j+2], x[4*j+3]);
+         x[4*j+0] = vcombine_u32(vget_low_u32(p01.val[0]), vget_low_u32(p23.val[0]));
+         x[4*j+1] = vcombine_u32(vget_low_u32(p01.val[1]), vget_low_u32(p23.val[1]));
+         x[4*j+2] = vcombine_u32(vget_high_u32(p01.val[0]), vget_high_u32(p23.val[0]));
+         x[4*j+3] = vcombine_u32(vget_high_u32(p01.val[1]), vget_high_u32(p23.val[1]));
+      }
+      for (i = 0; i < 4; i++) {
+         for (j = 0; j < 4; j++) {
+            uint8x16_t m = vld1q_u8(in + 64*i + 16*j);
+            vst1q_u8(out + 64*i + 16*j, veorq_u8(m, vreinterpretq_u8_u32(x[4*j+i])));
+         }
+      }
+      in += 256;
+      out += 256;
+   }
+}
+
+#undef VADD
+#undef VXOR
+#undef VROTL
+#undef VROT16
+#undef VROT8
+
+#endif /* CHACHA_NEON */
+
+/**
+  Process as many whole blocks as the vector kernels can handle, advancing
+  the block counter. Only called from chacha_crypt() with no buffered
+  keystream.
+  @param st      The ChaCha state
+  @param in      The plaintext (or ciphertext)
+  @param out     [out] The ciphertext (or plaintext)
+  @param blocks  Number of available 64 byte blocks
+  @return The number of blocks processed, possibly 0
+*/
+unsigned long chacha_blocks_accel(chacha_state *st, const unsigned char *in, unsigned char *out, unsigned long blocks)
+{
+   unsigned long done = 0;
+#if defined(CHACHA_X86) || defined(CHACHA_NEON)
+   int features = crypt_cpu_features();
+   unsigned long n;
+#endif
+
+#ifdef CHACHA_X86
+   if ((features & LTC_CPU_AVX2) && blocks >= 8) {
+      n = blocks / 8;
+      /* the kernels only step the low counter word, leave a wrap to the
+       * scalar code */
+      if (st->input[12] <= 0xFFFFFFFFUL - 8 * n) {
+         _chacha_blocks_avx2(st->input, in, out, n, st->rounds);
+         st->input[12] += 8 * n;
+         done = 8 * n;
+         in += 64 * done;
+         out += 64 * done;
+         blocks -= done;
+      }
+   }
+   if ((features & LTC_CPU_SSE2) && blocks >= 4) {
+      n = blocks / 4;
+      if (st->input[12] <= 0xFFFFFFFFUL - 4 * n) {
+         _chacha_blocks_sse2(st->input, in, out, n, st->rounds);
+         st->input[12] += 4 * n;
+         done += 4 * n;
+      }
+   }
+#elif defined(CHACHA_NEON)
+   if ((features & LTC_CPU_NEON) && blocks >= 4) {
+      n = blocks / 4;
+      if (st->input[12] <= 0xFFFFFFFFUL - 4 * n) {
+         _chacha_blocks_neon(st->input, in, out, n, st->rounds);
+         st->input[12] += 4 * n;
+         done = 4 * n;
+      }
+   }
+#else
+   (void)st;
+   (void)in;
+   (void)out;
+   (void)blocks;
+#endif
+   return done;
+}
+
+#endif
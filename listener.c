@@ -26,6 +26,7 @@
 #include "listener.h"
 #include "session.h"
 #include "dbutil.h"
+#include "event.h"
 
 void listeners_initialise() {
 
@@ -36,24 +37,7 @@ void listeners_initialise() {
 
 }
 
-void set_listener_fds(fd_set * readfds) {
-
-	unsigned int i, j;
-	struct Listener *listener;
-
-	/* check each in turn */
-	for (i = 0; i < ses.listensize; i++) {
-		listener = ses.listeners[i];
-		if (listener != NULL) {
-			for (j = 0; j < listener->nsocks; j++) {
-				FD_SET(listener->socks[j], readfds);
-			}
-		}
-	}
-}
-
-
-void handle_listeners(fd_set * readfds) {
+void handle_listeners() {
 
 	unsigned int i, j;
 	struct Listener *listener;
@@ -65,7 +49,7 @@ void handle_listeners(fd_set * readfds) {
 		if (listener != NULL) {
 			for (j = 0; j < listener->nsocks; j++) {
 				sock = listener->socks[j];
-				if (FD_ISSET(sock, readfds)) {
+				if (events_ready(sock) & DROPBEAR_EV_READ) {
 					listener->acceptor(listener, sock);
 				}
 			}
@@ -113,6 +97,7 @@ struct Listener* new_listener(int socks[], unsigned int nsocks,
 
 	for (j = 0; j < nsocks; j++) {
 		ses.maxfd = MAX(ses.maxfd, socks[j]);
+		events_set(socks[j], DROPBEAR_EV_READ, NULL);
 	}
 
 	TRACE(("new listener num %d ", i))
@@ -157,6 +142,7 @@ void remove_listener(struct Listener* listener) {
 	}
 
 	for (j = 0; j < listener->nsocks; j++) {
+		events_remove(listener->socks[j]);
 		close(listener->socks[j]);
 	}
 	ses.listeners[listener->index] = NULL;
@@ -47,8 +47,7 @@ struct Listener {
 };
 
 void listeners_initialise(void);
-void handle_listeners(fd_set * readfds);
-void set_listener_fds(fd_set * readfds);
+void handle_listeners(void);
 
 struct Listener* new_listener(int socks[], unsigned int nsocks, 
 		int type, void* typedata, 
@@ -2,8 +2,20 @@
 #include "list.h"
 #include "dbutil.h"
 #include "session.h"
+#include "packet.h"
+#include "event.h"
 #include "debug.h"
 
+#if DROPBEAR_TX_ZEROCOPY
+#include <linux/errqueue.h>
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#endif
+
 struct dropbear_progress_connection {
 	struct addrinfo *res;
 	struct addrinfo *res_iter;
@@ -13,7 +25,7 @@ struct dropbear_progress_connection {
 	connect_callback cb;
 	void *cb_data;
 
-	struct Queue *writequeue; /* A queue of encrypted packets to send with TCP fastopen,
+	buffer **writequeue; /* Encrypted packets to send with TCP fastopen,
 								or NULL. */
 
 	int sock;
@@ -55,6 +67,8 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 	int fastopen = 0;
 #if DROPBEAR_CLIENT_TCP_FAST_OPEN
 	struct msghdr message;
+	struct iovec iov;
+	buffer *writequeue;
 #endif
 
 	for (r = c->res_iter; r; r = r->ai_next)
@@ -77,12 +91,12 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 			memset(&message, 0x0, sizeof(message));
 			message.msg_name = r->ai_addr;
 			message.msg_namelen = r->ai_addrlen;
-			/* 6 is arbitrary, enough to hold initial packets */
-			unsigned int iovlen = 6; /* Linux msg_iovlen is a size_t */
-			struct iovec iov[6];
-			packet_queue_to_iovec(c->writequeue, iov, &iovlen);
-			message.msg_iov = iov;
-			message.msg_iovlen = iovlen;
+			/* the initial packets are contiguous in the writequeue */
+			writequeue = *c->writequeue;
+			iov.iov_len = writequeue->len - writequeue->pos;
+			iov.iov_base = buf_getptr(writequeue, iov.iov_len);
+			message.msg_iov = &iov;
+			message.msg_iovlen = 1;
 			res = sendmsg(c->sock, &message, MSG_FASTOPEN);
 			/* Returns EINPROGRESS if FASTOPEN wasn't available */
 			if (res < 0) {
@@ -98,7 +112,7 @@ static void connect_try_next(struct dropbear_progress_connection *c) {
 					c->writequeue = NULL;
 				}
 			} else {
-				packet_queue_consume(c->writequeue, res);
+				writequeue_consume(res);
 			}
 		}
 #endif
@@ -172,7 +186,7 @@ void remove_connect_pending() {
 }
 
 
-void set_connect_fds(fd_set *writefd) {
+void set_connect_fds() {
 	m_list_elem *iter;
 	TRACE(("enter set_connect_fds"))
 	iter = ses.conn_pending.first;
@@ -184,7 +198,7 @@ void set_connect_fds(fd_set *writefd) {
 			connect_try_next(c);
 		}
 		if (c->sock >= 0) {
-			FD_SET(c->sock, writefd);
+			events_set(c->sock, DROPBEAR_EV_WRITE, NULL);
 		} else {
 			/* Final failure */
 			if (!c->errstring) {
@@ -197,7 +211,7 @@ void set_connect_fds(fd_set *writefd) {
 	}
 }
 
-void handle_connect_fds(fd_set *writefd) {
+void handle_connect_fds() {
 	m_list_elem *iter;
 	TRACE(("enter handle_connect_fds"))
 	for (iter = ses.conn_pending.first; iter; iter = iter->next) {
@@ -205,9 +219,11 @@ void handle_connect_fds(fd_set *writefd) {
 		socklen_t vallen = sizeof(val);
 		struct dropbear_progress_connection *c = iter->item;
 
-		if (c->sock < 0 || !FD_ISSET(c->sock, writefd)) {
+		if (c->sock < 0 || !(events_ready(c->sock) & DROPBEAR_EV_WRITE)) {
 			continue;
 		}
+		/* the socket is either closed or passed on below */
+		events_remove(c->sock);
 
 		TRACE(("handling %s port %s socket %d", c->remotehost, c->remoteport, c->sock));
 
@@ -236,59 +252,153 @@ void handle_connect_fds(fd_set *writefd) {
 	TRACE(("leave handle_connect_fds - end iter"))
 }
 
-void connect_set_writequeue(struct dropbear_progress_connection *c, struct Queue *writequeue) {
+void connect_set_writequeue(struct dropbear_progress_connection *c, buffer **writequeue) {
 	c->writequeue = writequeue;
 }
-#if defined(HAVE_WRITEV) && (defined(IOV_MAX) || defined(UIO_MAXIOV))
-void packet_queue_to_iovec(struct Queue *queue, struct iovec *iov, unsigned int *iov_count) {
-	struct Link *l;
-	unsigned int i;
-	int len;
-	buffer *writebuf;
+void set_sock_nodelay(int sock) {
+	int val;
 
-	#ifndef IOV_MAX
-	#define IOV_MAX UIO_MAXIOV
-	#endif
+	/* disable nagle */
+	val = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void*)&val, sizeof(val));
+}
 
-	*iov_count = MIN(MIN(queue->count, IOV_MAX), *iov_count);
+/* Returns the smoothed round trip time of a TCP socket in microseconds,
+ * or 0 if it isn't known */
+unsigned int get_sock_rtt(int sock) {
+#if defined(__linux__) && defined(TCP_INFO)
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
 
-	for (l = queue->head, i = 0; i < *iov_count; l = l->link, i++)
-	{
-		writebuf = (buffer*)l->item;
-		len = writebuf->len - 1 - writebuf->pos;
-		dropbear_assert(len > 0);
-		TRACE2(("write_packet writev #%d  type %d len %d/%d", i, writebuf->data[writebuf->len-1],
-				len, writebuf->len-1))
-		iov[i].iov_base = buf_getptr(writebuf, len);
-		iov[i].iov_len = len;
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, (void*)&info, &len) == 0) {
+		return info.tcpi_rtt;
 	}
+#endif
+	return 0;
 }
 
-void packet_queue_consume(struct Queue *queue, ssize_t written) {
-	buffer *writebuf;
-	int len;
-	while (written > 0) {
-		writebuf = (buffer*)examine(queue);
-		len = writebuf->len - 1 - writebuf->pos;
-		if (len > written) {
-			/* partial buffer write */
-			buf_incrpos(writebuf, written);
-			written = 0;
-		} else {
-			written -= len;
-			dequeue(queue);
-			buf_free(writebuf);
-		}
+#if SEND_QUEUE_DELAY_MS
+/* Returns the number of bytes written to a TCP socket that the kernel
+ * hasn't sent yet, 0 if unknown */
+unsigned int get_sock_unsent(int sock) {
+#ifdef SIOCOUTQNSD
+	int val;
+
+	if (ioctl(sock, SIOCOUTQNSD, &val) == 0 && val > 0) {
+		return val;
 	}
+#endif
+	return 0;
 }
+
+/* Only report writable once less than lowat bytes are unsent, so that
+ * a bulk sender doesn't fill the socket buffer far beyond what's in flight.
+ * Returns DROPBEAR_FAILURE if it isn't a TCP socket or isn't supported */
+int set_sock_notsent_lowat(int sock, unsigned int lowat) {
+#ifdef TCP_NOTSENT_LOWAT
+	int val = lowat;
+
+	if (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void*)&val, sizeof(val)) == 0) {
+		return DROPBEAR_SUCCESS;
+	}
+	TRACE(("set_sock_notsent_lowat failed for socket %d: %s", sock, strerror(errno)))
 #endif
-void set_sock_nodelay(int sock) {
+	return DROPBEAR_FAILURE;
+}
+
+/* Grow one of a socket's buffers to at least want bytes. Setting a size
+ * stops the kernel's own tuning of that buffer, so this is left alone while
+ * the kernel keeps up. The kernel doubles the size that is set */
+static void grow_sock_buffer(int sock, int optname, unsigned int want) {
 	int val;
+	socklen_t len = sizeof(val);
 
-	/* disable nagle */
-	val = 1;
-	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void*)&val, sizeof(val));
+	want = MIN(want, SOCK_BUFFER_MAX);
+	if (getsockopt(sock, SOL_SOCKET, optname, (void*)&val, &len) != 0
+			|| val <= 0 || (unsigned int)val >= want) {
+		return;
+	}
+	val = want/2;
+	TRACE(("grow_sock_buffer %d: %s %u", sock,
+		optname == SO_SNDBUF ? "sndbuf" : "rcvbuf", want))
+	setsockopt(sock, SOL_SOCKET, optname, (void*)&val, sizeof(val));
+}
+
+/* Returns the rate the congestion window currently allows a TCP socket to
+ * send at, in bytes per second, or 0 if it isn't known. The send and
+ * receive buffers are grown to twice the bandwidth delay product seen in
+ * each direction if the kernel hasn't already done so */
+unsigned int tune_sock_buffers(int sock) {
+#if defined(__linux__) && defined(TCP_INFO)
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	uint64_t inflight;
+
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, (void*)&info, &len) != 0
+			|| info.tcpi_rtt == 0) {
+		return 0;
+	}
+
+	inflight = (uint64_t)info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+	grow_sock_buffer(sock, SO_SNDBUF, MIN(2*inflight, SOCK_BUFFER_MAX));
+	grow_sock_buffer(sock, SO_RCVBUF, MIN(2*(uint64_t)info.tcpi_rcv_space, SOCK_BUFFER_MAX));
+
+	return MIN(inflight * 1000000 / info.tcpi_rtt, UINT_MAX);
+#else
+	(void)sock;
+	return 0;
+#endif
+}
+#endif /* SEND_QUEUE_DELAY_MS */
+
+#if DROPBEAR_TX_ZEROCOPY
+/* Allow MSG_ZEROCOPY sends on a socket */
+int set_sock_zerocopy(int sock) {
+	int val = 1;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, (void*)&val, sizeof(val)) == 0) {
+		return DROPBEAR_SUCCESS;
+	}
+	TRACE(("set_sock_zerocopy failed for socket %d: %s", sock, strerror(errno)))
+	return DROPBEAR_FAILURE;
+}
+
+/* Read a MSG_ZEROCOPY completion from the socket's error queue. The kernel
+ * is done with the sends numbered lo to hi inclusive, copied is set if it
+ * had to copy the data anyway. Returns DROPBEAR_FAILURE once there are no
+ * more completions waiting */
+int get_sock_zerocopy_done(int sock, uint32_t *lo, uint32_t *hi, int *copied) {
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *serr;
+	unsigned char control[128];
+
+	for (;;) {
+		memset(&msg, 0x0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			return DROPBEAR_FAILURE;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR)
+				&& !(cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+				continue;
+			}
+			serr = (struct sock_extended_err*)CMSG_DATA(cmsg);
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+			*lo = serr->ee_info;
+			*hi = serr->ee_data;
+			*copied = (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+			return DROPBEAR_SUCCESS;
+		}
+		/* not a completion, try the next one */
+	}
 }
+#endif /* DROPBEAR_TX_ZEROCOPY */
 
 #if DROPBEAR_SERVER_TCP_FAST_OPEN
 void set_listen_fast_open(int sock) {
@@ -3,7 +3,6 @@
 
 #include "includes.h"
 #include "buffer.h"
-#include "queue.h"
 
 enum dropbear_prio {
 	DROPBEAR_PRIO_DEFAULT = 10,
@@ -13,6 +12,16 @@ enum dropbear_prio {
 
 void set_sock_nodelay(int sock);
 void set_sock_priority(int sock, enum dropbear_prio prio);
+unsigned int get_sock_rtt(int sock);
+#if SEND_QUEUE_DELAY_MS
+unsigned int get_sock_unsent(int sock);
+int set_sock_notsent_lowat(int sock, unsigned int lowat);
+unsigned int tune_sock_buffers(int sock);
+#endif
+#if DROPBEAR_TX_ZEROCOPY
+int set_sock_zerocopy(int sock);
+int get_sock_zerocopy_done(int sock, uint32_t *lo, uint32_t *hi, int *copied);
+#endif
 
 void get_socket_address(int fd, char **local_host, char **local_port,
 		char **remote_host, char **remote_port, int host_lookup);
@@ -31,22 +40,34 @@ typedef void(*connect_callback)(int result, int sock, void* data, const char* er
 struct dropbear_progress_connection * connect_remote (const char* remotehost, const char* remoteport,
 	connect_callback cb, void *cb_data);
 
-/* Sets up for select() */
-void set_connect_fds(fd_set *writefd);
-/* Handles ready sockets after select() */
-void handle_connect_fds(fd_set *writefd);
+/* Sets up for events_wait() */
+void set_connect_fds(void);
+/* Handles ready sockets after events_wait() */
+void handle_connect_fds(void);
 /* Cleanup */
 void remove_connect_pending(void);
 
 /* Doesn't actually stop the connect, but adds a dummy callback instead */
 void cancel_connect(struct dropbear_progress_connection *c);
 
-void connect_set_writequeue(struct dropbear_progress_connection *c, struct Queue *writequeue);
+void connect_set_writequeue(struct dropbear_progress_connection *c, buffer **writequeue);
+
+#if SEND_QUEUE_DELAY_MS && defined(__linux__)
+/* May be supported by the kernel even if the libc headers are too old */
+#ifndef SIOCOUTQNSD
+#define SIOCOUTQNSD 0x894B
+#endif
+#endif
 
-/* TODO: writev #ifdef guard */
-/* Fills out iov which contains iov_count slots, returning the number filled in iov_count */
-void packet_queue_to_iovec(struct Queue *queue, struct iovec *iov, unsigned int *iov_count);
-void packet_queue_consume(struct Queue *queue, ssize_t written);
+#if DROPBEAR_TX_ZEROCOPY
+/* Define values which may be supported by the kernel even if the libc is too old */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#endif
 
 #if DROPBEAR_SERVER_TCP_FAST_OPEN
 /* Try for any Linux builds, will fall back if the kernel doesn't support it */
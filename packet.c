@@ -35,48 +35,209 @@
 #include "auth.h"
 #include "channel.h"
 #include "netio.h"
+#include "runopts.h"
 
 static int read_packet_init(void);
-static void make_mac(unsigned int seqno, const struct key_context_directional * key_state,
+static unsigned int recv_max_packet_len(void);
+static unsigned int readahead_take(unsigned char *dest, unsigned int len);
+static void make_mac(unsigned int seqno, struct key_context_directional * key_state,
 		buffer * clear_buf, unsigned int clear_len, 
 		unsigned char *output_mac);
 static int checkmac(void);
+static void seal_packet(buffer *writebuf, unsigned int seqno);
+#if DROPBEAR_MAC_BATCH
+static void mac_batch_hmac(struct key_context_directional *key_state,
+		unsigned int count, unsigned char macs[][MAX_HASH_SIZE]);
+#endif
+#if DROPBEAR_ENABLE_CTR_MODE
+static void mac_stitch_init(struct key_context_directional *key_state);
+static int use_stitch(struct key_context_directional *key_state, unsigned int len);
+static void stitch_crypt_mac(unsigned int seqno, struct key_context_directional *key_state,
+		unsigned char *data, unsigned int len, unsigned int crypt_off,
+		int direction, unsigned char *output_mac);
+#endif
+#if DEBUG_TRACE
+static void trace_packet_allocs(const char *direction);
+#else
+#define trace_packet_allocs(direction)
+#endif
 
 /* For exact details see http://www.zlib.net/zlib_tech.html
  * 5 bytes per 16kB block, plus 6 bytes for the stream.
  * We might allocate 5 unnecessary bytes here if it's an
  * exact multiple. */
-#define ZLIB_COMPRESS_EXPANSION (((RECV_MAX_PAYLOAD_LEN/16384)+1)*5 + 6)
+#define ZLIB_COMPRESS_EXPANSION(len) (((((len))/16384)+1)*5 + 6)
 #define ZLIB_DECOMPRESS_INCR 1024
 #ifndef DISABLE_ZLIB
 static buffer* buf_decompress(buffer* buf, unsigned int len);
 static void buf_compress(buffer * dest, buffer * src, unsigned int len);
 #endif
 
-/* non-blocking function writing out a current encrypted packet */
+#if DROPBEAR_TX_ZEROCOPY
+/* The zerocopy_buf for the current writequeue, if it has sends the
+ * kernel hasn't completed */
+static struct zerocopy_buf* zerocopy_current() {
+	struct zerocopy_buf *zc;
+
+	if (ses.zerocopy_count == 0) {
+		return NULL;
+	}
+	zc = &ses.zerocopy_bufs[ses.zerocopy_count-1];
+	return zc->buf == ses.writequeue ? zc : NULL;
+}
+
+/* write() from the writequeue, with MSG_ZEROCOPY for large bulk writes.
+ * Interactive sessions and small writes are copied as usual */
+static ssize_t write_zerocopy(const unsigned char *data, unsigned int len) {
+	struct zerocopy_buf *zc = zerocopy_current();
+	ssize_t written;
+
+	if (ses.zerocopy < 0) {
+		ses.zerocopy = set_sock_zerocopy(ses.sock_out) == DROPBEAR_SUCCESS;
+	}
+
+	if (!ses.zerocopy
+		|| len < TX_ZEROCOPY_MIN_LEN
+		|| ses.chan_prio_count[DROPBEAR_CHANNEL_PRIO_INTERACTIVE] > 0
+		|| (!zc && ses.zerocopy_count == TX_ZEROCOPY_MAX_BUFFERS)) {
+		return write(ses.sock_out, data, len);
+	}
+
+	written = send(ses.sock_out, data, len, MSG_ZEROCOPY);
+	if (written < 0 && errno == ENOBUFS) {
+		/* over the limit for pinned memory, optmem_max */
+		return write(ses.sock_out, data, len);
+	}
+
+	/* each send that takes data gets a number, for its completion */
+	if (written > 0) {
+		if (!zc) {
+			zc = &ses.zerocopy_bufs[ses.zerocopy_count++];
+			zc->buf = ses.writequeue;
+			zc->first = ses.zerocopy_seq;
+			zc->outstanding = 0;
+		}
+		ses.zerocopy_seq++;
+		zc->next = ses.zerocopy_seq;
+		zc->outstanding++;
+	}
+	return written;
+}
+
+/* Replace the writequeue with another buffer with room for len more bytes,
+ * moving across the unsent data. The kernel may still be reading the sent
+ * part of the old one, so it is left in place until that is completed */
+static void writequeue_retire(unsigned int len) {
+	buffer *wq = ses.writequeue;
+	unsigned int pending = wq->len - wq->pos;
+	unsigned int size = wq->size;
+	buffer *next;
+
+	if (size < pending + len) {
+		size = MAX(size * 2, pending + len);
+	}
+	if (ses.zerocopy_spare && ses.zerocopy_spare->size >= size) {
+		next = ses.zerocopy_spare;
+		ses.zerocopy_spare = NULL;
+	} else {
+		next = buf_new(size);
+	}
+	buf_setpos(next, 0);
+	buf_setlen(next, 0);
+	buf_putbytes(next, buf_getptr(wq, pending), pending);
+	buf_setpos(next, 0);
+	ses.writequeue = next;
+}
+
+static void zerocopy_release(buffer *buf) {
+	if (ses.zerocopy_spare == NULL) {
+		ses.zerocopy_spare = buf;
+	} else {
+		buf_free(buf);
+	}
+}
+
+/* Handle completions for zerocopy sends, and release buffers that the
+ * kernel has finished sending from */
+void zerocopy_reap() {
+	struct zerocopy_buf *zc;
+	uint32_t lo, hi, start, end;
+	unsigned int i, keep;
+	int copied;
+
+	if (ses.zerocopy_count == 0) {
+		return;
+	}
+
+	while (get_sock_zerocopy_done(ses.sock_out, &lo, &hi, &copied) == DROPBEAR_SUCCESS) {
+		TRACE2(("zerocopy done %u-%u%s", lo, hi, copied ? " copied" : ""))
+		if (copied && ses.zerocopy) {
+			/* the route doesn't support it (loopback), pinning only costs */
+			TRACE(("zerocopy sends were copied, disabling"))
+			ses.zerocopy = 0;
+		}
+		for (i = 0; i < ses.zerocopy_count; i++) {
+			zc = &ses.zerocopy_bufs[i];
+			start = MAX(lo, zc->first);
+			end = MIN(hi, zc->next - 1);
+			if (start <= end) {
+				zc->outstanding -= MIN(end - start + 1, zc->outstanding);
+			}
+		}
+	}
+
+	keep = 0;
+	for (i = 0; i < ses.zerocopy_count; i++) {
+		zc = &ses.zerocopy_bufs[i];
+		if (zc->outstanding > 0) {
+			ses.zerocopy_bufs[keep++] = *zc;
+		} else if (zc->buf != ses.writequeue) {
+			zerocopy_release(zc->buf);
+		}
+	}
+	ses.zerocopy_count = keep;
+}
+
+/* Free buffers still waiting on completions, the session is ending */
+void zerocopy_cleanup() {
+	unsigned int i;
+
+	for (i = 0; i < ses.zerocopy_count; i++) {
+		if (ses.zerocopy_bufs[i].buf != ses.writequeue) {
+			buf_free(ses.zerocopy_bufs[i].buf);
+		}
+	}
+	ses.zerocopy_count = 0;
+	if (ses.zerocopy_spare) {
+		buf_free(ses.zerocopy_spare);
+		ses.zerocopy_spare = NULL;
+	}
+}
+#endif /* DROPBEAR_TX_ZEROCOPY */
+
+/* non-blocking function writing out the encrypted packets queued in
+ * ses.writequeue, with a single write() of everything pending */
 void write_packet() {
 
 	ssize_t written;
-#if defined(HAVE_WRITEV) && (defined(IOV_MAX) || defined(UIO_MAXIOV))
-	/* 50 is somewhat arbitrary */
-	unsigned int iov_count = 50;
-	struct iovec iov[50];
-#else
-	int len;
-	buffer* writebuf;
-	int packet_type;
-#endif
-	
+	unsigned int len;
+
 	TRACE2(("enter write_packet"))
-	dropbear_assert(!isempty(&ses.writequeue));
+	dropbear_assert(ses.writequeue_len > 0);
 
-#if defined(HAVE_WRITEV) && (defined(IOV_MAX) || defined(UIO_MAXIOV))
+	mac_batch_flush();
 
-	packet_queue_to_iovec(&ses.writequeue, iov, &iov_count);
+	len = ses.writequeue->len - ses.writequeue->pos;
 	/* This may return EAGAIN. The main loop sometimes
 	calls write_packet() without bothering to test with select() since
 	it's likely to be necessary */
-	written = writev(ses.sock_out, iov, iov_count);
+#if DROPBEAR_TX_ZEROCOPY
+	written = write_zerocopy(buf_getptr(ses.writequeue, len), len);
+#else
+	written = write(ses.sock_out, buf_getptr(ses.writequeue, len), len);
+#endif
+	TRACE2(("write_packet %d/%u", (int)written, len))
+
 	if (written < 0) {
 		if (errno == EINTR || errno == EAGAIN) {
 			TRACE2(("leave write_packet: EINTR"))
@@ -86,54 +247,134 @@ void write_packet() {
 		}
 	}
 
-	packet_queue_consume(&ses.writequeue, written);
-	ses.writequeue_len -= written;
-
 	if (written == 0) {
 		ses.remoteclosed();
 	}
 
-#else /* No writev () */
-	/* Get the next buffer in the queue of encrypted packets to write*/
-	writebuf = (buffer*)examine(&ses.writequeue);
+	writequeue_consume(written);
+#if SEND_QUEUE_DELAY_MS
+	/* until update_send_queue() asks the kernel */
+	ses.sock_unsent += written;
+#endif
+	TRACE2(("leave write_packet"))
+}
 
-	/* The last byte of the buffer is not to be transmitted, but is 
-	 * a cleartext packet_type indicator */
-	packet_type = writebuf->data[writebuf->len-1];
-	len = writebuf->len - 1 - writebuf->pos;
-	TRACE2(("write_packet type %d len %d/%d", packet_type,
-			len, writebuf->len-1))
-	dropbear_assert(len > 0);
-	/* Try to write as much as possible */
-	written = write(ses.sock_out, buf_getptr(writebuf, len), len);
+/* Fill the read-ahead buffer with whatever the socket has. Data that is
+ * already buffered is used up first, so a single read() can provide
+ * many packets */
+static void readahead_fill() {
 
-	if (written < 0) {
+	int len;
+
+	if (ses.readahead == NULL) {
+		ses.readahead = buf_new(RECV_READAHEAD_LEN);
+	}
+	if (ses.readahead->pos < ses.readahead->len) {
+		return;
+	}
+
+	len = read(ses.sock_in, ses.readahead->data, ses.readahead->size);
+	if (len == 0) {
+		ses.remoteclosed();
+	}
+	if (len < 0) {
 		if (errno == EINTR || errno == EAGAIN) {
-			TRACE2(("leave writepacket: EINTR"))
-			return;
+			TRACE2(("leave readahead_fill: EINTR or EAGAIN"))
+			len = 0;
 		} else {
-			dropbear_exit("Error writing: %s", strerror(errno));
+			dropbear_exit("Error reading: %s", strerror(errno));
 		}
-	} 
+	}
 
-	if (written == 0) {
-		ses.remoteclosed();
+	buf_setlen(ses.readahead, len);
+	buf_setpos(ses.readahead, 0);
+}
+
+/* Copy up to len bytes of read-ahead data to dest, returns the number
+ * copied */
+static unsigned int readahead_take(unsigned char *dest, unsigned int len) {
+
+	len = MIN(len, ses.readahead->len - ses.readahead->pos);
+	if (len > 0) {
+		memcpy(dest, buf_getptr(ses.readahead, len), len);
+		buf_incrpos(ses.readahead, len);
 	}
+	return len;
+}
 
-	ses.writequeue_len -= written;
+/* Bytes waiting to go out on the session socket. Where the socket reports
+ * it this includes data the kernel hasn't sent yet, not only the writequeue */
+unsigned int send_queue_len() {
+#if SEND_QUEUE_DELAY_MS
+	if (ses.send_paced) {
+		return ses.writequeue_len + ses.sock_unsent;
+	}
+#endif
+	return ses.writequeue_len;
+}
 
-	if (written == len) {
-		/* We've finished with the packet, free it */
-		dequeue(&ses.writequeue);
-		buf_free(writebuf);
-		writebuf = NULL;
-	} else {
-		/* More packet left to write, leave it in the queue for later */
-		buf_incrpos(writebuf, written);
+/* The send_queue_len() past which more packets shouldn't be queued */
+unsigned int send_queue_limit() {
+#if SEND_QUEUE_DELAY_MS
+	if (ses.send_paced) {
+		return ses.send_queue_limit;
 	}
-#endif /* writev */
+#endif
+	return 2*TRANS_MAX_PAYLOAD_LEN;
+}
 
-	TRACE2(("leave write_packet"))
+/* Returns 1 if the writequeue is short enough that more packets should be
+ * queued. Past this reading from the socket and from channels waits */
+int writequeue_has_space() {
+	return send_queue_len() <= send_queue_limit();
+}
+
+/* Refresh the count of unsent bytes in the kernel after writing, and
+ * periodically set the send queue limit from the socket's current rate.
+ * Enough is queued to last SEND_QUEUE_DELAY_MS, anything more would
+ * only delay interactive packets queued behind it */
+void update_send_queue() {
+#if SEND_QUEUE_DELAY_MS
+	uint64_t now, limit;
+	unsigned int rate;
+
+	if (!ses.send_paced || ses.sock_out < 0) {
+		return;
+	}
+
+	if (ses.sock_unsent > 0) {
+		ses.sock_unsent = get_sock_unsent(ses.sock_out);
+	}
+
+	now = monotonic_now_us();
+	if (ses.send_tune_time != 0 && now - ses.send_tune_time < SEND_QUEUE_TUNE_US) {
+		return;
+	}
+
+	rate = tune_sock_buffers(ses.sock_out);
+	limit = (uint64_t)rate * SEND_QUEUE_DELAY_MS / 1000;
+	limit = MAX(limit, SEND_QUEUE_MIN_LEN);
+	limit = MIN(limit, SEND_QUEUE_MAX_LEN);
+
+	if (ses.send_tune_time == 0 || limit != ses.send_queue_limit) {
+		/* wake for writing once the kernel is down to half */
+		if (set_sock_notsent_lowat(ses.sock_out, limit/2) == DROPBEAR_FAILURE) {
+			/* a -J proxy command's pipe, or an old kernel */
+			TRACE(("update_send_queue: not pacing"))
+			ses.send_paced = 0;
+			ses.sock_unsent = 0;
+			return;
+		}
+		TRACE2(("update_send_queue: rate %u limit %u", rate, (unsigned int)limit))
+		ses.send_queue_limit = limit;
+	}
+	ses.send_tune_time = now;
+#endif
+}
+
+/* Returns 1 if data has been read ahead that isn't yet part of a packet */
+int packet_readahead_pending() {
+	return ses.readahead != NULL && ses.readahead->pos < ses.readahead->len;
 }
 
 /* Non-blocking function reading available portion of a packet into the
@@ -141,12 +382,14 @@ void write_packet() {
  * full portion if possible */
 void read_packet() {
 
-	int len;
+	unsigned int len;
 	unsigned int maxlen;
 	unsigned char blocksize;
 
 	TRACE2(("enter read_packet"))
 	blocksize = ses.keys->recv.algo_crypt->blocksize;
+
+	readahead_fill();
 	
 	if (ses.readbuf == NULL || ses.readbuf->len < blocksize) {
 		int ret;
@@ -163,34 +406,13 @@ void read_packet() {
 		}
 	}
 
-	/* Attempt to read the remainder of the packet, note that there
-	 * mightn't be any available (EAGAIN) */
+	/* Take the remainder of the packet, note that there
+	 * mightn't be enough read yet */
 	maxlen = ses.readbuf->len - ses.readbuf->pos;
-	if (maxlen == 0) {
-		/* Occurs when the packet is only a single block long and has all
-		 * been read in read_packet_init().  Usually means that MAC is disabled
-		 */
-		len = 0;
-	} else {
-		len = read(ses.sock_in, buf_getptr(ses.readbuf, maxlen), maxlen);
-
-		if (len == 0) {
-			ses.remoteclosed();
-		}
-
-		if (len < 0) {
-			if (errno == EINTR || errno == EAGAIN) {
-				TRACE2(("leave read_packet: EINTR or EAGAIN"))
-				return;
-			} else {
-				dropbear_exit("Error reading: %s", strerror(errno));
-			}
-		}
-
-		buf_incrpos(ses.readbuf, len);
-	}
+	len = readahead_take(buf_getptr(ses.readbuf, maxlen), maxlen);
+	buf_incrpos(ses.readbuf, len);
 
-	if ((unsigned int)len == maxlen) {
+	if (len == maxlen) {
 		/* The whole packet has been read */
 		decrypt_packet();
 		/* The main select() loop process_packet() to
@@ -206,8 +428,9 @@ void read_packet() {
 static int read_packet_init() {
 
 	unsigned int maxlen;
-	int slen;
-	unsigned int len;
+	unsigned int slen;
+	unsigned int len, plen;
+	unsigned int minlen = MIN_PACKET_LEN;
 	unsigned int blocksize;
 	unsigned int macsize;
 
@@ -217,28 +440,16 @@ static int read_packet_init() {
 
 	if (ses.readbuf == NULL) {
 		/* start of a new packet */
-		ses.readbuf = buf_new(INIT_READBUF);
+		ses.readbuf = buf_pool_new(INIT_READBUF);
 	}
 
 	maxlen = blocksize - ses.readbuf->pos;
 			
-	/* read the rest of the packet if possible */
-	slen = read(ses.sock_in, buf_getwriteptr(ses.readbuf, maxlen),
-			maxlen);
-	if (slen == 0) {
-		ses.remoteclosed();
-	}
-	if (slen < 0) {
-		if (errno == EINTR || errno == EAGAIN) {
-			TRACE2(("leave read_packet_init: EINTR"))
-			return DROPBEAR_FAILURE;
-		}
-		dropbear_exit("Error reading: %s", strerror(errno));
-	}
-
+	/* take the rest of the first block if possible */
+	slen = readahead_take(buf_getwriteptr(ses.readbuf, maxlen), maxlen);
 	buf_incrwritepos(ses.readbuf, slen);
 
-	if ((unsigned int)slen != maxlen) {
+	if (slen != maxlen) {
 		/* don't have enough bytes to determine length, get next time */
 		return DROPBEAR_FAILURE;
 	}
@@ -246,32 +457,65 @@ static int read_packet_init() {
 	/* now we have the first block, need to get packet length, so we decrypt
 	 * the first block (only need first 4 bytes) */
 	buf_setpos(ses.readbuf, 0);
-	if (ses.keys->recv.crypt_mode->decrypt(buf_getptr(ses.readbuf, blocksize), 
-				buf_getwriteptr(ses.readbuf, blocksize),
-				blocksize,
-				&ses.keys->recv.cipher_state) != CRYPT_OK) {
-		dropbear_exit("Error decrypting");
+#if DROPBEAR_AEAD_MODE
+	if (ses.keys->recv.crypt_mode->aead_crypt) {
+		/* only the length is decrypted, the block stays as ciphertext
+		 * until the tag has been checked */
+		if (ses.keys->recv.crypt_mode->aead_getlength(ses.recvseq,
+					buf_getptr(ses.readbuf, blocksize), &plen,
+					blocksize,
+					&ses.keys->recv.cipher_state) != CRYPT_OK) {
+			dropbear_exit("Error decrypting");
+		}
+		/* the length field isn't included in the block alignment, so
+		 * the smallest packet is a single block after it */
+		len = plen + 4 + macsize;
+		minlen = 4 + blocksize;
+	} else
+#endif
+	if (ses.keys->recv.algo_mac->etm) {
+		/* the length is sent in the clear, nothing is decrypted until
+		 * the MAC has been checked */
+		plen = buf_getint(ses.readbuf);
+		len = plen + 4 + macsize;
+		minlen = 4 + blocksize;
+	} else {
+		if (ses.keys->recv.crypt_mode->decrypt(buf_getptr(ses.readbuf, blocksize), 
+					buf_getwriteptr(ses.readbuf, blocksize),
+					blocksize,
+					&ses.keys->recv.cipher_state) != CRYPT_OK) {
+			dropbear_exit("Error decrypting");
+		}
+		plen = buf_getint(ses.readbuf) + 4;
+		len = plen + macsize;
 	}
-	len = buf_getint(ses.readbuf) + 4 + macsize;
 
 	TRACE2(("packet size is %u, block %u mac %u", len, blocksize, macsize))
 
 
 	/* check packet length */
-	if ((len > RECV_MAX_PACKET_LEN) ||
-		(len < MIN_PACKET_LEN + macsize) ||
-		((len - macsize) % blocksize != 0)) {
+	if ((len > recv_max_packet_len()) ||
+		(len < minlen + macsize) ||
+		(plen % blocksize != 0)) {
 		dropbear_exit("Integrity error (bad packet size %u)", len);
 	}
 
 	if (len > ses.readbuf->size) {
-		ses.readbuf = buf_resize(ses.readbuf, len);		
+		ses.readbuf = buf_pool_resize(ses.readbuf, len);
 	}
 	buf_setlen(ses.readbuf, len);
 	buf_setpos(ses.readbuf, blocksize);
 	return DROPBEAR_SUCCESS;
 }
 
+/* Largest packet accepted from the wire, a full payload from -M
+ * possibly expanded by compression, plus padding and MAC */
+static unsigned int recv_max_packet_len() {
+	unsigned int len = opts.recv_max_payload
+		+ ZLIB_COMPRESS_EXPANSION(opts.recv_max_payload) + 100;
+	return MAX(35000, len);
+}
+
 /* handle the received packet */
 void decrypt_packet() {
 
@@ -286,23 +530,78 @@ void decrypt_packet() {
 
 	ses.kexstate.datarecv += ses.readbuf->len;
 
-	/* we've already decrypted the first blocksize in read_packet_init */
-	buf_setpos(ses.readbuf, blocksize);
+#if DROPBEAR_AEAD_MODE
+	if (ses.keys->recv.crypt_mode->aead_crypt) {
+		/* a bad tag is fatal, so nothing decrypted from a bad packet
+		 * is used. Only chacha20-poly1305 checks the tag before
+		 * decrypting, AES-GCM checks it afterwards */
+		buf_setpos(ses.readbuf, 0);
+		len = ses.readbuf->len - macsize;
+		if (ses.keys->recv.crypt_mode->aead_crypt(ses.recvseq,
+					buf_getptr(ses.readbuf, len + macsize),
+					buf_getwriteptr(ses.readbuf, len),
+					len, macsize,
+					&ses.keys->recv.cipher_state, DROPBEAR_DECRYPT) != CRYPT_OK) {
+			dropbear_exit("Integrity error");
+		}
+		buf_incrpos(ses.readbuf, len);
+	} else
+#endif
+	if (ses.keys->recv.algo_mac->etm) {
+		/* the MAC covers the ciphertext, so a bad packet is rejected
+		 * without decrypting it */
+		if (checkmac() != DROPBEAR_SUCCESS) {
+			dropbear_exit("Integrity error");
+		}
 
-	/* decrypt it in-place */
-	len = ses.readbuf->len - macsize - ses.readbuf->pos;
-	if (ses.keys->recv.crypt_mode->decrypt(
-				buf_getptr(ses.readbuf, len), 
-				buf_getwriteptr(ses.readbuf, len),
-				len,
-				&ses.keys->recv.cipher_state) != CRYPT_OK) {
-		dropbear_exit("Error decrypting");
-	}
-	buf_incrpos(ses.readbuf, len);
+		/* decrypt everything after the length in-place */
+		buf_setpos(ses.readbuf, 4);
+		len = ses.readbuf->len - macsize - ses.readbuf->pos;
+		if (ses.keys->recv.crypt_mode->decrypt(
+					buf_getptr(ses.readbuf, len), 
+					buf_getwriteptr(ses.readbuf, len),
+					len,
+					&ses.keys->recv.cipher_state) != CRYPT_OK) {
+			dropbear_exit("Error decrypting");
+		}
+		buf_incrpos(ses.readbuf, len);
+	} else
+#if DROPBEAR_ENABLE_CTR_MODE
+	if (use_stitch(&ses.keys->recv, ses.readbuf->len - macsize)) {
+		unsigned char mac_bytes[MAX_MAC_LEN];
+
+		/* decrypt and MAC in one pass, the first block was already
+		 * decrypted in read_packet_init */
+		buf_setpos(ses.readbuf, 0);
+		len = ses.readbuf->len - macsize;
+		stitch_crypt_mac(ses.recvseq, &ses.keys->recv,
+				buf_getwriteptr(ses.readbuf, len), len, blocksize,
+				DROPBEAR_DECRYPT, mac_bytes);
+		buf_incrpos(ses.readbuf, len);
+		if (constant_time_memcmp(mac_bytes, buf_getptr(ses.readbuf, macsize), macsize) != 0) {
+			dropbear_exit("Integrity error");
+		}
+	} else
+#endif
+	{
+		/* we've already decrypted the first blocksize in read_packet_init */
+		buf_setpos(ses.readbuf, blocksize);
+
+		/* decrypt it in-place */
+		len = ses.readbuf->len - macsize - ses.readbuf->pos;
+		if (ses.keys->recv.crypt_mode->decrypt(
+					buf_getptr(ses.readbuf, len), 
+					buf_getwriteptr(ses.readbuf, len),
+					len,
+					&ses.keys->recv.cipher_state) != CRYPT_OK) {
+			dropbear_exit("Error decrypting");
+		}
+		buf_incrpos(ses.readbuf, len);
 
-	/* check the hmac */
-	if (checkmac() != DROPBEAR_SUCCESS) {
-		dropbear_exit("Integrity error");
+		/* check the hmac */
+		if (checkmac() != DROPBEAR_SUCCESS) {
+			dropbear_exit("Integrity error");
+		}
 	}
 
 	/* get padding length */
@@ -312,7 +611,8 @@ void decrypt_packet() {
 	/* payload length */
 	/* - 4 - 1 is for LEN and PADLEN values */
 	len = ses.readbuf->len - padlen - 4 - 1 - macsize;
-	if ((len > RECV_MAX_PAYLOAD_LEN+ZLIB_COMPRESS_EXPANSION) || (len < 1)) {
+	if ((len > opts.recv_max_payload + ZLIB_COMPRESS_EXPANSION(opts.recv_max_payload))
+			|| (len < 1)) {
 		dropbear_exit("Bad packet size %u", len);
 	}
 
@@ -324,7 +624,7 @@ void decrypt_packet() {
 		ses.payload = buf_decompress(ses.readbuf, len);
 		buf_setpos(ses.payload, 0);
 		ses.payload_beginning = 0;
-		buf_free(ses.readbuf);
+		buf_pool_free(ses.readbuf);
 	} else 
 #endif
 	{
@@ -339,6 +639,7 @@ void decrypt_packet() {
 	ses.readbuf = NULL;
 
 	ses.recvseq++;
+	trace_packet_allocs("recv");
 
 	TRACE2(("leave decrypt_packet"))
 }
@@ -372,9 +673,10 @@ static buffer* buf_decompress(buffer* buf, unsigned int len) {
 	int result;
 	buffer * ret;
 	z_streamp zstream;
+	unsigned int limit;
 
 	zstream = ses.keys->recv.zstream;
-	ret = buf_new(len);
+	ret = buf_pool_new(len);
 
 	zstream->avail_in = len;
 	zstream->next_in = buf_getptr(buf, len);
@@ -382,12 +684,16 @@ static buffer* buf_decompress(buffer* buf, unsigned int len) {
 	/* decompress the payload, incrementally resizing the output buffer */
 	while (1) {
 
-		zstream->avail_out = ret->size - ret->pos;
+		/* pooled buffers may be larger than the payload limit. One byte
+		 * spare so that a payload of exactly the limit doesn't look like
+		 * it was cut off */
+		limit = MIN(ret->size, opts.recv_max_payload + 1);
+		zstream->avail_out = limit - ret->pos;
 		zstream->next_out = buf_getwriteptr(ret, zstream->avail_out);
 
 		result = inflate(zstream, Z_SYNC_FLUSH);
 
-		buf_setlen(ret, ret->size - zstream->avail_out);
+		buf_setlen(ret, limit - zstream->avail_out);
 		buf_setpos(ret, ret->len);
 
 		if (result != Z_BUF_ERROR && result != Z_OK) {
@@ -398,18 +704,21 @@ static buffer* buf_decompress(buffer* buf, unsigned int len) {
 		   		(zstream->avail_out != 0 || result == Z_BUF_ERROR)) {
 			/* we can only exit if avail_out hasn't all been used,
 			 * and there's no remaining input */
+			if (ret->len > opts.recv_max_payload) {
+				dropbear_exit("bad packet, oversized decompressed");
+			}
 			return ret;
 		}
 
 		if (zstream->avail_out == 0) {
 			int new_size = 0;
-			if (ret->size >= RECV_MAX_PAYLOAD_LEN) {
+			if (limit > opts.recv_max_payload) {
 				/* Already been increased as large as it can go,
 				 * yet didn't finish up the decompression */
 				dropbear_exit("bad packet, oversized decompressed");
 			}
-			new_size = MIN(RECV_MAX_PAYLOAD_LEN, ret->size + ZLIB_DECOMPRESS_INCR);
-			ret = buf_resize(ret, new_size);
+			new_size = MIN(opts.recv_max_payload + 1, ret->size + ZLIB_DECOMPRESS_INCR);
+			ret = buf_pool_resize(ret, new_size);
 		}
 	}
 }
@@ -470,17 +779,91 @@ void maybe_flush_reply_queue() {
 	ses.reply_queue_head = ses.reply_queue_tail = NULL;
 }
 	
+/* MAC and encrypt a framed packet in place with the transmit keys, the
+ * MAC (or AEAD tag) is appended. writebuf->len is the packet length and
+ * writebuf must have room for the MAC after it */
+static void seal_packet(buffer *writebuf, unsigned int seqno) {
+	unsigned char mac_size = ses.keys->trans.algo_mac->hashsize;
+	unsigned char mac_bytes[MAX_MAC_LEN];
+	unsigned int len;
+
+#if DROPBEAR_AEAD_MODE
+	if (ses.keys->trans.crypt_mode->aead_crypt) {
+		/* encrypt in-place, the tag is written after the packet */
+		buf_setpos(writebuf, 0);
+		len = writebuf->len;
+		buf_incrlen(writebuf, mac_size);
+		if (ses.keys->trans.crypt_mode->aead_crypt(seqno,
+					buf_getptr(writebuf, len),
+					buf_getwriteptr(writebuf, len + mac_size),
+					len, mac_size,
+					&ses.keys->trans.cipher_state, DROPBEAR_ENCRYPT) != CRYPT_OK) {
+			dropbear_exit("Error encrypting");
+		}
+		buf_incrpos(writebuf, len + mac_size);
+	} else
+#endif
+	if (ses.keys->trans.algo_mac->etm) {
+		/* encrypt everything after the length in-place */
+		buf_setpos(writebuf, 4);
+		len = writebuf->len - 4;
+		if (ses.keys->trans.crypt_mode->encrypt(
+					buf_getptr(writebuf, len),
+					buf_getwriteptr(writebuf, len),
+					len,
+					&ses.keys->trans.cipher_state) != CRYPT_OK) {
+			dropbear_exit("Error encrypting");
+		}
+
+		/* then MAC the length and ciphertext */
+		make_mac(seqno, &ses.keys->trans, writebuf, writebuf->len, mac_bytes);
+		buf_setpos(writebuf, writebuf->len);
+		buf_putbytes(writebuf, mac_bytes, mac_size);
+	} else
+#if DROPBEAR_ENABLE_CTR_MODE
+	if (use_stitch(&ses.keys->trans, writebuf->len)) {
+		/* MAC and encrypt in one pass */
+		buf_setpos(writebuf, 0);
+		len = writebuf->len;
+		stitch_crypt_mac(seqno, &ses.keys->trans,
+				buf_getwriteptr(writebuf, len), len, 0,
+				DROPBEAR_ENCRYPT, mac_bytes);
+		buf_incrpos(writebuf, len);
+		buf_putbytes(writebuf, mac_bytes, mac_size);
+	} else
+#endif
+	{
+		make_mac(seqno, &ses.keys->trans, writebuf, writebuf->len, mac_bytes);
+
+		/* do the actual encryption, in-place */
+		buf_setpos(writebuf, 0);
+		/* encrypt it in-place*/
+		len = writebuf->len;
+		if (ses.keys->trans.crypt_mode->encrypt(
+					buf_getptr(writebuf, len),
+					buf_getwriteptr(writebuf, len),
+					len,
+					&ses.keys->trans.cipher_state) != CRYPT_OK) {
+			dropbear_exit("Error encrypting");
+		}
+		buf_incrpos(writebuf, len);
+
+		/* stick the MAC on it */
+		buf_putbytes(writebuf, mac_bytes, mac_size);
+	}
+}
+
 /* encrypt the writepayload, putting into writebuf, ready for write_packet()
  * to put on the wire */
 void encrypt_packet() {
 
 	unsigned char padlen;
 	unsigned char blocksize, mac_size;
+	buffer packet;
 	buffer * writebuf; /* the packet which will go on the wire. This is 
-	                      encrypted in-place. */
+	                      encrypted in-place at the end of ses.writequeue */
 	unsigned char packet_type;
 	unsigned int len, encrypt_buf_size;
-	unsigned char mac_bytes[MAX_MAC_LEN];
 
 	time_t now;
 	
@@ -512,13 +895,13 @@ void encrypt_packet() {
 				+ mac_size
 #ifndef DISABLE_ZLIB
 	/* some extra in case 'compression' makes it larger */
-				+ ZLIB_COMPRESS_EXPANSION
+				+ ZLIB_COMPRESS_EXPANSION(ses.writepayload->len)
 #endif
-	/* and an extra cleartext (stripped before transmission) byte for the
-	 * packet type */
-				+ 1;
+				;
 
-	writebuf = buf_new(encrypt_buf_size);
+	writequeue_reserve(encrypt_buf_size);
+	buf_tailview(&packet, ses.writequeue);
+	writebuf = &packet;
 	buf_setlen(writebuf, PACKET_PAYLOAD_OFF);
 	buf_setpos(writebuf, PACKET_PAYLOAD_OFF);
 
@@ -540,8 +923,17 @@ void encrypt_packet() {
 	buf_setlen(ses.writepayload, 0);
 
 	/* length of padding - packet length must be a multiple of blocksize,
-	 * with a minimum of 4 bytes of padding */
-	padlen = blocksize - (writebuf->len) % blocksize;
+	 * with a minimum of 4 bytes of padding. AEAD and encrypt-then-mac
+	 * modes don't count the packet length field. */
+	len = writebuf->len;
+	if (ses.keys->trans.algo_mac->etm
+#if DROPBEAR_AEAD_MODE
+		|| ses.keys->trans.crypt_mode->aead_crypt
+#endif
+		) {
+		len -= 4;
+	}
+	padlen = blocksize - len % blocksize;
 	if (padlen < 4) {
 		padlen += blocksize;
 	}
@@ -561,31 +953,37 @@ void encrypt_packet() {
 	buf_incrlen(writebuf, padlen);
 	genrandom(buf_getptr(writebuf, padlen), padlen);
 
-	make_mac(ses.transseq, &ses.keys->trans, writebuf, writebuf->len, mac_bytes);
-
-	/* do the actual encryption, in-place */
-	buf_setpos(writebuf, 0);
-	/* encrypt it in-place*/
-	len = writebuf->len;
-	if (ses.keys->trans.crypt_mode->encrypt(
-				buf_getptr(writebuf, len),
-				buf_getwriteptr(writebuf, len),
-				len,
-				&ses.keys->trans.cipher_state) != CRYPT_OK) {
-		dropbear_exit("Error encrypting");
+#if DROPBEAR_MAC_BATCH
+	if (ses.keys->trans.mac_batch) {
+		/* the MAC and encryption are left for mac_batch_flush(), which
+		 * does several packets at once. Leave room for the MAC */
+		struct mac_batch_packet *batch = &ses.mac_batch[ses.mac_batch_count++];
+		batch->offset = ses.writequeue->len - ses.writequeue->pos;
+		batch->len = writebuf->len;
+		batch->seqno = ses.transseq;
+		buf_incrlen(writebuf, mac_size);
+	} else
+#endif
+	{
+		seal_packet(writebuf, ses.transseq);
 	}
-	buf_incrpos(writebuf, len);
-
-	/* stick the MAC on it */
-	buf_putbytes(writebuf, mac_bytes, mac_size);
 
 	/* Update counts */
 	ses.kexstate.datatrans += writebuf->len;
 
-	writebuf_enqueue(writebuf, packet_type);
+	/* the packet is already in place, add it to the queued length */
+	buf_incrlen(ses.writequeue, writebuf->len);
+	ses.writequeue_len += writebuf->len;
 
 	/* Update counts */
 	ses.transseq++;
+	trace_packet_allocs("trans");
+
+#if DROPBEAR_MAC_BATCH
+	if (ses.mac_batch_count == MAC_BATCH_MAX) {
+		mac_batch_flush();
+	}
+#endif
 
 	now = monotonic_now();
 	ses.last_packet_time_any_sent = now;
@@ -602,61 +1000,517 @@ void encrypt_packet() {
 	TRACE2(("leave encrypt_packet()"))
 }
 
-void writebuf_enqueue(buffer * writebuf, unsigned char packet_type) {
-	/* The last byte of the buffer stores the cleartext packet_type. It is not
-	 * transmitted but is used for transmit timeout purposes */
-	buf_putbyte(writebuf, packet_type);
-	/* enqueue the packet for sending. It will get freed after transmission. */
-	buf_setpos(writebuf, 0);
-	enqueue(&ses.writequeue, (void*)writebuf);
-	ses.writequeue_len += writebuf->len-1;
+#if DEBUG_TRACE
+/* Allocations since the previous packet in either direction, which
+ * should be zero for bulk data once the session is set up */
+static void trace_packet_allocs(const char *direction) {
+	static unsigned long last_count = 0;
+
+	TRACE2(("%s packet: %lu allocations", direction, m_alloc_count - last_count))
+	last_count = m_alloc_count;
+}
+#endif
+
+/* Make room for len more bytes after the end of ses.writequeue. The
+ * unsent data is moved back to the start once the tail runs out, so
+ * the queue stays contiguous and is written with one syscall */
+void writequeue_reserve(unsigned int len) {
+	buffer *wq = ses.writequeue;
+	unsigned int pending = wq->len - wq->pos;
+	unsigned char *unsent;
+
+	ses.writequeue_peak = MAX(ses.writequeue_peak, pending + len);
+	if (wq->size - wq->len >= len) {
+		return;
+	}
+
+#if DROPBEAR_TX_ZEROCOPY
+	if (zerocopy_current()) {
+		writequeue_retire(len);
+		return;
+	}
+#endif
+
+	if (wq->pos > 0) {
+		unsent = buf_getptr(wq, pending);
+		buf_setpos(wq, 0);
+		memmove(buf_getwriteptr(wq, pending), unsent, pending);
+		buf_setlen(wq, pending);
+	}
+
+	if (wq->size - wq->len < len) {
+		ses.writequeue = buf_resize(wq, MAX(wq->size * 2, pending + len));
+	}
 }
 
+/* Give back the memory of a writequeue that grew for a burst, once it has
+ * drained. A session that keeps queueing more than INIT_WRITEQUEUE keeps
+ * the larger buffer rather than growing it again for every burst */
+static void writequeue_shrink() {
+	unsigned int peak = ses.writequeue_peak;
+
+	ses.writequeue_peak = 0;
+	if (ses.writequeue->size <= WRITEQUEUE_SHRINK_LEN || peak > INIT_WRITEQUEUE) {
+		return;
+	}
+
+	TRACE(("writequeue_shrink: %u bytes", ses.writequeue->size))
+	ses.writequeue = buf_resize(ses.writequeue, INIT_WRITEQUEUE);
+#if DROPBEAR_TX_ZEROCOPY
+	if (ses.zerocopy_spare && ses.zerocopy_spare->size > INIT_WRITEQUEUE) {
+		buf_free(ses.zerocopy_spare);
+		ses.zerocopy_spare = NULL;
+	}
+#endif
+}
+
+/* Remove written bytes from the front of ses.writequeue */
+void writequeue_consume(unsigned int len) {
+	buf_incrpos(ses.writequeue, len);
+	ses.writequeue_len -= len;
+	if (ses.writequeue_len == 0) {
+#if DROPBEAR_TX_ZEROCOPY
+		if (zerocopy_current()) {
+			/* the kernel may still be reading the old one */
+			writequeue_retire(0);
+		}
+#endif
+		/* start again at the beginning once everything is sent */
+		buf_setpos(ses.writequeue, 0);
+		buf_setlen(ses.writequeue, 0);
+		writequeue_shrink();
+	}
+}
+
+/* Queue unencrypted bytes for sending, used for the identification string */
+void writequeue_putbytes(const unsigned char *bytes, unsigned int len) {
+	buffer tail;
+
+	writequeue_reserve(len);
+	buf_tailview(&tail, ses.writequeue);
+	buf_putbytes(&tail, bytes, len);
+	buf_incrlen(ses.writequeue, len);
+	ses.writequeue_len += len;
+}
+
+
+/* Hash the HMAC ipad and opad blocks for a newly installed key, so
+ * that each packet only needs to copy the saved states */
+void mac_key_init(struct key_context_directional *key_state) {
+	unsigned char pad[MAXBLOCKSIZE];
+	const struct ltc_hash_descriptor *hash_desc = key_state->algo_mac->hash_desc;
+	unsigned long i, blocksize;
+
+#if DROPBEAR_ENABLE_CTR_MODE
+	key_state->stitch = NULL;
+#endif
+#if DROPBEAR_MAC_BATCH
+	key_state->mac_batch = 0;
+#endif
+
+#if DROPBEAR_UMAC
+	if (key_state->algo_mac->umac) {
+		if (umac_init(&key_state->umac, find_cipher("aes"),
+				key_state->mackey, key_state->algo_mac->keysize,
+				key_state->algo_mac->hashsize) != CRYPT_OK) {
+			dropbear_exit("UMAC error");
+		}
+		return;
+	}
+#endif
+
+	if (hash_desc == NULL) {
+		return;
+	}
+
+	/* mac keys are never longer than the hash block */
+	blocksize = hash_desc->blocksize;
+	dropbear_assert(key_state->algo_mac->keysize <= blocksize);
+
+	memset(pad, 0x0, sizeof(pad));
+	memcpy(pad, key_state->mackey, key_state->algo_mac->keysize);
+	for (i = 0; i < blocksize; i++) {
+		pad[i] ^= 0x36;
+	}
+	if (hash_desc->init(&key_state->mac_inner) != CRYPT_OK
+		|| hash_desc->process(&key_state->mac_inner, pad, blocksize) != CRYPT_OK) {
+		dropbear_exit("HMAC error");
+	}
+
+	/* 0x36 ^ 0x5c gives the opad from the ipad */
+	for (i = 0; i < blocksize; i++) {
+		pad[i] ^= 0x36 ^ 0x5c;
+	}
+	if (hash_desc->init(&key_state->mac_outer) != CRYPT_OK
+		|| hash_desc->process(&key_state->mac_outer, pad, blocksize) != CRYPT_OK) {
+		dropbear_exit("HMAC error");
+	}
+
+	m_burn(pad, sizeof(pad));
+#if DROPBEAR_ENABLE_CTR_MODE
+	mac_stitch_init(key_state);
+#endif
+#if DROPBEAR_MAC_BATCH
+	key_state->mac_batch = sha_mb_available(hash_desc);
+#endif
+}
+
+/* Finish an HMAC started from the mac_inner state, output_mac gets the
+ * truncated hashsize bytes. md is burnt */
+static void hmac_finish(struct key_context_directional *key_state,
+		hash_state *md, unsigned char *output_mac) {
+	unsigned char digest[MAX_HASH_SIZE];
+	const struct ltc_hash_descriptor *hash_desc = key_state->algo_mac->hash_desc;
+
+	if (hash_desc->done(md, digest) != CRYPT_OK) {
+		dropbear_exit("HMAC error");
+	}
+
+	*md = key_state->mac_outer;
+	if (hash_desc->process(md, digest, hash_desc->hashsize) != CRYPT_OK
+		|| hash_desc->done(md, digest) != CRYPT_OK) {
+		dropbear_exit("HMAC error");
+	}
+
+	memcpy(output_mac, digest, key_state->algo_mac->hashsize);
+	m_burn(md, sizeof(*md));
+	m_burn(digest, sizeof(digest));
+}
+
+/* HMAC of the sequence number followed by a list of buffers, using the
+ * states from mac_key_init(). The output is truncated to the mac's
+ * hashsize. UMAC takes the sequence number as its nonce instead. */
+void mac_iovec(unsigned int seqno, struct key_context_directional *key_state,
+		const struct iovec *iov, unsigned int iovcnt,
+		unsigned char *output_mac) {
+	unsigned char seqbuf[4] = {0};
+	const struct ltc_hash_descriptor *hash_desc = key_state->algo_mac->hash_desc;
+	hash_state md;
+	unsigned int i;
+
+#if DROPBEAR_UMAC
+	if (key_state->algo_mac->umac) {
+		unsigned char nonce[8];
+		unsigned long maclen = key_state->algo_mac->hashsize;
+
+		STORE64H((ulong64)seqno, nonce);
+		for (i = 0; i < iovcnt; i++) {
+			if (umac_process(&key_state->umac, iov[i].iov_base, iov[i].iov_len) != CRYPT_OK) {
+				dropbear_exit("UMAC error");
+			}
+		}
+		if (umac_done(&key_state->umac, nonce, sizeof(nonce), output_mac, &maclen) != CRYPT_OK) {
+			dropbear_exit("UMAC error");
+		}
+		return;
+	}
+#endif
+
+	STORE32H(seqno, seqbuf);
+
+	md = key_state->mac_inner;
+	if (hash_desc->process(&md, seqbuf, sizeof(seqbuf)) != CRYPT_OK) {
+		dropbear_exit("HMAC error");
+	}
+	for (i = 0; i < iovcnt; i++) {
+		if (hash_desc->process(&md, iov[i].iov_base, iov[i].iov_len) != CRYPT_OK) {
+			dropbear_exit("HMAC error");
+		}
+	}
+	hmac_finish(key_state, &md, output_mac);
+}
 
 /* Create the packet mac, and append H(seqno|clearbuf) to the output */
 /* output_mac must have ses.keys->trans.algo_mac->hashsize bytes. */
-static void make_mac(unsigned int seqno, const struct key_context_directional * key_state,
+static void make_mac(unsigned int seqno, struct key_context_directional * key_state,
 		buffer * clear_buf, unsigned int clear_len, 
 		unsigned char *output_mac) {
-	unsigned char seqbuf[4];
-	unsigned long bufsize;
-	hmac_state hmac;
+	struct iovec iov;
 
 	if (key_state->algo_mac->hashsize > 0) {
 		/* calculate the mac */
-		if (hmac_init(&hmac, 
-					key_state->hash_index,
-					key_state->mackey,
-					key_state->algo_mac->keysize) != CRYPT_OK) {
-			dropbear_exit("HMAC error");
+		buf_setpos(clear_buf, 0);
+		iov.iov_base = buf_getptr(clear_buf, clear_len);
+		iov.iov_len = clear_len;
+		mac_iovec(seqno, key_state, &iov, 1, output_mac);
+	}
+	TRACE2(("leave writemac"))
+}
+
+#if DROPBEAR_ENABLE_CTR_MODE
+/* Picks a kernel that runs AES counter mode and the HMAC hash over the
+ * data in one pass. Only for encrypt-and-MAC, since an encrypt-then-MAC
+ * hash covers the ciphertext, and only with the AES-NI key schedule */
+static void mac_stitch_init(struct key_context_directional *key_state) {
+#if defined(LTC_AESNI) && defined(RIJNDAEL)
+	const struct ltc_hash_descriptor *hash_desc = key_state->algo_mac->hash_desc;
+
+	if (key_state->crypt_mode != &dropbear_mode_ctr
+		|| key_state->algo_mac->etm
+		|| cipher_descriptor[key_state->cipher_state.ctr.cipher].accel_ctr_encrypt
+			!= aesni_accel_ctr_encrypt) {
+		return;
+	}
+#if DROPBEAR_SHA2_256_HMAC
+	if (hash_desc == &sha256_desc) {
+		key_state->stitch = aesni_ctr_sha256_stitch;
+	}
+#endif
+	if (hash_desc == &sha1_desc) {
+		key_state->stitch = aesni_ctr_sha1_stitch;
+	}
+#else
+	(void)key_state;
+#endif
+}
+
+/* Whether a packet of len bytes should go through the stitched kernel.
+ * The keystream must start on a fresh counter block */
+static int use_stitch(struct key_context_directional *key_state, unsigned int len) {
+	return key_state->stitch
+		&& len >= CTR_HMAC_STITCH_MIN_LEN
+		&& key_state->cipher_state.ctr.padlen == key_state->cipher_state.ctr.blocklen;
+}
+
+/* Encrypt or decrypt data[crypt_off,len) in place and HMAC the sequence
+ * number and the plaintext data[0,len), with the kernel from
+ * mac_stitch_init(). The first hash block holds the sequence number, so
+ * the hash runs 60 bytes ahead of the cipher when encrypting, reading
+ * each block before it is overwritten. When decrypting the cipher is
+ * first taken a step past the hash so the hash only sees plaintext. */
+static void stitch_crypt_mac(unsigned int seqno, struct key_context_directional *key_state,
+		unsigned char *data, unsigned int len, unsigned int crypt_off,
+		int direction, unsigned char *output_mac) {
+	const struct ltc_hash_descriptor *hash_desc = key_state->algo_mac->hash_desc;
+	symmetric_CTR *ctr = &key_state->cipher_state.ctr;
+	unsigned char seqbuf[4];
+	unsigned int hash_off, steps;
+	hash_state md;
+
+	hash_off = hash_desc->blocksize - sizeof(seqbuf);
+	if (direction == DROPBEAR_DECRYPT) {
+		if (ctr_decrypt(data + crypt_off, data + crypt_off,
+				2*hash_desc->blocksize - crypt_off, ctr) != CRYPT_OK) {
+			dropbear_exit("Error decrypting");
 		}
-	
-		/* sequence number */
-		STORE32H(seqno, seqbuf);
-		if (hmac_process(&hmac, seqbuf, 4) != CRYPT_OK) {
+		crypt_off = 2*hash_desc->blocksize;
+	}
+
+	STORE32H(seqno, seqbuf);
+	md = key_state->mac_inner;
+	if (hash_desc->process(&md, seqbuf, sizeof(seqbuf)) != CRYPT_OK
+		|| hash_desc->process(&md, data, hash_off) != CRYPT_OK) {
+		dropbear_exit("HMAC error");
+	}
+
+	steps = (len - MAX(crypt_off, hash_off)) / hash_desc->blocksize;
+	if (key_state->stitch(data + crypt_off, data + crypt_off, data + hash_off,
+			steps, ctr->ctr, ctr->mode, &ctr->key, &md) != CRYPT_OK) {
+		dropbear_exit("Error encrypting");
+	}
+	crypt_off += steps * hash_desc->blocksize;
+	hash_off += steps * hash_desc->blocksize;
+
+	/* the rest separately, the hash first when encrypting in place */
+	if (direction == DROPBEAR_ENCRYPT) {
+		if (hash_desc->process(&md, data + hash_off, len - hash_off) != CRYPT_OK) {
 			dropbear_exit("HMAC error");
 		}
-	
-		/* the actual contents */
-		buf_setpos(clear_buf, 0);
-		if (hmac_process(&hmac, 
-					buf_getptr(clear_buf, clear_len),
-					clear_len) != CRYPT_OK) {
-			dropbear_exit("HMAC error");
+		if (ctr_encrypt(data + crypt_off, data + crypt_off, len - crypt_off, ctr) != CRYPT_OK) {
+			dropbear_exit("Error encrypting");
 		}
-	
-		bufsize = MAX_MAC_LEN;
-		if (hmac_done(&hmac, output_mac, &bufsize) != CRYPT_OK) {
+	} else {
+		if (ctr_decrypt(data + crypt_off, data + crypt_off, len - crypt_off, ctr) != CRYPT_OK) {
+			dropbear_exit("Error decrypting");
+		}
+		if (hash_desc->process(&md, data + hash_off, len - hash_off) != CRYPT_OK) {
 			dropbear_exit("HMAC error");
 		}
 	}
-	TRACE2(("leave writemac"))
+
+	hmac_finish(key_state, &md, output_mac);
+}
+#endif /* DROPBEAR_ENABLE_CTR_MODE */
+
+/* MAC and encrypt the packets that encrypt_packet() left framed in the
+ * writequeue. This must be called before they are written out, and
+ * before the transmit keys change */
+void mac_batch_flush() {
+#if DROPBEAR_MAC_BATCH
+	struct key_context_directional *key_state = &ses.keys->trans;
+	unsigned char macs[MAC_BATCH_MAX][MAX_HASH_SIZE];
+	struct mac_batch_packet *batch;
+	unsigned int count = ses.mac_batch_count, i;
+	unsigned char mac_size;
+	buffer packet;
+
+	if (count == 0) {
+		return;
+	}
+	ses.mac_batch_count = 0;
+	mac_size = key_state->algo_mac->hashsize;
+
+	if (count == 1) {
+		/* no other lanes to fill */
+		batch = &ses.mac_batch[0];
+		buf_subview(&packet, ses.writequeue, ses.writequeue->pos + batch->offset,
+				batch->len + mac_size);
+		buf_setlen(&packet, batch->len);
+		seal_packet(&packet, batch->seqno);
+		return;
+	}
+
+	if (key_state->algo_mac->etm) {
+		for (i = 0; i < count; i++) {
+			batch = &ses.mac_batch[i];
+			buf_subview(&packet, ses.writequeue,
+					ses.writequeue->pos + batch->offset + 4, batch->len - 4);
+			if (key_state->crypt_mode->encrypt(
+						buf_getwriteptr(&packet, batch->len - 4),
+						buf_getwriteptr(&packet, batch->len - 4),
+						batch->len - 4,
+						&key_state->cipher_state) != CRYPT_OK) {
+				dropbear_exit("Error encrypting");
+			}
+		}
+	}
+
+	mac_batch_hmac(key_state, count, macs);
+
+	for (i = 0; i < count; i++) {
+		batch = &ses.mac_batch[i];
+		buf_subview(&packet, ses.writequeue, ses.writequeue->pos + batch->offset,
+				batch->len + mac_size);
+		buf_setlen(&packet, batch->len);
+		if (!key_state->algo_mac->etm) {
+			if (key_state->crypt_mode->encrypt(
+						buf_getwriteptr(&packet, batch->len),
+						buf_getwriteptr(&packet, batch->len),
+						batch->len,
+						&key_state->cipher_state) != CRYPT_OK) {
+				dropbear_exit("Error encrypting");
+			}
+		}
+		buf_setpos(&packet, batch->len);
+		buf_putbytes(&packet, macs[i], mac_size);
+	}
+	m_burn(macs, sizeof(macs));
+#endif
+}
+
+#if DROPBEAR_MAC_BATCH
+/* Block k of the HMAC inner hash for a queued packet, after the ipad
+ * block: the sequence number, the packet and the SHA padding. Blocks
+ * wholly inside the packet are used in place, others are put together
+ * in scratch */
+static const unsigned char* mac_batch_block(const struct mac_batch_packet *batch,
+		const unsigned char *data, unsigned int k, unsigned char *scratch) {
+	unsigned int start = 64*k, total, i, v;
+
+	if (start >= 4 && start + 64 <= 4 + batch->len) {
+		return data + start - 4;
+	}
+
+	for (i = 0; i < 64; i++) {
+		v = start + i;
+		if (v < 4) {
+			scratch[i] = (batch->seqno >> (8 * (3 - v))) & 0xff;
+		} else if (v < 4 + batch->len) {
+			scratch[i] = data[v - 4];
+		} else if (v == 4 + batch->len) {
+			scratch[i] = 0x80;
+		} else {
+			scratch[i] = 0;
+		}
+	}
+	total = (4 + batch->len + 9 + 63) / 64;
+	if (k == total - 1) {
+		/* bits hashed including the ipad block */
+		STORE64H((ulong64)(64 + 4 + batch->len) * 8, scratch + 56);
+	}
+	return scratch;
+}
+
+/* HMAC of each queued packet, the multi-buffer hash runs one packet in
+ * each lane. macs[i] gets the full digest */
+static void mac_batch_hmac(struct key_context_directional *key_state,
+		unsigned int count, unsigned char macs[][MAX_HASH_SIZE]) {
+	static const unsigned char zero_block[64];
+	const struct ltc_hash_descriptor *hash_desc = key_state->algo_mac->hash_desc;
+	void (*compress)(sha_mb_state *st, const unsigned char *const blocks[SHA_MB_LANES],
+			unsigned int active) = NULL;
+	const unsigned int words = hash_desc->hashsize / 4;
+	unsigned char scratch[MAC_BATCH_MAX][64];
+	const unsigned char *blocks[SHA_MB_LANES];
+	unsigned int nblocks[MAC_BATCH_MAX];
+	unsigned int maxblocks = 0, active, i, k, w;
+	const unsigned char *queued;
+	const hash_state *init;
+	sha_mb_state st;
+
+#if DROPBEAR_SHA2_256_HMAC
+	if (hash_desc == &sha256_desc) {
+		compress = sha256_mb_compress;
+	}
+#endif
+	if (hash_desc == &sha1_desc) {
+		compress = sha1_mb_compress;
+	}
+	dropbear_assert(compress != NULL);
+
+	/* inner hash, from the state after the ipad block */
+	queued = buf_getptr(ses.writequeue, ses.writequeue->len - ses.writequeue->pos);
+	init = &key_state->mac_inner;
+	for (i = 0; i < count; i++) {
+		nblocks[i] = (4 + ses.mac_batch[i].len + 9 + 63) / 64;
+		maxblocks = MAX(maxblocks, nblocks[i]);
+		for (w = 0; w < words; w++) {
+			st.h[w][i] = hash_desc == &sha1_desc ? init->sha1.state[w] : init->sha256.state[w];
+		}
+	}
+	for (k = 0; k < maxblocks; k++) {
+		active = 0;
+		for (i = 0; i < SHA_MB_LANES; i++) {
+			blocks[i] = zero_block;
+			if (i < count && k < nblocks[i]) {
+				blocks[i] = mac_batch_block(&ses.mac_batch[i],
+						queued + ses.mac_batch[i].offset, k, scratch[i]);
+				active |= 1 << i;
+			}
+		}
+		compress(&st, blocks, active);
+	}
+
+	/* outer hash of the inner digest, one block */
+	init = &key_state->mac_outer;
+	active = 0;
+	for (i = 0; i < count; i++) {
+		memset(scratch[i], 0x0, 64);
+		for (w = 0; w < words; w++) {
+			STORE32H(st.h[w][i], scratch[i] + 4*w);
+			st.h[w][i] = hash_desc == &sha1_desc ? init->sha1.state[w] : init->sha256.state[w];
+		}
+		scratch[i][4*words] = 0x80;
+		STORE64H((ulong64)(64 + 4*words) * 8, scratch[i] + 56);
+		blocks[i] = scratch[i];
+		active |= 1 << i;
+	}
+	compress(&st, blocks, active);
+
+	for (i = 0; i < count; i++) {
+		for (w = 0; w < words; w++) {
+			STORE32H(st.h[w][i], macs[i] + 4*w);
+		}
+	}
+	m_burn(&st, sizeof(st));
+	m_burn(scratch, sizeof(scratch));
 }
+#endif /* DROPBEAR_MAC_BATCH */
 
 #ifndef DISABLE_ZLIB
 /* compresses len bytes from src, outputting to dest (starting from the
  * respective current positions. dest must have sufficient space,
- * len+ZLIB_COMPRESS_EXPANSION */
+ * len+ZLIB_COMPRESS_EXPANSION(len) */
 static void buf_compress(buffer * dest, buffer * src, unsigned int len) {
 
 	unsigned int endpos = src->pos + len;
@@ -664,7 +1518,7 @@ static void buf_compress(buffer * dest, buffer * src, unsigned int len) {
 
 	TRACE2(("enter buf_compress"))
 
-	dropbear_assert(dest->size - dest->pos >= len+ZLIB_COMPRESS_EXPANSION);
+	dropbear_assert(dest->size - dest->pos >= len+ZLIB_COMPRESS_EXPANSION(len));
 
 	ses.keys->trans.zstream->avail_in = endpos - src->pos;
 	ses.keys->trans.zstream->next_in = 
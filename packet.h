@@ -27,15 +27,60 @@
 #define DROPBEAR_PACKET_H_
 
 #include "includes.h"
-#include "queue.h"
 #include "buffer.h"
 
 void write_packet(void);
 void read_packet(void);
+int packet_readahead_pending(void);
 void decrypt_packet(void);
 void encrypt_packet(void);
 
-void writebuf_enqueue(buffer * writebuf, unsigned char packet_type);
+void writequeue_reserve(unsigned int len);
+void writequeue_consume(unsigned int len);
+void writequeue_putbytes(const unsigned char *bytes, unsigned int len);
+unsigned int send_queue_len(void);
+unsigned int send_queue_limit(void);
+int writequeue_has_space(void);
+void update_send_queue(void);
+
+#if DROPBEAR_TX_ZEROCOPY
+/* A writequeue buffer that MSG_ZEROCOPY sends numbered first to next-1
+ * were made from. It can't be changed or freed until the kernel has
+ * completed all of them */
+struct zerocopy_buf {
+	buffer *buf;
+	uint32_t first, next;
+	unsigned int outstanding;
+};
+
+void zerocopy_reap(void);
+void zerocopy_cleanup(void);
+#endif
+
+/* Outgoing HMAC-SHA-256/SHA-1 packets are MACed several at a time with
+ * the multi-buffer hashes where the CPU has them */
+#ifdef LTC_SHA_MB
+#define DROPBEAR_MAC_BATCH 1
+#define MAC_BATCH_MAX SHA_MB_LANES
+#else
+#define DROPBEAR_MAC_BATCH 0
+#endif
+
+#if DROPBEAR_MAC_BATCH
+/* A packet framed in the writequeue, waiting for mac_batch_flush() */
+struct mac_batch_packet {
+	unsigned int offset; /* from the writequeue's pos */
+	unsigned int len; /* not including the MAC */
+	unsigned int seqno;
+};
+#endif
+void mac_batch_flush(void);
+
+struct key_context_directional;
+void mac_key_init(struct key_context_directional *key_state);
+void mac_iovec(unsigned int seqno, struct key_context_directional *key_state,
+		const struct iovec *iov, unsigned int iovcnt,
+		unsigned char *output_mac);
 
 void process_packet(void);
 
@@ -49,5 +94,10 @@ typedef struct PacketType {
 #define PACKET_PAYLOAD_OFF 5
 
 #define INIT_READBUF 128
+/* Room for a few full size packets, it grows if more are queued */
+#define INIT_WRITEQUEUE (4*(TRANS_MAX_PAYLOAD_LEN+256))
+/* A writequeue grown past this goes back to INIT_WRITEQUEUE once it
+ * drains, unless it is still being filled past INIT_WRITEQUEUE */
+#define WRITEQUEUE_SHRINK_LEN (2*INIT_WRITEQUEUE)
 
 #endif /* DROPBEAR_PACKET_H_ */
@@ -154,7 +154,7 @@ void process_packet() {
 	recv_unimplemented();
 
 out:
-	buf_free(ses.payload);
+	buf_pool_free(ses.payload);
 	ses.payload = NULL;
 
 	TRACE2(("leave process_packet"))
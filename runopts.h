@@ -38,6 +38,10 @@ typedef struct runopts {
 	int listen_fwd_all;
 #endif
 	unsigned int recv_window;
+	/* largest SSH payload to receive (as advertised for channels),
+	 * and to send if the peer allows */
+	unsigned int recv_max_payload;
+	unsigned int trans_max_payload;
 	time_t keepalive_secs; /* Time between sending keepalives. 0 is off */
 	time_t idle_timeout_secs; /* Exit if no traffic is sent/received in this time */
 	int usingsyslog;
@@ -176,5 +180,6 @@ void parse_ciphers_macs(void);
 #endif
 
 void print_version(void);
+void parse_max_payload(const char *arg);
 
 #endif /* DROPBEAR_RUNOPTS_H_ */
@@ -32,13 +32,15 @@
 #include "kex.h"
 #include "auth.h"
 #include "channel.h"
-#include "queue.h"
 #include "listener.h"
 #include "packet.h"
 #include "tcpfwd.h"
 #include "chansession.h"
 #include "dbutil.h"
 #include "netio.h"
+#include "chachapoly.h"
+#include "gcm.h"
+#include "ctrmt.h"
 
 extern int sessinitdone; /* Is set to 0 somewhere */
 extern int exitflag;
@@ -81,9 +83,36 @@ struct key_context_directional {
 		symmetric_CBC cbc;
 #if DROPBEAR_ENABLE_CTR_MODE
 		symmetric_CTR ctr;
+#endif
+#if DROPBEAR_CHACHA20POLY1305
+		dropbear_chachapoly_state chachapoly;
+#endif
+#if DROPBEAR_ENABLE_GCM_MODE
+		dropbear_gcm_state gcm;
+#endif
+#if DROPBEAR_CTR_THREADS
+		dropbear_ctrmt_state ctrmt;
 #endif
 	} cipher_state;
 	unsigned char mackey[MAX_MAC_LEN];
+	/* HMAC hash states after the ipad and opad blocks, set up once
+	 * by mac_key_init() and copied for each packet */
+	hash_state mac_inner, mac_outer;
+#if DROPBEAR_UMAC
+	umac_state umac;
+#endif
+#if DROPBEAR_ENABLE_CTR_MODE
+	/* AES-CTR and HMAC in one pass for encrypt-and-MAC, NULL unless
+	 * mac_key_init() found a kernel for the pair */
+	int (*stitch)(const unsigned char *in, unsigned char *out,
+			const unsigned char *hin, unsigned long steps,
+			unsigned char *IV, int mode, symmetric_key *skey,
+			hash_state *md);
+#endif
+#if DROPBEAR_MAC_BATCH
+	/* outgoing packets are queued for mac_batch_flush() */
+	int mac_batch;
+#endif
 	int valid;
 };
 
@@ -130,8 +159,32 @@ struct sshsession {
 	buffer *writepayload; /* Unencrypted payload to write - this is used
 							 throughout the code, as handlers fill out this
 							 buffer with the packet to send. */
-	struct Queue writequeue; /* A queue of encrypted packets to send */
+	buffer *writequeue; /* Encrypted packets to send, contiguous from pos to len */
 	unsigned int writequeue_len; /* Number of bytes pending to send in writequeue */
+	unsigned int writequeue_peak; /* Most bytes pending since it last drained */
+#if SEND_QUEUE_DELAY_MS
+	/* Whether sock_out is a TCP socket that reports its unsent data */
+	int send_paced;
+	unsigned int sock_unsent; /* Written to sock_out, not yet sent by the kernel */
+	unsigned int send_queue_limit; /* Allowed writequeue_len + sock_unsent */
+	uint64_t send_tune_time; /* monotonic_now_us() of the last rate measurement */
+#endif
+#if DROPBEAR_TX_ZEROCOPY
+	int zerocopy; /* MSG_ZEROCOPY is used on sock_out, -1 until tried */
+	uint32_t zerocopy_seq; /* Number of the next zerocopy send */
+	/* Buffers with zerocopy sends in progress, the last may be the
+	 * current writequeue */
+	struct zerocopy_buf zerocopy_bufs[TX_ZEROCOPY_MAX_BUFFERS];
+	unsigned int zerocopy_count;
+	buffer *zerocopy_spare; /* A completed buffer for the next writequeue */
+#endif
+#if DROPBEAR_MAC_BATCH
+	/* Framed packets at the end of the writequeue still to be MACed and
+	 * encrypted, they are counted in writequeue_len */
+	struct mac_batch_packet mac_batch[MAC_BATCH_MAX];
+	unsigned int mac_batch_count;
+#endif
+	buffer *readahead; /* Read from the wire but not yet part of readbuf */
 	buffer *readbuf; /* From the wire, decrypted in-place */
 	buffer *payload; /* Post-decompression, the actual SSH packet. 
 						May have extra data at the beginning, will be
@@ -202,8 +255,33 @@ struct sshsession {
 	struct Channel ** channels; /* these pointers may be null */
 	unsigned int chansize; /* the number of Channel*s allocated for channels */
 	unsigned int chancount; /* the number of Channel*s in use */
+	unsigned int *chan_free; /* unused indexes of channels, a stack */
+	unsigned int chan_freecount;
+	struct Channel ** chan_active; /* the chancount channels in use, unordered */
+	/* number of channels at each priority, excluding PRIO_EARLY */
+	unsigned int chan_prio_count[DROPBEAR_CHANNEL_PRIO_EARLY];
 	const struct ChanType **chantypes; /* The valid channel types */
 	int channel_signal_pending; /* Flag set by sigchld handler */
+	/* Channels whose fd events need updating, by index. If it fills up
+	 * (or reads are enabled/disabled) every channel is updated */
+	unsigned int *chan_dirty;
+	unsigned int chan_dirtycount;
+	int chan_events_all;
+	int chan_reads_allowed;
+	unsigned int chan_io_round; /* to handle each ready channel once in channelio() */
+	/* Non-interactive channels with data to send, taking turns */
+	struct Channel *chan_txq;
+	unsigned int chan_txqcount;
+	/* Interactive channels holding back output to send it together */
+	struct Channel *chan_held;
+	/* Exited channels waiting briefly for more output */
+	struct Channel *chan_flush;
+#if DROPBEAR_RECV_WINDOW_AUTOTUNE
+	/* How much receive windows have grown past opts.recv_window in total,
+	 * and whether a channel couldn't grow because of that */
+	unsigned int chan_window_grown;
+	int chan_window_pressure;
+#endif
 
 	/* TCP priority level for the main "port 22" tcp socket */
 	enum dropbear_prio socket_prio;
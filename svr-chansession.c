@@ -705,7 +705,7 @@ static int sessioncommand(struct Channel *channel, struct ChanSess *chansess,
 		ret = noptycommand(channel, chansess);
 		if (ret == DROPBEAR_SUCCESS) {
 			channel->prio = DROPBEAR_CHANNEL_PRIO_BULK;
-			update_channel_prio();
+			channel_prio_changed(channel);
 		}
 	} else {
 		/* want pty */
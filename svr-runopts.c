@@ -91,6 +91,7 @@ static void printhelp(const char * progname) {
 					"-i		Start for inetd\n"
 #endif
 					"-W <receive_window_buffer> (default %d, larger may be faster, max 1MB)\n"
+					"-M <max_packet>  (default %d, larger may be faster, max %d)\n"
 					"-K <keepalive>  (0 is never, default %d, in seconds)\n"
 					"-I <idle_timeout>  (0 is never, default %d, in seconds)\n"
 					"-V    Version\n"
@@ -108,7 +109,8 @@ static void printhelp(const char * progname) {
 					ECDSA_PRIV_FILENAME,
 #endif
 					DROPBEAR_MAX_PORTS, DROPBEAR_DEFPORT, DROPBEAR_PIDFILE,
-					DEFAULT_RECV_WINDOW, DEFAULT_KEEPALIVE, DEFAULT_IDLE_TIMEOUT);
+					DEFAULT_RECV_WINDOW, RECV_MAX_PAYLOAD_LEN, MAX_JUMBO_PAYLOAD_LEN,
+					DEFAULT_KEEPALIVE, DEFAULT_IDLE_TIMEOUT);
 }
 
 void svr_getopts(int argc, char ** argv) {
@@ -117,6 +119,7 @@ void svr_getopts(int argc, char ** argv) {
 	char ** next = 0;
 	int nextisport = 0;
 	char* recv_window_arg = NULL;
+	char* max_payload_arg = NULL;
 	char* keepalive_arg = NULL;
 	char* idle_timeout_arg = NULL;
 	char* keyfile = NULL;
@@ -159,6 +162,8 @@ void svr_getopts(int argc, char ** argv) {
 	opts.usingsyslog = 1;
 #endif
 	opts.recv_window = DEFAULT_RECV_WINDOW;
+	opts.recv_max_payload = RECV_MAX_PAYLOAD_LEN;
+	opts.trans_max_payload = TRANS_MAX_PAYLOAD_LEN;
 	opts.keepalive_secs = DEFAULT_KEEPALIVE;
 	opts.idle_timeout_secs = DEFAULT_IDLE_TIMEOUT;
 	
@@ -229,6 +234,9 @@ void svr_getopts(int argc, char ** argv) {
 				case 'W':
 					next = &recv_window_arg;
 					break;
+				case 'M':
+					next = &max_payload_arg;
+					break;
 				case 'K':
 					next = &keepalive_arg;
 					break;
@@ -331,6 +339,10 @@ void svr_getopts(int argc, char ** argv) {
 			dropbear_exit("Bad recv window '%s'", recv_window_arg);
 		}
 	}
+
+	if (max_payload_arg) {
+		parse_max_payload(max_payload_arg);
+	}
 	
 	if (keepalive_arg) {
 		unsigned int val;
@@ -84,7 +84,11 @@
 #define MD5_HASH_SIZE 16
 #define MAX_HASH_SIZE 64 /* sha512 */
 
+#if DROPBEAR_CHACHA20POLY1305
+#define MAX_KEY_LEN 64 /* 2 x 256 bits for chacha20 */
+#else
 #define MAX_KEY_LEN 32 /* 256 bits for aes256 etc */
+#endif
 #define MAX_IV_LEN 20 /* must be same as max blocksize,  */
 
 #if DROPBEAR_SHA2_512_HMAC
@@ -140,14 +144,15 @@
 /* From transport rfc */
 #define MIN_PACKET_LEN 16
 
-#define RECV_MAX_PACKET_LEN (MAX(35000, ((RECV_MAX_PAYLOAD_LEN)+100)))
+/* the largest -M */
+#define MAX_JUMBO_PAYLOAD_LEN (256*1024)
 
 /* for channel code */
 #define TRANS_MAX_WINDOW 500000000 /* 500MB is sufficient, stopping overflow */
 #define TRANS_MAX_WIN_INCR 500000000 /* overflow prevention */
 
-#define RECV_WINDOWEXTEND (opts.recv_window / 3) /* We send a "window extend" every
-								RECV_WINDOWEXTEND bytes */
+#define RECV_WINDOWEXTEND(channel) ((channel)->recvwindowsize / 3) /* We send a
+						"window extend" every RECV_WINDOWEXTEND bytes */
 #define MAX_RECV_WINDOW (2 * 1024 * 1024) /* 2 MB is what OpenSSH uses */
 
 #define MAX_CHANNELS 1000 /* simple mem restriction, includes each tcp/x11
@@ -177,10 +182,26 @@
 												auth */
 
 
-#define DROPBEAR_AES ((DROPBEAR_AES256) || (DROPBEAR_AES128))
+/* UMAC is built on AES */
+#define DROPBEAR_AES ((DROPBEAR_AES256) || (DROPBEAR_AES128) || (DROPBEAR_UMAC))
+
+/* Ciphers which provide their own integrity check rather than using a MAC */
+#define DROPBEAR_AEAD_MODE ((DROPBEAR_CHACHA20POLY1305) || (DROPBEAR_ENABLE_GCM_MODE))
 
 #define DROPBEAR_TWOFISH ((DROPBEAR_TWOFISH256) || (DROPBEAR_TWOFISH128))
 
+#if !defined(HAVE_PTHREAD) || !DROPBEAR_ENABLE_CTR_MODE
+#undef DROPBEAR_CTR_THREADS
+#define DROPBEAR_CTR_THREADS 0
+#endif
+
+#if DROPBEAR_CTR_THREADS
+/* Keystream is generated in CTR_MT_BUFFERS buffers of CTR_MT_BUFFER_LEN
+ * bytes, so up to 512kB ahead of where it is used */
+#define CTR_MT_BUFFERS 8
+#define CTR_MT_BUFFER_LEN 65536
+#endif
+
 #define DROPBEAR_CLI_ANYTCPFWD ((DROPBEAR_CLI_REMOTETCPFWD) || (DROPBEAR_CLI_LOCALTCPFWD))
 
 #define DROPBEAR_TCP_ACCEPT ((DROPBEAR_CLI_LOCALTCPFWD) || (DROPBEAR_SVR_REMOTETCPFWD))
@@ -262,4 +283,44 @@
 #define DROPBEAR_CLIENT_TCP_FAST_OPEN 0
 #endif
 
+/* The session event loop uses epoll where available, select() otherwise */
+#if defined(__linux__) && defined(HAVE_SYS_EPOLL_H)
+#define DROPBEAR_EPOLL 1
+#else
+#define DROPBEAR_EPOLL 0
+#endif
+
+#ifndef __linux__
+#undef DROPBEAR_CBUF_DOUBLE_MAP
+#define DROPBEAR_CBUF_DOUBLE_MAP 0
+#undef SEND_QUEUE_DELAY_MS
+#define SEND_QUEUE_DELAY_MS 0
+#undef DROPBEAR_TX_ZEROCOPY
+#define DROPBEAR_TX_ZEROCOPY 0
+#endif
+
+#if SEND_QUEUE_DELAY_MS
+/* Bounds for the session socket's send queue limit. The rate is measured
+ * again every SEND_QUEUE_TUNE_US */
+#define SEND_QUEUE_MIN_LEN (2*TRANS_MAX_PAYLOAD_LEN)
+#define SEND_QUEUE_MAX_LEN (1024*1024)
+#define SEND_QUEUE_TUNE_US 100000
+/* Largest socket buffer that is set from the bandwidth delay product */
+#define SOCK_BUFFER_MAX (16*1024*1024)
+#endif
+
+#if DROPBEAR_TX_ZEROCOPY
+/* Smaller writes are copied, pinning pages costs more than copying them.
+ * At most TX_ZEROCOPY_MAX_BUFFERS writequeue buffers can be waiting for
+ * the kernel before writes fall back to copying */
+#define TX_ZEROCOPY_MIN_LEN (4*TRANS_MAX_PAYLOAD_LEN)
+#define TX_ZEROCOPY_MAX_BUFFERS 8
+#endif
+
+#if DROPBEAR_ENABLE_CTR_MODE
+/* Shorter encrypt-and-MAC packets don't go through the stitched AES-CTR
+ * and HMAC kernel, it needs a few hash blocks to be worthwhile */
+#define CTR_HMAC_STITCH_MIN_LEN 256
+#endif
+
 /* no include guard for this file */